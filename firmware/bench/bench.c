@@ -0,0 +1,135 @@
+/*
+* Cycle bench for the firmware under ucsim (s51).
+*
+* Builds smbusb_firmware.c with this driver in place of its main loop and
+* runs every case below through handle_vendorcommand. The registers are
+* plain memory in the simulator: I2CS is preset to DONE|ACK so every byte
+* is ACKed at once, I2DAT is what every read returns and the OUT data
+* stages are EP0BUF handed over again for every packet. The bit-banged
+* pins read back as nobody else being on the bus, what isn't pulled low
+* is high. That leaves what the firmware itself spends on each request,
+* which is what the bench is for.
+*
+* bench.py breaks on bench_begin/bench_end and writes the cycle table.
+*/
+
+#define SMB_BENCH
+
+#define BENCH_STOP_DONE() I2CS &= ~bmSTOP	// no I2C engine to finish it
+#define BENCH_OUT_LEN(bcl,got) bench_out_len(got)
+#define BENCH_BB_IN(pins) (bb_portd ? ~OED : ~OEB)
+
+#include <fx2regs.h>
+
+WORD bench_out_len(WORD got);
+
+#include "../smbusb_firmware.c"
+
+struct bench_case {
+	BYTE cmd;
+	WORD value;
+	WORD index;
+	WORD length;	// wLength, the OUT data stage length for OUT requests
+	BYTE i2dat;	// every byte read returns this, a block read's blocksz too
+	BYTE pec;	// SMB_ENABLE_PEC mode
+};
+
+// CASE(name, ...) the name is only for bench.py, it picks it up from here
+#define CASE(name,cmd,value,index,length,i2dat,pec) {cmd,value,index,length,i2dat,pec}
+
+__code struct bench_case cases[] = {
+	CASE(send_byte,		SMB_SEND_BYTE,		0x16, 0x08, 0,   0,    0),
+	CASE(read_byte,		SMB_READ_BYTE,		0x16, 0x08, 3,   0x5A, 0),
+	CASE(read_byte_pec,	SMB_READ_BYTE,		0x16, 0x08, 3,   0x5A, 1),
+	CASE(read_byte_hostpec,	SMB_READ_BYTE,		0x16, 0x08, 4,   0x5A, 2),
+	CASE(write_byte,	SMB_WRITE_BYTE,		0x16, 0x08, 1,   0,    0),
+	CASE(write_byte_pec,	SMB_WRITE_BYTE,		0x16, 0x08, 1,   0,    1),
+	CASE(read_word,		SMB_READ_WORD,		0x16, 0x09, 4,   0x5A, 0),
+	CASE(read_word_pec,	SMB_READ_WORD,		0x16, 0x09, 4,   0x5A, 1),
+	CASE(write_word,	SMB_WRITE_WORD,		0x16, 0x09, 2,   0,    0),
+	CASE(write_word_pec,	SMB_WRITE_WORD,		0x16, 0x09, 2,   0,    1),
+	CASE(process_call_pec,	SMB_PROCESS_CALL,	0x0016|(0x44<<8), 0x1234, 4, 0x5A, 1),
+	CASE(read_words_8_pec,	SMB_READ_WORDS,		0x16, 0x00|(8<<8),  2+8*3,  0x5A, 1),
+	CASE(read_words_32_pec,	SMB_READ_WORDS,		0x16, 0x00|(32<<8), 2+32*3, 0x5A, 1),
+	// the list is staged like the host does it, once for all the requests that read from it.
+	// The first one after the stage takes it over, the list cases start LIST_MAX-n entries in to read n commands
+	CASE(stage_word_list,SMB_STAGE_WRITE,	0,    0,    LIST_MAX, 0x16, 0),
+	CASE(read_word_list_1_pec,	SMB_READ_WORD_LIST,	0x16, LIST_MAX-1,  2+1*3,  0x5A, 1),
+	CASE(read_word_list_8_pec,	SMB_READ_WORD_LIST,	0x16, LIST_MAX-8,  2+8*3,  0x5A, 1),
+	CASE(read_word_list_32_pec,	SMB_READ_WORD_LIST,	0x16, LIST_MAX-32, 2+32*3, 0x5A, 1),
+	CASE(read_word_list_64_hostpec,SMB_READ_WORD_LIST,	0x16, LIST_MAX-64, 2+64*4, 0x5A, 2),
+	CASE(read_block_4,	SMB_READ_BLOCK,		0x16, 0x20, 258, 4,    0),
+	CASE(read_block_32,	SMB_READ_BLOCK,		0x16, 0x20, 258, 32,   0),
+	CASE(read_block_32_pec,	SMB_READ_BLOCK,		0x16, 0x20, 258, 32,   1),
+	CASE(stage_block_list,SMB_STAGE_WRITE,	0,    0,    LIST_MAX, 0x16, 0),
+	CASE(read_block_list_1x32,SMB_READ_BLOCK_LIST,	0x16, LIST_MAX-1, 258, 32,   0),
+	CASE(read_block_list_4x32,SMB_READ_BLOCK_LIST,	0x16, LIST_MAX-4, 258, 32,   0),
+	CASE(read_block_list_7x32,SMB_READ_BLOCK_LIST,	0x16, LIST_MAX-7, 258, 32,   0),
+	CASE(write_block_16,	SMB_WRITE_BLOCK,	0x16, 0x20, 17,  0,    0),
+	CASE(write_block_64,	SMB_WRITE_BLOCK,	0x16, 0x20, 65,  0,    0),
+	CASE(write_block_64_pec,SMB_WRITE_BLOCK,	0x16, 0x20, 65,  0,    1),
+	CASE(raw_read_16,	SMB_READ,		16,   SMB_READ_CMD_FIRST_READ|SMB_READ_CMD_LAST_READ, 2+16,  0x5A, 0),
+	CASE(raw_read_128,	SMB_READ,		128,  SMB_READ_CMD_FIRST_READ|SMB_READ_CMD_LAST_READ, 2+128, 0x5A, 0),
+	CASE(raw_write_16,	SMB_WRITE,		16,   SMB_WRITE_CMD_START_FIRST|SMB_WRITE_CMD_STOP_AFTER, 16,  0, 0),
+	CASE(raw_write_128,	SMB_WRITE,		128,  SMB_WRITE_CMD_START_FIRST|SMB_WRITE_CMD_STOP_AFTER, 128, 0, 0),
+	// ep0_receive and the skip map load, the xcopy paths without a bus transaction behind them
+	CASE(stage_write_16,	SMB_STAGE_WRITE,	0,    0,    16,  0,    0),
+	CASE(stage_write_128,	SMB_STAGE_WRITE,	0,    0,    128, 0,    0),
+	CASE(set_scan_skip,	SMB_SET_SCAN_SKIP,	0,    0,    32,  0,    0),
+	CASE(write_read_16_pec,	SMB_WRITE_READ,		0x16|(1<<8), 0x00, 2+16,  0x5A, 1),
+	CASE(write_read_128_pec,SMB_WRITE_READ,		0x16|(1<<8), 0x00, 2+128, 0x5A, 1),
+	CASE(scan_address_ack,	SMB_SCAN_ADDRESS_ACK,	0x08|(0x77<<8), 0, 2+32, 0, 0),
+	CASE(scan_command_ack,	SMB_SCAN_COMMAND_ACK,	0x16, 0x00|(0xFF<<8), 2+32, 0, 0),
+	// bit-banged bus 1 from here on. Nothing answers on it, so a read is START, 
+	// 9 clocks for the NAKed address and STOP: the clocks give the SCL period
+	CASE(bb_select_1,	SMB_SELECT_BUS,		1,    0,    0,   0,    0),
+	CASE(bb_read_word_nak,	SMB_READ_WORD,		0x16, 0x09, 4,   0,    0),
+	CASE(bb_read_word_multi_4_nak,SMB_READ_WORD_MULTI,0x16|(0x0F<<8), 0x09, 2+4*3, 0, 0),
+	CASE(bb_recover_idle,	SMB_RECOVER_BUS,	0,    0,    0,   0,    0)
+};
+
+#define CASES (sizeof(cases)/sizeof(cases[0]))
+
+volatile __data WORD out_len;
+
+/*
+The OUT data stage comes in 64 byte packets of whatever is in EP0BUF.
+*/
+WORD bench_out_len(WORD got) {
+	return out_len-got > 64 ? 64 : out_len-got;
+}
+
+// breakpoints for bench.py, they have to stay real calls
+void bench_begin() {}
+void bench_end() {}
+void bench_done() {}
+
+void main() {
+	BYTE i;
+
+	// the breakpoint to breakpoint overhead with nothing in between
+	bench_begin();
+	bench_end();
+
+	for (i=0;i<CASES;i++) {
+		SETUPDAT[2] = LSB(cases[i].value);
+		SETUPDAT[3] = MSB(cases[i].value);
+		SETUPDAT[4] = LSB(cases[i].index);
+		SETUPDAT[5] = MSB(cases[i].index);
+		SETUPDAT[6] = LSB(cases[i].length);
+		SETUPDAT[7] = MSB(cases[i].length);
+		out_len = cases[i].length;
+		EP0BUF[0] = cases[i].length-1;	// blocksz for SMB_WRITE_BLOCK
+		EP0CS = 0;
+		I2CS = bmDONE | bmACK;
+		I2DAT = cases[i].i2dat;
+		pec_enabled = cases[i].pec > 0;
+		pec_host = cases[i].pec == SMB_PEC_HOST;
+
+		bench_begin();
+		handle_vendorcommand(cases[i].cmd);
+		bench_end();
+	}
+	bench_done();
+	while (TRUE);
+}
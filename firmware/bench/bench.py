@@ -0,0 +1,114 @@
+#!/usr/bin/env python3
+"""
+Runs the bench build under ucsim (s51) and prints the cycle table.
+
+Every case in bench.c is bracketed by calls to bench_begin/bench_end. This
+breaks on both, reads the clock counter at each stop and subtracts the
+empty begin/end pair measured first. The _n cases come in pairs of
+different lengths, their difference gives the cost per byte.
+
+ucsim models a classic 12 clock 8051 so the numbers are machine cycles of
+that core, not FX2 time. They're for comparing firmware revisions with
+each other: --baseline takes the cycles.md of an earlier run and puts its
+numbers next to these ones.
+"""
+
+import argparse
+import re
+import subprocess
+import sys
+
+
+def symbol(mapfile, name):
+    with open(mapfile) as f:
+        for line in f:
+            m = re.match(r"\s*(?:C:)?\s*([0-9A-Fa-f]{4,8})\s+_" + name + r"\b", line)
+            if m:
+                return int(m.group(1), 16)
+    sys.exit("%s not found in %s" % (name, mapfile))
+
+
+def cases(source):
+    with open(source) as f:
+        return re.findall(r"^\s*CASE\((\w+),", f.read(), re.M)
+
+
+def baseline(path):
+    with open(path) as f:
+        return dict((name, int(c)) for name, c in
+                    re.findall(r"^\| (\w+) \| (\d+) \|$", f.read(), re.M))
+
+
+def run(s51, ihx, begin, end, done, stops):
+    script = "break 0x%x\nbreak 0x%x\nbreak 0x%x\n" % (begin, end, done)
+    script += "run\nstate\n" * stops + "quit\n"
+    out = subprocess.run([s51, "-t", "8052", ihx], input=script,
+                         capture_output=True, text=True).stdout
+    return [(int(pc, 16), int(clks)) for pc, clks in
+            re.findall(r"PC=\s*0x([0-9A-Fa-f]+).*?\((\d+) clks\)", out, re.S)]
+
+
+def main():
+    ap = argparse.ArgumentParser()
+    ap.add_argument("--s51", default="s51")
+    ap.add_argument("--ihx", required=True)
+    ap.add_argument("--map", required=True)
+    ap.add_argument("--cases", required=True)
+    ap.add_argument("--baseline", help="cycles.md of the revision to compare with")
+    args = ap.parse_args()
+
+    names = cases(args.cases)
+    begin = symbol(args.map, "bench_begin")
+    end = symbol(args.map, "bench_end")
+    done = symbol(args.map, "bench_done")
+
+    stops = run(args.s51, args.ihx, begin, end, done, 2 * (len(names) + 1) + 1)
+    spans = []
+    start = None
+    for pc, clks in stops:
+        if pc == begin:
+            start = clks
+        elif pc == end and start is not None:
+            spans.append((clks - start) // 12)
+            start = None
+    if len(spans) != len(names) + 1:
+        sys.exit("expected %d measurements, got %d" % (len(names) + 1, len(spans)))
+
+    overhead = spans[0]
+    cycles = dict(zip(names, [c - overhead for c in spans[1:]]))
+
+    print("| case | cycles |")
+    print("|------|-------:|")
+    for name in names:
+        print("| %s | %d |" % (name, cycles[name]))
+
+    if args.baseline:
+        before = baseline(args.baseline)
+        print()
+        print("| case | before | after | change |")
+        print("|------|-------:|------:|-------:|")
+        for name in names:
+            if name in before:
+                print("| %s | %d | %d | %+.1f%% |" % (name, before[name], cycles[name],
+                      100.0 * (cycles[name] - before[name]) / before[name] if before[name] else 0))
+            else:
+                print("| %s | - | %d | new |" % (name, cycles[name]))
+
+    # cases that only differ in length give the per byte cost
+    lengths = {}
+    for name in names:
+        m = re.match(r"(.*?)_(\d+)(_.*)?$", name)
+        if m:
+            lengths.setdefault(m.group(1) + (m.group(3) or ""), []).append((int(m.group(2)), name))
+    print()
+    print("| op | cycles per byte/word |")
+    print("|----|-------:|")
+    for op, runs in sorted(lengths.items()):
+        if len(runs) < 2:
+            continue
+        (n0, a), (n1, b) = sorted(runs)[:2]
+        print("| %s | %.1f |" % (op, (cycles[b] - cycles[a]) / float(n1 - n0)))
+
+
+if __name__ == "__main__":
+    main()
@@ -12,13 +12,29 @@
 #include <eputils.h>
 
 #define VERSION_MAJOR 1
-#define VERSION_MINOR 0
-#define VERSION_REVISION 1
+#define VERSION_MINOR 3
+#define VERSION_REVISION 0
 
 #define SYNCDELAY SYNCDELAY4;
 
+// bench/bench.c builds this file under a simulator with no I2C engine or
+// host behind the registers, these let it stand in for them
+#ifndef BENCH_STOP_DONE
+#define BENCH_STOP_DONE()
+#endif
+#ifndef BENCH_OUT_LEN
+#define BENCH_OUT_LEN(bcl,got) (bcl)
+#endif
+#ifndef BENCH_BB_IN
+#define BENCH_BB_IN(pins) (pins)
+#endif
+
 #define I2C_MAX_RETRIES 5
-#define I2C_TIMEOUT 10
+
+// SMBus tTIMEOUT: a transaction fails once SCL has been held low this long.
+// Timer 0 is reloaded to tick count every 1ms, CLKOUT/12 = 4MHz
+#define SMB_TIMEOUT_DEFAULT 35	// ms, the top of the 25-35ms range
+#define T0_RELOAD (65536-4000)
 
 
 #define SMB_INTERFACE_ID 0x99
@@ -26,7 +42,19 @@
 
 // Standard SMB protocol commands
 
-#define SMB_ENABLE_PEC 0x5
+#define SMB_ENABLE_PEC 0x5		// smb_addr = 0 off, 1 PEC in firmware, 2 PEC on the host
+#define SMB_PEC_HOST 2
+
+#define SMB_SELECT_BUS 0x6		// smb_addr = 0 the I2C controller, 1-8 a bit-banged bus
+#define SMB_BUSES 8
+
+#define SMB_ALERT_ENABLE 0x7		// smb_addr = 1 watch SMBALERT# on PA0/INT0#, reports go to EP1 IN
+#define SMB_ARA 0x19			// Alert Response Address, read
+
+#define SMB_SNIFF 0x8			// smb_addr = bit-banged bus to watch, 0 stops. Records go to EP6 IN
+
+#define SMB_SET_TIMEOUT 0x9		// smb_addr = clock low limit in ms, 0 = SMB_TIMEOUT_DEFAULT. smb_cmd = bus, 0xFF all
+#define SMB_ALL_BUSES 0xFF
 
 
 
@@ -36,11 +64,23 @@
 
 #define SMB_READ_WORD 0x20
 #define SMB_WRITE_WORD 0x21
+#define SMB_READ_WORDS 0x22		// wIndex = first command | count<<8, replies status,lo,hi per word
 
 #define SMB_READ_BLOCK 0x30
 #define SMB_WRITE_BLOCK 0x32
 
-#define BLOCK_SEQ_TIMEOUT 5
+// START, ADDR, write bytes, RESTART, ADDR+1, read bytes, (PEC), STOP in one request
+#define SMB_WRITE_READ 0x40		// smb_addr = address | flags<<8, smb_cmd = inline write bytes
+#define SMB_WR_INLINE_MASK 0x3		// 1-2 write bytes are in smb_cmd, 0 = the staged ones
+#define SMB_WR_CONTINUE 0x4		// leave the read open, SMB_READ finishes it
+#define SMB_STAGE_WRITE 0x41		// OUT, write bytes for the SMB_WRITE_READ/BLOCK_PROCESS_CALL/READ_*_LIST that follows
+
+#define SMB_READ_WORD_MULTI 0x23	// smb_addr = address | bus mask<<8, Read Word on the buses in lockstep
+#define SMB_PROCESS_CALL 0x24		// smb_addr = address | command<<8, smb_cmd = data word
+#define SMB_READ_WORD_LIST 0x25		// Read Words of the staged command list from entry smb_cmd on
+#define SMB_BLOCK_PROCESS_CALL 0x34	// writes the staged block, replies with the block read back
+#define SMB_READ_BLOCK_LIST 0x35	// Block Reads of the staged command list from entry smb_cmd on
+#define LIST_MAX 128
 
 // Arbitrary SMB operations
 
@@ -55,8 +95,10 @@
 
 #define SMB_GET_CLEAR_PEC_FAIL	0x54
 #define SMB_GET_MRQ_PECS	0x55
+#define SMB_GET_STATUS		0x56	// status and ACKed byte count of the last SMBus operation
 
-#define SMB_RESET_INTERFACE 0x61 	// sets stop, clears mrq_pecs, empties blockread temp buffer
+#define SMB_RESET_INTERFACE 0x61 	// sets stop, clears mrq_pecs
+#define SMB_RECOVER_BUS 0x62		// clocks a hung bit-banged bus free and sends STOP, stalls if it stays hung
                                  
 // SMB Hacking and Discovery
 
@@ -64,9 +106,44 @@
 #define SMB_TEST_COMMAND_ACK 0x91
 #define SMB_TEST_COMMAND_WRITE 0x92
 
+// Batched versions of the above. wIndex (wValue for addresses) = begin | end<<8
+#define SMB_SCAN_ADDRESS_ACK 0x93	// replies with a 256 bit ACK bitmap
+#define SMB_SCAN_COMMAND_ACK 0x94	// replies with a 256 bit ACK bitmap
+#define SMB_SCAN_COMMAND_WRITE 0x95	// replies with a writability level per command
+#define SMB_SET_SCAN_SKIP 0x96		// OUT, 256 bit bitmap of addresses/commands the scans skip
+
+// Every reply to an SMBus IN request starts with a status header: 
+// status byte, number of bytes the slave ACKed, then the payload.
+// OUT requests can only stall on failure, SMB_GET_STATUS tells why.
+//
+// Replies are built in xbuf and sent from there by the SUDPTR, so they
+// can span several EP0 packets. OUT data stages of any length up to 
+// XBUF_SIZE are received into xbuf as well.
+
+#define RESP_HDR 2
+#define RESP_MAX 256
+#define XBUF_SIZE (RESP_HDR+RESP_MAX+1)	// +1 for the raw PEC byte in host PEC mode
+
+#define SMB_STATUS_OK 0
+#define SMB_STATUS_NAK_ADDRESS 1
+#define SMB_STATUS_NAK_COMMAND 2
+#define SMB_STATUS_NAK_DATA 3
+#define SMB_STATUS_BUS_ERROR 4
+#define SMB_STATUS_TIMEOUT 5
+#define SMB_STATUS_PEC 6
+#define SMB_STATUS_BAD_LENGTH 7
+
+// In host PEC mode the PEC bytes are still clocked but the CRC is left to the
+// host. Received PECs are appended to the reply raw, written ones come from
+// the host at the end of the data stage.
+volatile BOOL pec_host = FALSE;
+volatile BYTE pec_raw = 0;	// raw PEC bytes appended to this reply
+
 BYTE pec_crc(BYTE crc, BYTE data) {
     BYTE i;
 
+    if (pec_host) return crc;	// the host does it
+
     data = crc ^ data;
   
     for ( i = 0; i < 8; i++ ) 
@@ -88,14 +165,35 @@ BYTE pec_crc(BYTE crc, BYTE data) {
 volatile __bit dosud;
 __bit on;
 
-volatile WORD count = 0;
+volatile WORD count = 0;	// ms
+volatile __xdata BYTE bus_timeout[SMB_BUSES+1];	// 0 = SMB_TIMEOUT_DEFAULT
 volatile BOOL pec_enabled = TRUE;
 volatile BOOL pec_failed = FALSE;
 
-volatile __xdata BYTE temp[192];
-volatile __xdata WORD tempptr=0,templen=0;
-volatile __xdata BYTE mrq_pec=0,rcv_pec=0;
+volatile BYTE xfer_status = SMB_STATUS_OK;
+volatile BYTE xfer_acked = 0;
+volatile BYTE last_status = SMB_STATUS_OK;
+volatile BYTE last_acked = 0;
+
+// SUDPTR needs a word aligned buffer, the scratch RAM at 0xE000 is
+volatile __xdata __at(0xE000) BYTE xbuf[XBUF_SIZE];
+// touched on every byte or request, kept in internal RAM
+volatile __data BYTE mrq_pec=0,rcv_pec=0;
+volatile __data WORD stage_len=0;
+volatile __xdata BYTE scan_skip[32];
+volatile __xdata BYTE list_cmds[LIST_MAX];	// the replies overwrite the staged bytes, the list lives here
+volatile BYTE list_len = 0;
+
+volatile BOOL alert_enabled = FALSE;
+volatile __bit alert_pending;
+volatile BYTE alert_seq = 0;
+
+volatile BOOL sniff_on = FALSE;
 
+void handle_alert();
+void sniff_poll();
+
+#ifndef SMB_BENCH
 void main() {
 
  REVCTL = 0;
@@ -116,7 +214,9 @@ void main() {
  ENABLE_USBRESET();
  ENABLE_HISPEED();
 
- TMOD = 0x01; 
+ TMOD = 0x11; // timer 0 counts timeouts, timer 1 timestamps sniffer records
+ TH0 = T0_RELOAD>>8;
+ TL0 = T0_RELOAD&0xFF;
  
  EA=1;
 
@@ -127,25 +227,206 @@ void main() {
  while(TRUE) {
 
  if (dosud) {
+   SUDPTRCTL = bmSDPAUTO; // fx2lib sends descriptors in auto mode, replies switch it off
    handle_setupdata();
    dosud=FALSE;
- } 
+ } else if (sniff_on) {
+   sniff_poll();
+ } else if (alert_pending && alert_enabled) {
+   handle_alert();
+ }
 
  }
  
 
 }
 
+#endif
+
 BOOL handle_get_descriptor() {
   return FALSE;
 }
 
 
+/*
+Bit-banged buses, 1-4 on PORTB and 5-8 on PORTD. With k = (n-1)&3 bus n
+has SCL on pin 2k and SDA on pin 2k+1. The pins are open 
+drain: IO stays 0 and OE pulls the line low, the pull-ups do high.
+
+Buses on the same port can be clocked together, the bytes written are the
+same on all of them and a byte read comes in on each at once.
+*/
+#define BB_DELAY 2	// extra NOPs per half clock, the C around them is most of it
+
+volatile BYTE smb_bus = 0;	// 0 = the I2C controller
+volatile BOOL bb_portd = FALSE;
+volatile BYTE bb_scl = 0, bb_sda = 0;	// pins of the selected buses
+volatile BYTE bb_rx[4];		// last byte read per pin pair
+
+void bb_oe(BYTE low, BYTE release) {
+	if (bb_portd) {
+		OED = (OED | low) & ~release;
+	} else {
+		OEB = (OEB | low) & ~release;
+	}
+}
+
+BYTE bb_in() {
+	return BENCH_BB_IN(bb_portd ? IOD : IOB);
+}
+
+void bb_wait() {
+	BYTE i;
+	for (i=0;i<BB_DELAY;i++) NOP;
+}
+
+/*
+Selects the buses in the mask (bit 0 = bus 1), all on one port.
+*/
+void bb_select(BYTE buses) {
+	BYTE j;
+
+	bb_portd = (buses & 0xF0) != 0;
+	if (bb_portd) buses >>= 4;
+	bb_scl = 0; 
+	bb_sda = 0;
+	for (j=0;j<4;j++) {
+		if (buses & (1<<j)) {
+			bb_scl |= 1<<(2*j);
+			bb_sda |= 2<<(2*j);
+		}
+	}
+	if (bb_portd) {
+		IOD &= ~(bb_scl|bb_sda);
+	} else {
+		IOB &= ~(bb_scl|bb_sda);
+	}
+	bb_oe(0,bb_scl|bb_sda);
+}
+
+void bb_scl_low() {
+	bb_oe(bb_scl,0);
+	bb_wait();
+}
+
+/*
+@returns whether the selected bus has been waited on longer than its 
+clock low limit since count was zeroed
+*/
+BOOL timed_out() {
+	BYTE limit = bus_timeout[smb_bus];
+
+	return count >= (limit ? limit : SMB_TIMEOUT_DEFAULT);
+}
+
+/*
+Releases SCL and waits out any slave stretching it.
+*/
+BOOL bb_scl_high() {
+	bb_oe(0,bb_scl);
+	count=0;
+	while ((bb_in() & bb_scl) != bb_scl) {
+		if (timed_out()) {
+			xfer_status = SMB_STATUS_TIMEOUT;
+			return FALSE;
+		}
+	}
+	bb_wait();
+	return TRUE;
+}
+
+BOOL bb_start() {
+	bb_oe(0,bb_sda);	// a restart comes with SCL low, let SDA up first
+	if (!bb_scl_high()) return FALSE;
+	if ((bb_in() & bb_sda) != bb_sda) {	// somebody holds SDA
+		xfer_status = SMB_STATUS_BUS_ERROR;
+		return FALSE;
+	}
+	bb_oe(bb_sda,0);
+	bb_wait();
+	bb_scl_low();
+	return TRUE;
+}
+
+void bb_stop() {
+	bb_oe(bb_sda,0);
+	bb_scl_high();
+	bb_oe(0,bb_sda);
+	bb_wait();
+}
+
+/*
+Frees a bus a slave holds SDA low on because it's still waiting for the
+clocks of a byte the master gave up on: clocks SCL until SDA is let go,
+nine times at most, then sends STOP.
+@returns whether both lines are high afterwards
+*/
+BOOL bb_recover() {
+	BYTE i;
+
+	bb_oe(0,bb_sda);
+	if (!bb_scl_high()) return FALSE;	// SCL held low, clocks won't help
+	for (i=0;i<9 && (bb_in() & bb_sda) != bb_sda;i++) {
+		bb_scl_low();
+		if (!bb_scl_high()) return FALSE;
+	}
+	bb_scl_low();
+	bb_stop();
+	return (bb_in() & (bb_scl|bb_sda)) == (bb_scl|bb_sda);
+}
+
+/*
+@returns the SDA pins that ACKed
+*/
+BYTE bb_byteout(BYTE b) {
+	BYTE i,ack;
+
+	for (i=0;i<8;i++) {
+		if (b & 0x80) {
+			bb_oe(0,bb_sda);
+		} else {
+			bb_oe(bb_sda,0);
+		}
+		if (!bb_scl_high()) return 0;
+		bb_scl_low();
+		b <<= 1;
+	}
+	bb_oe(0,bb_sda);
+	if (!bb_scl_high()) return 0;
+	ack = ~bb_in() & bb_sda;
+	bb_scl_low();
+	return ack;
+}
+
+/*
+Reads a byte on every selected bus into bb_rx and ACKs it unless it's the last.
+*/
+void bb_bytein(BOOL last) {
+	BYTE i,j,in;
+
+	bb_oe(0,bb_sda);
+	for (i=0;i<8;i++) {
+		if (!bb_scl_high()) return;
+		in = bb_in();
+		for (j=0;j<4;j++) bb_rx[j] = (bb_rx[j]<<1) | ((in>>(2*j+1)) & 1);
+		bb_scl_low();
+	}
+	if (!last) bb_oe(bb_sda,0);
+	bb_scl_high();
+	bb_scl_low();
+	bb_oe(0,bb_sda);
+}
+
 BOOL i2c_start() {
 	WORD tries = 0;
 
+	if (smb_bus) return bb_start();
+
 	retry:
-		if (tries>=I2C_MAX_RETRIES) return FALSE;
+		if (tries>=I2C_MAX_RETRIES) {
+			xfer_status = SMB_STATUS_BUS_ERROR;
+			return FALSE;
+		}
 	        I2CS |= bmSTART;
 	        if ( I2CS & bmBERR ) {            
 		            delay(10);
@@ -157,35 +438,72 @@ BOOL i2c_start() {
 }
 
 void i2c_restart() {
+	if (smb_bus) {
+		bb_start();
+		return;
+	}
 	I2CS |= bmSTART; 
 }
 
 void i2c_stop() {
+	if (smb_bus) {
+		bb_stop();
+		return;
+	}
 	
             I2CS |= bmSTOP;
+	    BENCH_STOP_DONE();
 	    count=0;
             while  (I2CS&bmSTOP) {
-		if (count>I2C_TIMEOUT) {
+		if (timed_out()) {
 			return;
 		}
 	    }
 }
 
+/*
+Gets a hung bus going again, which only the bit-banged buses can do. The
+controller's SCL and SDA are dedicated pins that can't be clocked by hand,
+and a START while a slave holds SDA low is a bus error before any clock
+goes out. That bus gets a STOP and a read of the reserved address 0x7F,
+which nobody answers, to find out whether it's free.
+@returns whether the bus is free afterwards
+*/
+BOOL i2c_recover() {
+	if (smb_bus) return bb_recover();
+
+	i2c_stop();
+	I2CS |= bmSTART;
+	if (!(I2CS & bmBERR)) {
+		I2DAT = 0xFF;
+		count=0;
+		while (!(I2CS & bmDONE) && !timed_out());
+	}
+	i2c_stop();
+	return !(I2CS & bmBERR);
+}
+
 /*
 @returns isAck
 */
 BOOL i2c_byteout(BYTE outb) {
 
+	if (smb_bus) return bb_byteout(outb) != 0;
+
 	I2DAT = outb;
 	
 	count=0;
 	while ( !(I2CS & bmDONE) ) {
-		if (count>I2C_TIMEOUT) {
+		if (timed_out()) {
+			xfer_status = SMB_STATUS_TIMEOUT;
 			i2c_stop();
 			return FALSE;
 		}
 	}
-        if (I2CS & bmBERR) return FALSE;	
+        if (I2CS & bmBERR) {
+		xfer_status = SMB_STATUS_BUS_ERROR;
+		return FALSE;	
+	}
         
         return (I2CS&bmACK);
 }
@@ -194,6 +512,16 @@ BYTE i2c_bytein(BOOL is_first, BOOL is_single, BOOL is_before_last, BOOL is_last
 
 	BYTE b;
 
+	if (smb_bus) {
+		bb_bytein(is_last);
+		if (xfer_status != SMB_STATUS_OK) {
+			bb_stop();
+			return 0;
+		}
+		if (is_last) bb_stop();
+		return bb_rx[(smb_bus-1)&3];
+	}
+
         if (is_single) {
 		I2CS |= bmLASTRD;
 	}
@@ -202,7 +530,8 @@ BYTE i2c_bytein(BOOL is_first, BOOL is_single, BOOL is_before_last, BOOL is_last
 		BYTE discard = I2DAT;
 		count=0;
 		while ( !(I2CS & bmDONE) ){
-			if (count>I2C_TIMEOUT) {
+			if (timed_out()) {
+				xfer_status = SMB_STATUS_TIMEOUT;
 				i2c_stop();
 				return FALSE;
 			}
@@ -223,7 +552,8 @@ BYTE i2c_bytein(BOOL is_first, BOOL is_single, BOOL is_before_last, BOOL is_last
 	if (!is_last)  {
 		count=0;
 		while ( !(I2CS & bmDONE) ){
-			if (count>I2C_TIMEOUT) {
+			if (timed_out()) {
+				xfer_status = SMB_STATUS_TIMEOUT;
 				i2c_stop();
 				return FALSE;
 			}
@@ -233,7 +563,8 @@ BYTE i2c_bytein(BOOL is_first, BOOL is_single, BOOL is_before_last, BOOL is_last
 	} else {
 		count=0;
 		while ( !(I2CS & bmSTOP) ){
-			if (count>I2C_TIMEOUT) {
+			if (timed_out()) {
+				xfer_status = SMB_STATUS_TIMEOUT;
 				i2c_stop();
 				return FALSE;
 			}
@@ -245,14 +576,595 @@ BYTE i2c_bytein(BOOL is_first, BOOL is_single, BOOL is_before_last, BOOL is_last
 	return b;
 }
 
-        
+/*
+Sends a byte and counts it if ACKed. A NAK is recorded as nak_status
+unless a bus error or timeout was already recorded for it.
+*/
+BOOL smb_out(BYTE outb, BYTE nak_status) {
+	if (i2c_byteout(outb)) {
+		xfer_acked++;
+		return TRUE;
+	}
+	if (xfer_status == SMB_STATUS_OK) xfer_status = nak_status;
+	return FALSE;
+}
+
+/*
+Answers an IN request with the status header. The len bytes of payload
+at xbuf+RESP_HDR are only sent if the operation succeeded.
+*/
+BOOL smb_reply(WORD len) {
+	WORD n;
+
+	last_status = xfer_status;
+	last_acked = xfer_acked;
+
+	*xbuf = xfer_status;
+	*(xbuf+1) = xfer_acked;
+	n = xfer_status == SMB_STATUS_OK ? RESP_HDR+len+pec_raw : RESP_HDR;
+
+	// a reply that ends on a full packet before wLength would leave the host waiting
+	// for more, pad it instead of relying on a zero length packet
+	if ((n & 63) == 0 && n < SETUP_LENGTH()) n++;
+
+	SUDPTRCTL = 0;	// manual mode, the length comes from EP0BCH:L
+	SUDPTRH = MSB((WORD)xbuf);
+	SUDPTRL = LSB((WORD)xbuf);
+	EP0BCH = MSB(n);
+	EP0BCL = LSB(n);
+	return TRUE;
+}
+
+/*
+Copies n bytes of xdata with the autopointers. The loop is one MOVX pair
+per byte, where a C loop reloads DPTR from both indexes every byte.
+Nothing in the interrupt handlers uses the autopointers.
+*/
+void xcopy(volatile __xdata BYTE *dst, volatile __xdata BYTE *src, BYTE n) {
+	AUTOPTRSETUP = bmAPTREN | bmAPTR1INC | bmAPTR2INC;
+	AUTOPTRH1 = MSB((WORD)src);
+	AUTOPTRL1 = LSB((WORD)src);
+	AUTOPTRH2 = MSB((WORD)dst);
+	AUTOPTRL2 = LSB((WORD)dst);
+	while (n--) XAUTODAT2 = XAUTODAT1;
+}
+
+/*
+Receives the OUT data stage of the request into xbuf, one EP0 packet at a time.
+@returns the number of bytes received
+*/
+WORD ep0_receive(WORD len) {
+	WORD got=0;
+	BYTE n;
+
+	if (len > XBUF_SIZE) len = XBUF_SIZE;
+	while (got < len) {
+		EP0BCL=0; // arm for the next packet
+		while (EP0CS&bmEPBUSY); // wait until it's in
+		n = BENCH_OUT_LEN(EP0BCL,got);
+		if (n > XBUF_SIZE-got) n = XBUF_SIZE-got;
+		xcopy(xbuf+got,EP0BUF,n);
+		got+=n;
+		if (n<64) break;
+	}
+	return got;
+}
+
+/*
+Finishes an OUT request. The status stage is the only answer there is,
+so failures stall and the host picks up the reason with SMB_GET_STATUS.
+*/
+BOOL smb_done() {
+	last_status = xfer_status;
+	last_acked = xfer_acked;
+
+	return xfer_status == SMB_STATUS_OK;
+}
+
+/*
+Checks a received PEC against the one computed. In host PEC mode it's 
+stored at dst for the host to check instead.
+*/
+void pec_in(BYTE rpec, BYTE pec, volatile __xdata BYTE *dst) {
+	if (pec_host) {
+		*dst = rpec;
+		pec_raw = 1;
+	} else if (rpec != pec && xfer_status == SMB_STATUS_OK) {
+		pec_failed=TRUE;
+		xfer_status=SMB_STATUS_PEC;
+	}
+}
+
+/*
+Reads the data word of a Read Word or Process Call once the read address
+is out. pec is the CRC of everything sent so far. 
+*/
+void smb_word_in(BYTE pec, volatile __xdata BYTE *dst) {
+	BYTE b,rpec;
+
+	if (pec_enabled) {
+		b = i2c_bytein(TRUE,FALSE,FALSE,FALSE);
+		*dst = b;
+		pec = pec_crc(pec,b);
+		b = i2c_bytein(FALSE,FALSE,TRUE,FALSE);
+		*(dst+1) = b;
+		pec = pec_crc(pec,b);
+		rpec = i2c_bytein(FALSE,FALSE,FALSE,TRUE);
+		pec_in(rpec,pec,dst+2);
+	} else { 
+		b = i2c_bytein(TRUE,FALSE,TRUE,FALSE);
+		*dst = b;
+		b = i2c_bytein(FALSE,FALSE,FALSE,TRUE);
+		*(dst+1) = b;	
+	}
+}
+
+/*
+Reads the blocksz byte and the block of a Block Read or Block Process Call
+into dst once the read address is out. pec is the CRC of everything sent
+so far. A block bigger than max is read to the end but fails with
+SMB_STATUS_BAD_LENGTH, in host PEC mode the raw PEC needs a byte more.
+@returns the number of bytes stored, 0 if it failed
+*/
+WORD smb_block_in(BYTE pec, volatile __xdata BYTE *dst, WORD max) {
+	BYTE b,rpec=0;
+	WORD n,blocklen;
+
+	// HW i2c on the FX2 needs prior knowledge of the last byte we want to read at least 2 bytes
+	// in advance. We don't have that with SMBus Block Reads
+	// 
+	// worst case scenario: the first read (block size) returns 1.
+	// we would've already needed to set LASTRD at this point
+	// workaround: always read the PEC byte
+
+	n=0; 
+	blocklen=255;
+	while (n<blocklen) {
+		b = i2c_bytein(n==0,FALSE,n==blocklen-2,n==blocklen-1);				
+		if (xfer_status != SMB_STATUS_OK) return 0;	// timed out, bytein already sent STOP
+		if (n==0) { 	
+			if (b>0xFE || b==0) {
+				//not a valid block readable command
+				xfer_status = SMB_STATUS_BAD_LENGTH;
+				i2c_stop();
+				return 0;
+			}
+			blocklen = b+2; //read the PEC byte always (+1 the blocksz, +1 the pec)
+		} 
+		if (pec_enabled && n<blocklen-1) pec = pec_crc(pec,b); // last byte is PEC, don't need to include that in crc
+		if (pec_enabled && n==blocklen-1) rpec = b; // but we can save it
+		if (n<blocklen-1 && n<max) { // never need the PEC in the buffer
+       			*(dst+n)=b; 
+		}
+		
+		n++;
+	}
+	if (blocklen-1 > max) {
+		xfer_status = SMB_STATUS_BAD_LENGTH;
+		return 0;
+	}
+
+	if (pec_enabled) {
+		pec_in(rpec,pec,dst+blocklen-1);
+		if (xfer_status != SMB_STATUS_OK) return 0;
+	}
+
+	return blocklen-1;	// blocksz byte and the data, sans the PEC
+}
+
+/*
+SMBus Read Word into dst, xfer_status tells if it worked.
+*/
+void smb_read_word(BYTE addr, BYTE cmd, volatile __xdata BYTE *dst) {
+	BYTE pec=0;
+
+	if (!i2c_start()) return;
+	if (!smb_out(addr,SMB_STATUS_NAK_ADDRESS)) goto rwfail;
+	if (!smb_out(cmd,SMB_STATUS_NAK_COMMAND)) goto rwfail;
+	i2c_restart();
+	if (!smb_out(addr+1,SMB_STATUS_NAK_ADDRESS)) goto rwfail;
+	if (pec_enabled) {
+		pec = pec_crc(pec,addr);
+		pec = pec_crc(pec,cmd);
+		pec = pec_crc(pec,addr+1);		
+	}
+	smb_word_in(pec,dst);
+	return;
+
+	rwfail:
+	i2c_stop();
+}
+
+/*
+SMBus Block Read into dst, at most max bytes of blocksz and block.
+@returns the number of bytes stored, 0 if it failed
+*/
+WORD smb_read_block(BYTE addr, BYTE cmd, volatile __xdata BYTE *dst, WORD max) {
+	BYTE pec=0;
+
+	if (!i2c_start()) return 0;
+	if (!smb_out(addr,SMB_STATUS_NAK_ADDRESS)) goto rbfail;
+	if (!smb_out(cmd,SMB_STATUS_NAK_COMMAND)) goto rbfail;
+	i2c_restart();
+	if (!smb_out(addr+1,SMB_STATUS_NAK_ADDRESS)) goto rbfail;
+	if (pec_enabled) {
+		pec = pec_crc(pec,addr);
+		pec = pec_crc(pec,cmd);
+		pec = pec_crc(pec,addr+1);
+	}
+	return smb_block_in(pec,dst,max);
+
+	rbfail:
+	i2c_stop();
+	return 0;
+}
+
+/*
+Takes the staged bytes over as the command list of SMB_READ_*_LIST. 
+Without new ones staged the last list is used again.
+*/
+void list_take() {
+	if (!stage_len) return;
+	list_len = stage_len > LIST_MAX ? LIST_MAX : stage_len;
+	xcopy(list_cmds,xbuf,list_len);
+	stage_len = 0;
+}
+
+/*
+Probes for the ACK tests and scans. NAKs are the expected outcome here so
+they aren't recorded, bus errors and timeouts are.
+@returns 0 = no ACK, 1 = address ACK, 2 = command ACK too
+*/
+BYTE probe_ack(BYTE addr, BYTE cmd, BOOL with_cmd) {
+	BYTE r=0;
+
+	if (!i2c_start()) return 0;
+	if (i2c_byteout(addr)) {
+		r++;
+		if (with_cmd && i2c_byteout(cmd)) r++;
+	}
+	i2c_stop();
+	return r;
+}
+
+/*
+@returns how far a write to cmd gets ACKed: 0 = nothing, 1 = command, 
+2 = byte, 3 = word, 4 = block, 5 = more than a block
+*/
+BYTE probe_write(BYTE addr, BYTE cmd) {
+	BYTE r=0;
+
+	if (!i2c_start()) return 0;
+	if (!i2c_byteout(addr)) goto pwOver;
+	if (i2c_byteout(cmd)) { r++; // Command ACK = command exists
+	} else {goto pwOver;}
+	if (i2c_byteout(3)) { r++; // Data Byte #1 ACK = byte writable
+	} else {goto pwOver;}
+	if (i2c_byteout(0)) { r++; // Data Byte #2 ACK = word writable
+	} else {goto pwOver;}
+	if (!i2c_byteout(0)) {goto pwOver;}
+	if (i2c_byteout(0)) { r++; // Data Byte #4 ACK = block writable
+	} else {goto pwOver;}
+	if (i2c_byteout(0)) { r++; // Data Byte #5 ACK = >block writable
+	} else {goto pwOver;}
+
+	pwOver:
+	i2c_stop();
+	return r;
+}
+
+/*
+Answers SMBALERT# with an Alert Response Address read and reports the 
+address that answered on EP1 IN: status, address, sequence number.
+Waits for the host to pick up the previous report first, the alerting
+device keeps SMBALERT# low until it's been asked so nothing is lost.
+*/
+void handle_alert() {
+	BYTE bus = smb_bus, b=0, rpec;
+
+	if (EP1INCS & bmEPBUSY) return;
+	alert_pending = FALSE;
+
+	smb_bus = 0;	// SMBALERT# is wired to the I2C controller's bus
+	xfer_status = SMB_STATUS_OK;
+	xfer_acked = 0;
+	if (i2c_start()) {
+		if (smb_out(SMB_ARA,SMB_STATUS_NAK_ADDRESS)) {
+			if (pec_enabled && !pec_host) {
+				b = i2c_bytein(TRUE,FALSE,TRUE,FALSE);
+				rpec = i2c_bytein(FALSE,FALSE,FALSE,TRUE);
+				if (xfer_status == SMB_STATUS_OK && rpec != pec_crc(pec_crc(0,SMB_ARA),b)) xfer_status = SMB_STATUS_PEC;
+			} else {
+				b = i2c_bytein(TRUE,TRUE,FALSE,TRUE);
+			}
+		} else {
+			i2c_stop();
+		}
+	}
+	smb_bus = bus;
+
+	EP1INBUF[0] = xfer_status;
+	EP1INBUF[1] = b;
+	EP1INBUF[2] = alert_seq++;
+	EP1INBC = 3;
+
+	// with more than one device alerting the line stays low, there's no new edge for the next one
+	if (!PA0) alert_pending = TRUE;
+}
+
+/*
+Passive sniffer. Watches SCL/SDA of a bit-banged bus pair with the pins
+released and writes a 4 byte record per START, STOP and byte+ACK to EP6:
+type, data, timestamp low, high. Timestamps are timer 1 ticks, CLKOUT/12 
+= 250ns, a WRAP record marks every 65536 ticks. While both EP6 buffers 
+are with the host records are dropped, a LOST record with the count and 
+the wraps missed comes first once there's room again.
+
+The I2C controller's pins can't be read, to watch that bus wire it to a 
+bit-banged pair too. Everything per edge has to fit in the SCL low time,
+so the EP6 buffer is filled one 256 byte half at a time: sniff_poll 
+writes a record at a __data byte index into the half, inline, and only 
+calls out when a half or the packet is full or the buffer isn't free yet.
+*/
+#define SNIFF_START 0x1
+#define SNIFF_STOP 0x2
+#define SNIFF_BYTE 0x3
+#define SNIFF_WRAP 0x4
+#define SNIFF_LOST 0x5
+#define SNIFF_NAK 0x80			// or'd into SNIFF_BYTE
+#define SNIFF_PACKET 512
+
+volatile BOOL sniff_portd = FALSE;
+volatile __data BYTE sniff_scl = 0, sniff_sda = 0;
+volatile __xdata BYTE * __data sniff_half = EP6FIFOBUF;	// the half of the EP6 buffer being filled
+volatile __data BYTE sniff_n = 0;	// bytes in that half
+volatile BYTE sniff_lost = 0;
+volatile WORD sniff_wraps = 0;		// wraps dropped with them
+volatile BYTE sniff_b = 0, sniff_bits = 0xFF;	// byte being clocked in, setup packets interrupt it
+
+void sniff_commit(WORD n) {
+	EP6BCH = MSB(n);
+	SYNCDELAY;
+	EP6BCL = LSB(n);
+	sniff_half = EP6FIFOBUF;
+	sniff_n = 0;
+}
+
+void sniff_flush() {
+	WORD n = (sniff_half - EP6FIFOBUF) + sniff_n;
+
+	if (n) sniff_commit(n);
+}
+
+// a record filled the half, go on to the second one or send the packet
+void sniff_next() {
+	if (sniff_half == EP6FIFOBUF) {
+		sniff_half = EP6FIFOBUF+256;
+	} else {
+		sniff_commit(SNIFF_PACKET);
+	}
+}
+
+/*
+Writes a record the slow way: the first one of a packet has to find the 
+EP6 buffer free, or is counted lost, and goes after a LOST record if any
+were.
+*/
+void sniff_rec(BYTE type, BYTE data, BYTE tl, BYTE th) {
+	volatile __xdata BYTE *p;
+
+	if (!sniff_n && sniff_half == EP6FIFOBUF) {
+		if (EP2468STAT & bmEP6FULL) {
+			if (type == SNIFF_WRAP) {
+				sniff_wraps++;
+			} else if (sniff_lost != 0xFF) {
+				sniff_lost++;
+			}
+			return;
+		}
+		if (sniff_lost || sniff_wraps) {
+			EP6FIFOBUF[0] = SNIFF_LOST;
+			EP6FIFOBUF[1] = sniff_lost;
+			EP6FIFOBUF[2] = LSB(sniff_wraps);
+			EP6FIFOBUF[3] = MSB(sniff_wraps);
+			sniff_n = 4;
+			sniff_lost = 0;
+			sniff_wraps = 0;
+		}
+	}
+	p = sniff_half + sniff_n;
+	p[0] = type;
+	p[1] = data;
+	p[2] = tl;
+	p[3] = th;
+	sniff_n += 4;
+	if (!sniff_n) sniff_next();
+}
+
+void sniff_start(BYTE bus) {
+	if (sniff_on) sniff_flush();	// what's left goes out as a short packet
+	sniff_on = FALSE;
+	if (!bus) return;
+
+	bb_select(1<<(bus-1));
+	sniff_portd = bb_portd;
+	sniff_scl = bb_scl;
+	sniff_sda = bb_sda;
+	bb_select(smb_bus ? 1<<(smb_bus-1) : 0);
+
+	EP6CFG = 0xE2;		// valid, IN, bulk, 512, double buffered
+	SYNCDELAY;
+	EP6FIFOCFG = 0;		// the CPU commits the packets
+	SYNCDELAY;
+	FIFORESET = 0x80;
+	SYNCDELAY;
+	FIFORESET = 0x06;
+	SYNCDELAY;
+	FIFORESET = 0;
+	SYNCDELAY;
+	sniff_half = EP6FIFOBUF;
+	sniff_n = 0;
+	sniff_lost = 0;
+	sniff_wraps = 0;
+	sniff_bits = 0xFF;
+
+	TR1 = 0;
+	TH1 = 0;
+	TL1 = 0;
+	TF1 = 0;
+	TR1 = 1;
+	sniff_on = TRUE;
+}
+
+/*
+Decodes edges until a setup packet comes in. SDA changing with SCL high
+is a START or STOP, SCL rising clocks a bit in. Bits before the first 
+START are ignored.
+*/
+void sniff_poll() {
+	__data BYTE now, last, b = sniff_b, bits = sniff_bits;
+	__data BYTE scl = sniff_scl, sda = sniff_sda;
+	__data BYTE type, val, tl, th;
+	volatile __xdata BYTE *p;
+
+	last = (sniff_portd ? IOD : IOB) & (scl|sda);
+	while (!dosud) {
+		if (TF1) {
+			TF1 = 0;
+			sniff_rec(SNIFF_WRAP,0,0,0);
+			sniff_flush();	// and nothing waits longer than a wrap for the host
+		}
+		now = (sniff_portd ? IOD : IOB) & (scl|sda);
+		if (now == last) continue;
+
+		type = 0;
+		val = 0;
+		if (now & last & scl) {
+			if (now & sda) {
+				type = SNIFF_STOP;
+				bits = 0xFF;
+			} else {
+				type = SNIFF_START;
+				bits = 0;
+			}
+		} else if ((now & scl) && bits != 0xFF) {
+			if (bits < 8) {
+				b = (b<<1) | ((now & sda) ? 1 : 0);
+				bits++;
+			} else {
+				type = (now & sda) ? SNIFF_BYTE|SNIFF_NAK : SNIFF_BYTE;
+				val = b;
+				bits = 0;
+			}
+		}
+		last = now;
+		if (!type) continue;
+
+		th = TH1;
+		tl = TL1;
+		if (TH1 != th) {
+			th = TH1;
+			tl = TL1;
+		}
+		// an overflow the loop hasn't seen yet belongs before this record
+		if (TF1 && !(th & 0x80)) {
+			TF1 = 0;
+			sniff_rec(SNIFF_WRAP,0,0,0);
+		}
+		if (!sniff_n) {
+			sniff_rec(type,val,tl,th);
+			continue;
+		}
+		p = sniff_half + sniff_n;
+		p[0] = type;
+		p[1] = val;
+		p[2] = tl;
+		p[3] = th;
+		sniff_n += 4;
+		if (!sniff_n) sniff_next();
+	}
+	sniff_b = b;
+	sniff_bits = bits;
+}
+
+/*
+Read Word on every bus in the mask at once. A bus that NAKs drops out but
+keeps being clocked with the rest. Replies status,lo,hi per bus, in bus 
+order, and the raw PEC after them in host PEC mode.
+@returns the reply length
+*/
+WORD bb_read_word_multi(BYTE buses, BYTE addr, BYTE cmd) {
+	BYTE j,b,live,pec,st[4],lo[4],hi[4];
+	WORD n=0;
+
+	bb_select(buses);
+	for (j=0;j<4;j++) {
+		st[j] = SMB_STATUS_OK;
+		lo[j] = 0;
+		hi[j] = 0;
+	}
+	pec = pec_crc(pec_crc(pec_crc(0,addr),cmd),addr+1);
+
+	if (!bb_start()) goto rmfail;
+	b = bb_byteout(addr);
+	live = b;
+	if (live && xfer_status == SMB_STATUS_OK) live &= bb_byteout(cmd);
+	if (live && xfer_status == SMB_STATUS_OK && bb_start()) live &= bb_byteout(addr+1);
+	if (xfer_status != SMB_STATUS_OK) goto rmstopfail;
+	for (j=0;j<4;j++) {
+		// a bus that didn't ACK its address says NAK_ADDRESS, one that stopped later NAK_COMMAND
+		if (!(bb_sda & (2<<(2*j)))) continue;
+		if (!(live & (2<<(2*j)))) st[j] = (b & (2<<(2*j))) ? SMB_STATUS_NAK_COMMAND : SMB_STATUS_NAK_ADDRESS;
+	}
+	if (live) {
+		bb_bytein(FALSE);
+		for (j=0;j<4;j++) lo[j] = bb_rx[j];
+		bb_bytein(!pec_enabled);
+		for (j=0;j<4;j++) hi[j] = bb_rx[j];
+		if (pec_enabled) bb_bytein(TRUE);
+	}
+	if (xfer_status != SMB_STATUS_OK) goto rmstopfail;
+	bb_stop();
+
+	for (j=0;j<4;j++) {
+		if (!(bb_sda & (2<<(2*j)))) continue;
+		*(xbuf+RESP_HDR+n) = st[j];
+		*(xbuf+RESP_HDR+n+1) = lo[j];
+		*(xbuf+RESP_HDR+n+2) = hi[j];
+		n+=3;
+		if (pec_host) {
+			*(xbuf+RESP_HDR+n) = bb_rx[j];
+			n++;
+		} else if (pec_enabled && st[j] == SMB_STATUS_OK && bb_rx[j] != pec_crc(pec_crc(pec,lo[j]),hi[j])) {
+			*(xbuf+RESP_HDR+n-3) = SMB_STATUS_PEC;
+		}
+	}
+	goto rmdone;
+
+	rmstopfail:
+	bb_stop();
+	rmfail:
+	n=0;
+	rmdone:
+	bb_select(smb_bus ? 1<<(smb_bus-1) : 0);
+	return n;
+}
+
 BOOL handle_vendorcommand(BYTE cmd) {
 
  WORD smb_addr = SETUP_VALUE();
  WORD smb_cmd = SETUP_INDEX();
  WORD smb_len = SETUP_LENGTH();
- BYTE b,i=0,j=0,k=0,blocklen=0,rs=0,pec=0, rpec=0;
+ BYTE b,i=0,rs=0,pec=0, rpec=0;
+ WORD n,m,blocklen=0;
  BOOL ack=FALSE;
+
+ xfer_status = SMB_STATUS_OK;
+ xfer_acked = 0;
+ pec_raw = 0;
+ // the stage only lives until the next request, the ones that consume it clear it themselves
+ if (cmd != SMB_WRITE_READ && cmd != SMB_BLOCK_PROCESS_CALL &&
+     cmd != SMB_READ_WORD_LIST && cmd != SMB_READ_BLOCK_LIST) stage_len = 0;
  
  switch (cmd) {
     case SMB_ENABLE_PEC:
@@ -260,11 +1172,62 @@ BOOL handle_vendorcommand(BYTE cmd) {
 	        EP0BCH=0;
 	        EP0BCL=0;		
 		pec_enabled = (smb_addr>0);
+		pec_host = (smb_addr==SMB_PEC_HOST);
 		if (!pec_enabled) {
 			mrq_pec = 0; rcv_pec=0;
 		}
 		return TRUE;
 	break;
+    case SMB_SELECT_BUS:
+	if (smb_addr > SMB_BUSES) return FALSE;
+	while (EP0CS&bmEPBUSY); // wait until ready
+	        EP0BCH=0;
+	        EP0BCL=0;		
+		smb_bus = smb_addr;
+		bb_select(smb_bus ? 1<<(smb_bus-1) : 0);
+		return TRUE;
+	break;
+    case SMB_ALERT_ENABLE:
+	while (EP0CS&bmEPBUSY); // wait until ready
+	        EP0BCH=0;
+	        EP0BCL=0;		
+		EX0 = 0;
+		alert_enabled = (smb_addr>0);
+		alert_pending = FALSE;
+		if (alert_enabled) {
+			EP1INCFG = 0xB0;	// valid, interrupt
+			SYNCDELAY;
+			PORTACFG |= bmINT0;	// PA0 is INT0#
+			IT0 = 1;		// falling edge
+			IE0 = 0;
+			alert_pending = !PA0;	// already low
+			EX0 = 1;
+		} else {
+			PORTACFG &= ~bmINT0;
+		}
+		return TRUE;
+	break;
+    case SMB_SNIFF:
+	if (smb_addr > SMB_BUSES) return FALSE;
+	while (EP0CS&bmEPBUSY); // wait until ready
+	        EP0BCH=0;
+	        EP0BCL=0;		
+		sniff_start(smb_addr);
+		return TRUE;
+	break;
+    case SMB_SET_TIMEOUT:
+	if (smb_cmd > SMB_BUSES && smb_cmd != SMB_ALL_BUSES) return FALSE;
+	if (smb_addr > 0xFF) return FALSE;
+	while (EP0CS&bmEPBUSY); // wait until ready
+	        EP0BCH=0;
+	        EP0BCL=0;		
+		if (smb_cmd == SMB_ALL_BUSES) {
+			for (i=0;i<=SMB_BUSES;i++) bus_timeout[i] = smb_addr;
+		} else {
+			bus_timeout[smb_cmd] = smb_addr;
+		}
+		return TRUE;
+	break;
     case SMB_INTERFACE_ID:
 	while (EP0CS&bmEPBUSY); // wait until ready
 		*(EP0BUF) = 0x55; *(EP0BUF+1) = 0x53; 	*(EP0BUF+2) = 0x4D;
@@ -284,21 +1247,16 @@ BOOL handle_vendorcommand(BYTE cmd) {
     case SMB_SEND_BYTE:	
 	while (EP0CS&bmEPBUSY); // wait until ready
 
-	if (!i2c_start()) return FALSE;
-	if (!i2c_byteout(smb_addr)) {
-		i2c_stop();
-		return FALSE;
-	}
-	if (!i2c_byteout(smb_cmd)) {
-		i2c_stop();
-		return FALSE;
+	if (!i2c_start()) return smb_done();
+	if (smb_out(smb_addr,SMB_STATUS_NAK_ADDRESS)) {
+		smb_out(smb_cmd,SMB_STATUS_NAK_COMMAND);
 	}
 	i2c_stop();
 
 	EP0BCH=0;
 	EP0BCL=0;		
 
-	return TRUE;
+	return smb_done();
 
 	break;
     case SMB_READ_BYTE:
@@ -306,10 +1264,10 @@ BOOL handle_vendorcommand(BYTE cmd) {
 	while (EP0CS&bmEPBUSY); // wait until ready
 
 	if (!i2c_start()) goto rbfail;
-	if (!i2c_byteout(smb_addr)) goto rbfail;
-	if (!i2c_byteout(smb_cmd)) goto rbfail;
+	if (!smb_out(smb_addr,SMB_STATUS_NAK_ADDRESS)) goto rbfail;
+	if (!smb_out(smb_cmd,SMB_STATUS_NAK_COMMAND)) goto rbfail;
 	i2c_restart();
-	if (!i2c_byteout(smb_addr+1)) goto rbfail;
+	if (!smb_out(smb_addr+1,SMB_STATUS_NAK_ADDRESS)) goto rbfail;
 
         if (pec_enabled) {
 		b = i2c_bytein(TRUE,FALSE,TRUE,FALSE); 
@@ -318,28 +1276,17 @@ BOOL handle_vendorcommand(BYTE cmd) {
 		pec = pec_crc(pec,smb_addr+1);		
 		pec = pec_crc(pec,b);
 		rpec = i2c_bytein(FALSE,FALSE,FALSE,TRUE); 
-		if (rpec != pec) {
-			 EP0BCH=0;
-			 EP0BCL=0;		
-			 pec_failed=TRUE;
-  			 goto rbfail;
-		}		
+		pec_in(rpec,pec,xbuf+RESP_HDR+1);
 	} else {
 		b = i2c_bytein(TRUE,TRUE,FALSE,TRUE); 
 	}
 
-	*EP0BUF = b;
-	 EP0BCH=0;
-	 EP0BCL=1;		
-	
-	goto rbsuccess;
+	*(xbuf+RESP_HDR) = b;
+	return smb_reply(1);
 
 	rbfail:
 	i2c_stop();
-	return FALSE;
-	
-	rbsuccess:
-	return TRUE;
+	return smb_reply(0);
 
 	break;
 
@@ -348,71 +1295,108 @@ BOOL handle_vendorcommand(BYTE cmd) {
 	while (EP0CS&bmEPBUSY); // wait until ready
 
 	if (!i2c_start()) goto wbfail;
-	if (!i2c_byteout(smb_addr)) goto wbfail;
-	if (!i2c_byteout(smb_cmd)) goto wbfail;
-	if (!i2c_byteout(*EP0BUF)) goto wbfail;
+	if (!smb_out(smb_addr,SMB_STATUS_NAK_ADDRESS)) goto wbfail;
+	if (!smb_out(smb_cmd,SMB_STATUS_NAK_COMMAND)) goto wbfail;
+	if (!smb_out(*EP0BUF,SMB_STATUS_NAK_DATA)) goto wbfail;
 	if (pec_enabled) {
 		pec = pec_crc(pec, smb_addr);
 		pec = pec_crc(pec, smb_cmd);
 		pec = pec_crc(pec, *EP0BUF);
-		if (!i2c_byteout(pec)) goto wbfail;		
+		if (!smb_out(pec_host ? *(EP0BUF+1) : pec,SMB_STATUS_NAK_DATA)) goto wbfail;		
 	}
-	i2c_stop();
-	
-	goto wbsuccess;
 
 	wbfail:
 	i2c_stop();
-	return FALSE;
-	
-	wbsuccess:
-	return TRUE;
+	return smb_done();
 
 	break;
 
     case SMB_READ_WORD:
 	while (EP0CS&bmEPBUSY); // wait until ready
 
-	if (!i2c_start()) goto rwfail;
-	if (!i2c_byteout(smb_addr)) goto rwfail;
-	if (!i2c_byteout(smb_cmd)) goto rwfail;
+	smb_read_word(smb_addr,smb_cmd,xbuf+RESP_HDR);
+	return smb_reply(2);
+
+	break;
+
+    case SMB_READ_WORDS:
+	while (EP0CS&bmEPBUSY); // wait until ready
+
+	// consecutive Read Words, each with its own status so one bad register doesn't lose the rest
+	// in host PEC mode each entry carries its raw PEC as well
+	m = pec_host ? 4 : 3;
+	n=0;
+	for (i=0;i<(smb_cmd>>8) && n+m<=RESP_MAX;i++) {
+		xfer_status = SMB_STATUS_OK;
+		smb_read_word(smb_addr,(smb_cmd&0xFF)+i,xbuf+RESP_HDR+n+1);
+		*(xbuf+RESP_HDR+n) = xfer_status;
+		n+=m;
+		if (xfer_status == SMB_STATUS_TIMEOUT || xfer_status == SMB_STATUS_BUS_ERROR) break;
+	}
+	xfer_status = SMB_STATUS_OK;
+	pec_raw = 0;	// already counted in n
+	return smb_reply(n);
+
+	break;
+
+    case SMB_READ_WORD_LIST:
+	while (EP0CS&bmEPBUSY); // wait until ready
+
+	// like SMB_READ_WORDS, for any commands
+	list_take();
+	m = pec_host ? 4 : 3;
+	n=0;
+	for (i=LSB(smb_cmd);i<list_len && n+m<=RESP_MAX;i++) {
+		xfer_status = SMB_STATUS_OK;
+		smb_read_word(smb_addr,list_cmds[i],xbuf+RESP_HDR+n+1);
+		*(xbuf+RESP_HDR+n) = xfer_status;
+		n+=m;
+		if (xfer_status == SMB_STATUS_TIMEOUT || xfer_status == SMB_STATUS_BUS_ERROR) break;
+	}
+	xfer_status = SMB_STATUS_OK;
+	pec_raw = 0;	// already counted in n
+	return smb_reply(n);
+
+	break;
+
+    case SMB_READ_WORD_MULTI:
+	while (EP0CS&bmEPBUSY); // wait until ready
+
+	b = MSB(smb_addr);
+	if (!b || ((b & 0x0F) && (b & 0xF0))) {	// lockstep only works within a port
+		xfer_status = SMB_STATUS_BAD_LENGTH;
+		return smb_reply(0);
+	}
+	return smb_reply(bb_read_word_multi(b,LSB(smb_addr),smb_cmd));
+
+	break;
+
+    case SMB_PROCESS_CALL:
+	while (EP0CS&bmEPBUSY); // wait until ready
+
+	i = MSB(smb_addr);	// command
+	smb_addr = LSB(smb_addr);
+	if (!i2c_start()) goto pcfail;
+	if (!smb_out(smb_addr,SMB_STATUS_NAK_ADDRESS)) goto pcstopfail;
+	if (!smb_out(i,SMB_STATUS_NAK_COMMAND)) goto pcstopfail;
+	if (!smb_out(LSB(smb_cmd),SMB_STATUS_NAK_DATA)) goto pcstopfail;
+	if (!smb_out(MSB(smb_cmd),SMB_STATUS_NAK_DATA)) goto pcstopfail;
 	i2c_restart();
-	if (!i2c_byteout(smb_addr+1)) goto rwfail;
+	if (!smb_out(smb_addr+1,SMB_STATUS_NAK_ADDRESS)) goto pcstopfail;
 	if (pec_enabled) {
-		b = i2c_bytein(TRUE,FALSE,FALSE,FALSE);
-		*EP0BUF = b;
 		pec = pec_crc(pec,smb_addr);
-		pec = pec_crc(pec,smb_cmd);
-		pec = pec_crc(pec,smb_addr+1);		
-		pec = pec_crc(pec,b);
-		b = i2c_bytein(FALSE,FALSE,TRUE,FALSE);
-		*(EP0BUF+1) = b;
-		pec = pec_crc(pec,b);
-		rpec = i2c_bytein(FALSE,FALSE,FALSE,TRUE);
-		if (rpec != pec) {
-			 EP0BCH=0;
-			 EP0BCL=0;
-			 pec_failed=TRUE;		
- 			 goto rwfail;
-		}
-	} else { 
-		b = i2c_bytein(TRUE,FALSE,TRUE,FALSE);
-		*EP0BUF = b;
-		b = i2c_bytein(FALSE,FALSE,FALSE,TRUE);
-		*(EP0BUF+1) = b;	
+		pec = pec_crc(pec,i);
+		pec = pec_crc(pec,LSB(smb_cmd));
+		pec = pec_crc(pec,MSB(smb_cmd));
+		pec = pec_crc(pec,smb_addr+1);
 	}
+	smb_word_in(pec,xbuf+RESP_HDR);
+	return smb_reply(2);
 
-        EP0BCH=0;
-        EP0BCL=2;		
-	
-	goto rwsuccess;
-
-	rwfail:
+	pcstopfail:
 	i2c_stop();
-	return FALSE;
-	
-	rwsuccess:
-	return TRUE;
+	pcfail:
+	return smb_reply(0);
 
 	break;
 
@@ -421,234 +1405,192 @@ BOOL handle_vendorcommand(BYTE cmd) {
 	while (EP0CS&bmEPBUSY); // wait until ready
 
 	if (!i2c_start()) goto wwfail;
-	if (!i2c_byteout(smb_addr)) goto wwfail;
-	if (!i2c_byteout(smb_cmd)) goto wwfail;
-	if (!i2c_byteout(*EP0BUF)) goto wwfail;
-	if (!i2c_byteout(*(EP0BUF+1))) goto wwfail;
+	if (!smb_out(smb_addr,SMB_STATUS_NAK_ADDRESS)) goto wwfail;
+	if (!smb_out(smb_cmd,SMB_STATUS_NAK_COMMAND)) goto wwfail;
+	if (!smb_out(*EP0BUF,SMB_STATUS_NAK_DATA)) goto wwfail;
+	if (!smb_out(*(EP0BUF+1),SMB_STATUS_NAK_DATA)) goto wwfail;
 	if (pec_enabled) {
 		pec = pec_crc(pec,smb_addr);
 		pec = pec_crc(pec,smb_cmd);
 		pec = pec_crc(pec,*EP0BUF);		
 		pec = pec_crc(pec,*(EP0BUF+1));		
-		if (!i2c_byteout(pec)) goto wwfail;				
+		if (!smb_out(pec_host ? *(EP0BUF+2) : pec,SMB_STATUS_NAK_DATA)) goto wwfail;				
 	}
-	i2c_stop();
-	
-	goto wwsuccess;
 
 	wwfail:
 	i2c_stop();
-	return FALSE;
-	
-	wwsuccess:
-	return TRUE;
+	return smb_done();
 
 	break;
 
     case SMB_READ_BLOCK:
 	while (EP0CS&bmEPBUSY); // wait until ready
 
-	if (templen>0 && count>BLOCK_SEQ_TIMEOUT) {
-		templen=0; tempptr=0;
-	}
+	return smb_reply(smb_read_block(smb_addr,smb_cmd,xbuf+RESP_HDR,RESP_MAX));
 
-	if ((templen-tempptr)>0) {
-		// when there is outstanding data, this command returns it in sequence, ignoring parameters
+	break;
 
-		blocklen = templen-tempptr >64 ? 64:templen-tempptr;
-		i=tempptr;
-		j=0;
-		while (j < blocklen) { 
-			*(EP0BUF+j) = temp[i];			
-			i++; j++;
-		}
-		tempptr+=j;
+    case SMB_READ_BLOCK_LIST:
+	while (EP0CS&bmEPBUSY); // wait until ready
 
-	        EP0BCH=0;
-	        EP0BCL=blocklen;
+	// status, blocksz, block (, raw PEC) per command. One that doesn't fit in what's left 
+	// fails with SMB_STATUS_BAD_LENGTH, the host reads it on its own
+	list_take();
+	m = pec_host ? 1 : 0;
+	n=0;
+	for (i=LSB(smb_cmd);i<list_len && n+3+m<=RESP_MAX;i++) {
+		xfer_status = SMB_STATUS_OK;
+		pec_raw = 0;
+		blocklen = smb_read_block(smb_addr,list_cmds[i],xbuf+RESP_HDR+n+1,RESP_MAX-n-1-m);
+		*(xbuf+RESP_HDR+n) = xfer_status;
+		if (!blocklen) *(xbuf+RESP_HDR+n+1) = 0;
+		n += 1 + (blocklen ? blocklen+pec_raw : 1);
+		if (xfer_status == SMB_STATUS_TIMEOUT || xfer_status == SMB_STATUS_BUS_ERROR) break;
+	}
+	xfer_status = SMB_STATUS_OK;
+	pec_raw = 0;	// already counted in n
+	return smb_reply(n);
 
-		if (templen-tempptr == 0) {
-			templen=0; tempptr=0;
-		}
-		return TRUE;
-	} 
+	break;
 
-	if (!i2c_start()) goto rlfail;
-	if (!i2c_byteout(smb_addr)) goto rlstopfail;
-	if (!i2c_byteout(smb_cmd)) goto rlstopfail;
-	i2c_restart();
-	if (!i2c_byteout(smb_addr+1)) goto rlstopfail;
+    case SMB_BLOCK_PROCESS_CALL:
+	while (EP0CS&bmEPBUSY); // wait until ready
+
+	if (stage_len == 0 || stage_len > 255) {
+		xfer_status = SMB_STATUS_BAD_LENGTH;
+		return smb_reply(0);
+	}
+	blocklen = stage_len;
+	stage_len = 0;
+
+	if (!i2c_start()) goto bpfail;
+	if (!smb_out(smb_addr,SMB_STATUS_NAK_ADDRESS)) goto bpstopfail;
+	if (!smb_out(smb_cmd,SMB_STATUS_NAK_COMMAND)) goto bpstopfail;
+	if (!smb_out(blocklen,SMB_STATUS_NAK_DATA)) goto bpstopfail;
 	if (pec_enabled) {
 		pec = pec_crc(pec,smb_addr);
 		pec = pec_crc(pec,smb_cmd);
-		pec = pec_crc(pec,smb_addr+1);
+		pec = pec_crc(pec,blocklen);
 	}
-	
-	// HW i2c on the FX2 needs prior knowledge of the last byte we want to read at least 2 bytes
-	// in advance. We don't have that with SMBus Block Reads
-	// 
-	// worst case scenario: the first read (block size) returns 1.
-	// we would've already needed to set LASTRD at this point
-	// workaround: always read the PEC byte
-
-	i=0; 
-	blocklen=255;
-	while (i<blocklen) {
-		b = i2c_bytein(i==0,FALSE,i==blocklen-2,i==blocklen-1);				
-		if (i==0) { 	
-			if (b>0xFE || b==0) {
-				//not a valid block readable command
-				goto rlstopfail;
-			}
-			blocklen = b+2; //read the PEC byte always (+1 the blocksz, +1 the pec)
-		} 
-		if (pec_enabled && i<blocklen-1) pec = pec_crc(pec,b); // last byte is PEC, don't need to include that in crc
-		if (pec_enabled && i==blocklen-1) rpec = b; // but we can save it
-		if (i<blocklen-1) { // never need the PEC in the buffer
-			if (i<64) {
-        			*(EP0BUF+i)=b; 
-			} else {
-				temp[i-64] = b;
-			}
-		}
-		
-		i++;
-	}
-
-	if ((blocklen-1)>64) {			// if blocklen sans the PEC byte including the blocksz byte >64
-		templen = (blocklen-1)-64;	// then the rest is stores in temp
-		tempptr = 0;
-		count = 0;
+	for (n=0;n<blocklen;n++) {
+		if (!smb_out(*(xbuf+n),SMB_STATUS_NAK_DATA)) goto bpstopfail;
+		if (pec_enabled) pec = pec_crc(pec,*(xbuf+n));
 	}
+	i2c_restart();
+	if (!smb_out(smb_addr+1,SMB_STATUS_NAK_ADDRESS)) goto bpstopfail;
+	if (pec_enabled) pec = pec_crc(pec,smb_addr+1);
 
-	if (pec_enabled) {
-		if (rpec != pec) {
-			 pec_failed=TRUE;	
- 			 goto rlfail;
-		}		
-	}
-	
-	EP0BCH=0;
-	EP0BCL=(blocklen-1)>64 ? 64 : blocklen-1;	
-	
-	goto rlsuccess;
+	// the block read back overwrites the one written, that's all on the bus by now
+	return smb_reply(smb_block_in(pec,xbuf+RESP_HDR,RESP_MAX));
 
-	rlstopfail:
+	bpstopfail:
 	i2c_stop();
-	rlfail:
-	EP0BCH=0;
-	EP0BCL=0;	
-
-	return FALSE;
-	
-	rlsuccess:
-	return TRUE;
+	bpfail:
+	return smb_reply(0);
 
 	break;
 
     case SMB_WRITE_BLOCK:
-	EP0BCL=0; // read from the host
-	while (EP0CS&bmEPBUSY); // wait until ready
-
-	if (templen>0 && count>BLOCK_SEQ_TIMEOUT) {
-		templen=0; tempptr=0;
-	}
-	
-	if (templen==0 && *EP0BUF >64) {		// when no SEQ write in progress and the write is too big to be completed in one req
-		templen=*EP0BUF;			// templen = blocksz 
-		tempptr=0;				
-		// put the 63 bytes into the temp
-		while (tempptr<63) {                    // store the first 63 bytes in this req (max reqsz - blocksz byte)
-			temp[tempptr] = *(EP0BUF+1+tempptr);
-			tempptr++;
-		}
-		count=0;          			// clear timer counter
-		return TRUE;
-		
-	}
-	if (templen>0) {				// if in-progress SEQ write
-		if (tempptr < templen) {		// still data to be read
-			blocklen = templen-tempptr > 64 ? 64 : templen-tempptr; // will it be completed in this req?
-			i=0; j=tempptr;
-			while (i<blocklen) {
-				temp[j] = *(EP0BUF+i);
-				i++; j++;
-			}		
-			tempptr+=i;			
-		}
-		if (tempptr == templen) {	// we have all the data
-				if (!i2c_start()) goto wlfail;
-				if (!i2c_byteout(smb_addr)) goto wlfail;
-				if (!i2c_byteout(smb_cmd)) goto wlfail;	
-				if (!i2c_byteout(templen)) goto wlfail;
-				if (pec_enabled) {
-					pec = pec_crc(pec,smb_addr);
-					pec = pec_crc(pec,smb_cmd);
-					pec = pec_crc(pec,templen);
-				}
-				i=0;
-				while (i<templen) {
-					if (!i2c_byteout(temp[i])) goto wlfail;
-					if (pec_enabled) {
-	       					pec = pec_crc(pec,temp[i]);
-					}
-					i++;
-				}
-				if (pec_enabled) {
-					if (!i2c_byteout(pec)) goto wlfail;					
-				}
-
-				i2c_stop();
-
-	                        tempptr=0; templen=0;	// we're done!
-				
-				goto wlsuccess;
-		} else {
-			return TRUE; // just got some data but not ready to send yet
-		}
+	// blocksz byte and the whole block in one data stage, and the PEC in host PEC mode
+	if (ep0_receive(smb_len) != *xbuf+1+pec_host || smb_len != *xbuf+1+pec_host) {
+		xfer_status = SMB_STATUS_BAD_LENGTH;
+		return smb_done();
 	}
-	
 
 	if (!i2c_start()) goto wlfail;
-	if (!i2c_byteout(smb_addr)) goto wlfail;
-	if (!i2c_byteout(smb_cmd)) goto wlfail;	
-	if (!i2c_byteout(*EP0BUF)) goto wlfail;
+	if (!smb_out(smb_addr,SMB_STATUS_NAK_ADDRESS)) goto wlfail;
+	if (!smb_out(smb_cmd,SMB_STATUS_NAK_COMMAND)) goto wlfail;	
+	if (!smb_out(*xbuf,SMB_STATUS_NAK_DATA)) goto wlfail;
 	if (pec_enabled) {
 		pec = pec_crc(pec,smb_addr);
 		pec = pec_crc(pec,smb_cmd);
-		pec = pec_crc(pec,*EP0BUF);
+		pec = pec_crc(pec,*xbuf);
 	}
 
 	i=0;
-	while (i<*EP0BUF) {
-		if (!i2c_byteout(*(EP0BUF+1+i))) goto wlfail;
+	while (i<*xbuf) {
+		if (!smb_out(*(xbuf+1+i),SMB_STATUS_NAK_DATA)) goto wlfail;
 		if (pec_enabled) {
-			pec = pec_crc(pec,*(EP0BUF+1+i));
+			pec = pec_crc(pec,*(xbuf+1+i));
 		}
 
 		i++;
 	}
 	if (pec_enabled) {
-		if (!i2c_byteout(pec)) goto wlfail;					
+		if (!smb_out(pec_host ? *(xbuf+1+i) : pec,SMB_STATUS_NAK_DATA)) goto wlfail;					
 	}
 
-	i2c_stop();
-	
-	goto wlsuccess;
-
 	wlfail:
 	i2c_stop();
-	return FALSE;
-	
-	wlsuccess:
-	return TRUE;
+	return smb_done();
 
 	break;
     
 
+    case SMB_STAGE_WRITE:
+	stage_len = ep0_receive(smb_len);
+	return TRUE;
+	break;
+
+    case SMB_WRITE_READ:
+	while (EP0CS&bmEPBUSY); // wait until ready
+
+	rs = MSB(smb_addr);
+	smb_addr = LSB(smb_addr);
+	m = rs & SMB_WR_INLINE_MASK;
+	if (m) {
+		*xbuf = LSB(smb_cmd);
+		*(xbuf+1) = MSB(smb_cmd);
+	} else {
+		m = stage_len;
+	}
+	stage_len = 0;
+
+	if (pec_host && !(rs & SMB_WR_CONTINUE)) smb_len--;	// the host left room for the raw PEC
+	blocklen = smb_len > RESP_HDR+RESP_MAX ? RESP_MAX : smb_len-RESP_HDR;
+	if (smb_len <= RESP_HDR) {
+		xfer_status = SMB_STATUS_BAD_LENGTH;
+		return smb_reply(0);
+	}
+
+	// mrq_pec runs over the whole message so SMB_READ can finish a continued read
+	mrq_pec = 0;
+	if (!i2c_start()) goto wrfail;
+	if (!smb_out(smb_addr,SMB_STATUS_NAK_ADDRESS)) goto wrstopfail;
+	mrq_pec = pec_crc(mrq_pec,smb_addr);
+	for (n=0;n<m;n++) {
+		if (!smb_out(*(xbuf+n),n==0 ? SMB_STATUS_NAK_COMMAND : SMB_STATUS_NAK_DATA)) goto wrstopfail;
+		mrq_pec = pec_crc(mrq_pec,*(xbuf+n));
+	}
+	i2c_restart();
+	if (!smb_out(smb_addr|1,SMB_STATUS_NAK_ADDRESS)) goto wrstopfail;
+	mrq_pec = pec_crc(mrq_pec,smb_addr|1);
+
+	// the reply overwrites the write bytes, they're all on the bus by now
+	ack = !(rs & SMB_WR_CONTINUE);	// this is the last read
+	m = blocklen;
+	if (pec_enabled && ack) m++;
+	for (n=0;n<m;n++) {
+		b = i2c_bytein(n==0, n==0 && m==1, ack && n==m-2, ack && n==m-1);
+		if (xfer_status != SMB_STATUS_OK) goto wrfail;
+		if (pec_enabled && ack && n==m-1) {
+			rcv_pec = b;
+		} else {
+			*(xbuf+RESP_HDR+n) = b;
+			mrq_pec = pec_crc(mrq_pec,b);
+		}
+	}
+	if (pec_enabled && ack) pec_in(rcv_pec,mrq_pec,xbuf+RESP_HDR+blocklen);
+	return smb_reply(blocklen);
+
+	wrstopfail:
+	i2c_stop();
+	wrfail:
+	return smb_reply(0);
+	break;
+
     case SMB_WRITE:
-		EP0BCL=0; // read from the host
-		while (EP0CS&bmEPBUSY); // wait for read to finish
+		smb_addr = ep0_receive(smb_addr);
 		if (smb_cmd & SMB_WRITE_CMD_START_FIRST){
 			if (pec_enabled) {
 				mrq_pec = 0; 
@@ -658,63 +1600,64 @@ BOOL handle_vendorcommand(BYTE cmd) {
 		if (smb_cmd & SMB_WRITE_CMD_RESTART_FIRST){
 			i2c_restart();			
 		}	
-		i=0;
-		while (i<smb_addr) {
-			if (!i2c_byteout(*(EP0BUF+i))) goto wafail;
+		n=0;
+		while (n<smb_addr) {
+			// the first byte after a (re)start is the address
+			if (!smb_out(*(xbuf+n),
+				(n==0 && (smb_cmd & (SMB_WRITE_CMD_START_FIRST|SMB_WRITE_CMD_RESTART_FIRST))) ? 
+					SMB_STATUS_NAK_ADDRESS : SMB_STATUS_NAK_DATA)) goto wafail;
 			if (pec_enabled) {
-				mrq_pec = pec_crc(mrq_pec,*(EP0BUF+i));
+				mrq_pec = pec_crc(mrq_pec,*(xbuf+n));
 			}
-			i++;
+			n++;
 		}
 		if (smb_cmd & SMB_WRITE_CMD_STOP_AFTER) {
-			if (pec_enabled) {
-				 if (!i2c_byteout(mrq_pec)) goto wafail;			
+			if (pec_enabled && !pec_host) {	// the host sent its own
+				 if (!smb_out(mrq_pec,SMB_STATUS_NAK_DATA)) goto wafail;			
 			}
 			i2c_stop();
 		}
 
-		goto wasuccess;
+		return smb_done();
 	    
 	    wafail:
 		i2c_stop();
-		return FALSE;
-	    wasuccess:
-		return TRUE;
+		return smb_done();
 	    break;
     case SMB_READ:	    
 	    while (EP0CS&bmEPBUSY); // wait until ready	
 		rs=smb_cmd; //read state	
-		i=0;					
-		j=smb_addr;
+		n=0;					
+		blocklen=smb_addr > RESP_MAX ? RESP_MAX : smb_addr;
+		smb_len=blocklen;
 		if (pec_enabled && (rs & SMB_READ_CMD_LAST_READ)) {
-			j++; // inject read of the pec byte here
+			blocklen++; // inject read of the pec byte here
 		}
-		while (i<j) {
+		while (n<blocklen) {
 			b = i2c_bytein(rs & SMB_READ_CMD_FIRST_READ,
-						 ((rs & SMB_READ_CMD_FIRST_READ) && (j==1)),
-						 ((rs & SMB_READ_CMD_LAST_READ) && (i==j-2)),
-						 ((rs & SMB_READ_CMD_LAST_READ) && (i==j-1)));			
+						 ((rs & SMB_READ_CMD_FIRST_READ) && (blocklen==1)),
+						 ((rs & SMB_READ_CMD_LAST_READ) && (n==blocklen-2)),
+						 ((rs & SMB_READ_CMD_LAST_READ) && (n==blocklen-1)));			
+			if (xfer_status != SMB_STATUS_OK) break;
 			if (pec_enabled) {
-				if ((rs & SMB_READ_CMD_LAST_READ) && (i==j-1)) {
+				if ((rs & SMB_READ_CMD_LAST_READ) && (n==blocklen-1)) {
 					rcv_pec = b;					
+					if (pec_host) pec_in(b,0,xbuf+RESP_HDR+n);
 				} else {
-					*(EP0BUF+i) = b;
+					*(xbuf+RESP_HDR+n) = b;
 					mrq_pec = pec_crc(mrq_pec,b);					
 
 				}
 			} else {
-				*(EP0BUF+i) = b;	
+				*(xbuf+RESP_HDR+n) = b;	
 			}
 		
-			i++;
+			n++;
                         rs &= ~SMB_READ_CMD_FIRST_READ;
 			
 		}
 
-	    EP0BCH=0;
-	    EP0BCL=smb_addr;
-
-	    return TRUE;		
+	    return smb_reply(smb_len);		
 
             break;
 
@@ -731,13 +1674,19 @@ BOOL handle_vendorcommand(BYTE cmd) {
 
 	    return TRUE;	
 	    break;
+     case SMB_GET_STATUS:
+	    while (EP0CS&bmEPBUSY); // wait until ready
+  	    *EP0BUF = last_status;
+  	    *(EP0BUF+1) = last_acked;
+
+	     EP0BCH=0;
+ 	     EP0BCL=2;
+
+	    return TRUE;
+	break;
      case 0x66:
 	    while (EP0CS&bmEPBUSY); // wait until ready
-	    i=0;
-	    while (i<64) {
-		*(EP0BUF+i) = temp[i];
-		i++;
-	    }
+	    xcopy(EP0BUF,xbuf,64);
 	       EP0BCH=0;
  	       EP0BCL=64;
 
@@ -769,68 +1718,74 @@ BOOL handle_vendorcommand(BYTE cmd) {
 	break;
      case SMB_RESET_INTERFACE:
 	    while (EP0CS&bmEPBUSY); // wait until ready
-	    mrq_pec=0; rcv_pec=0; templen=0; tempptr=0; 
+	    mrq_pec=0; rcv_pec=0;
+	    last_status=SMB_STATUS_OK; last_acked=0;
 	    i2c_stop();
 	    return TRUE;
 	break;
+     case SMB_RECOVER_BUS:
+	    while (EP0CS&bmEPBUSY); // wait until ready
+	    mrq_pec=0; rcv_pec=0;
+	    if (!i2c_recover() && xfer_status == SMB_STATUS_OK) xfer_status = SMB_STATUS_BUS_ERROR;
+	    return smb_done();	// stalls if it stays hung, SMB_GET_STATUS tells why
+	break;
      case SMB_TEST_ADDRESS_ACK:
 	    while (EP0CS&bmEPBUSY); // wait until ready
-	        if (!i2c_start()) return FALSE;
-		ack = i2c_byteout(smb_addr);
-		i2c_stop();
-		if (ack) {
-		 *EP0BUF=0xFF;
-		} else {
-		 *EP0BUF=0;
-		}
-    	       EP0BCH=0;
- 	       EP0BCL=1;
-	    return TRUE;   				
+		ack = probe_ack(smb_addr,0,FALSE);
+		xfer_acked = ack;
+		*(xbuf+RESP_HDR) = ack ? 0xFF : 0;
+	    return smb_reply(1);   				
 	    break;
 
      case SMB_TEST_COMMAND_ACK:
 		while (EP0CS&bmEPBUSY); // wait until ready
-		
-	        if (!i2c_start()) return FALSE;
-		if (!i2c_byteout(smb_addr)) goto tcaFail;
-		ack = (i2c_byteout(smb_cmd));
-		tcaFail:
-		i2c_stop();
-		if (ack) {
-		 *EP0BUF=0xFF;
-		} else {
-		 *EP0BUF=0;
-		}
-    	       EP0BCH=0;
- 	       EP0BCL=1;
-	    return TRUE;   				
+		b = probe_ack(smb_addr,smb_cmd,TRUE);
+		xfer_acked = b;
+		*(xbuf+RESP_HDR) = b==2 ? 0xFF : 0;
+	    return smb_reply(1);   				
 	    break;
      case SMB_TEST_COMMAND_WRITE:
 		while (EP0CS&bmEPBUSY); // wait until ready
-		*EP0BUF = 0;
-	        if (!i2c_start()) return FALSE;
-		if (!i2c_byteout(smb_addr)) goto tcwOver;
-		if (i2c_byteout(smb_cmd)) { (*EP0BUF)++; // Command ACK = command exists
-		} else {goto tcwOver;}
-		if (i2c_byteout(3)) { (*EP0BUF)++; // Data Byte #1 ACK = byte writable
-		} else {goto tcwOver;}
-		if (i2c_byteout(0)) { (*EP0BUF)++; // Data Byte #2 ACK = word writable
-		} else {goto tcwOver;}
-		if (!i2c_byteout(0)) {goto tcwOver;}
-		if (i2c_byteout(0)) { (*EP0BUF)++; // Data Byte #4 ACK = block writable
-		} else {goto tcwOver;}
-		if (i2c_byteout(0)) { (*EP0BUF)++; // Data Byte #5 ACK = >block writable
-		} else {goto tcwOver;}
-
-		tcwOver:
-		i2c_stop();
-		
-		EP0BCH=0;
-		EP0BCL=1;
-		
-		return TRUE;   				
+		*(xbuf+RESP_HDR) = probe_write(smb_addr,smb_cmd);
+		return smb_reply(1);   				
+		break;
 
-	        
+     case SMB_SET_SCAN_SKIP:
+		EP0BCL=0; // read from the host
+		while (EP0CS&bmEPBUSY); // wait until ready
+		if (smb_len > 32) smb_len = 32;
+		xcopy(scan_skip,EP0BUF,smb_len);
+		for (i=smb_len;i<32;i++) scan_skip[i] = 0;
+		return TRUE;
+		break;
+
+     case SMB_SCAN_ADDRESS_ACK:
+     case SMB_SCAN_COMMAND_ACK:
+		while (EP0CS&bmEPBUSY); // wait until ready
+		if (cmd == SMB_SCAN_ADDRESS_ACK) smb_cmd = smb_addr;	// range is in wValue for address scans
+		for (i=0;i<32;i++) *(xbuf+RESP_HDR+i) = 0;
+		for (n=smb_cmd&0xFF;n<=(smb_cmd>>8);n++) {
+			if (scan_skip[n>>3] & (1<<(n&7))) continue;
+			if (cmd == SMB_SCAN_ADDRESS_ACK) {
+				ack = probe_ack(n,0,FALSE)==1;
+			} else {
+				ack = probe_ack(smb_addr,n,TRUE)==2;
+			}
+			if (xfer_status != SMB_STATUS_OK) break;
+			if (ack) *(xbuf+RESP_HDR+(n>>3)) |= 1<<(n&7);
+		}
+		return smb_reply(32);
+		break;
+
+     case SMB_SCAN_COMMAND_WRITE:
+		while (EP0CS&bmEPBUSY); // wait until ready
+		blocklen=0;
+		for (n=smb_cmd&0xFF;n<=(smb_cmd>>8);n++) {
+			*(xbuf+RESP_HDR+blocklen) = (scan_skip[n>>3] & (1<<(n&7))) ? 0 : probe_write(smb_addr,n);
+			if (xfer_status != SMB_STATUS_OK) break;
+			blocklen++;
+		}
+		return smb_reply(blocklen);
 		break;
 
      default:
@@ -841,9 +1796,15 @@ BOOL handle_vendorcommand(BYTE cmd) {
   
 
 void timer0_isr() __interrupt TF0_ISR {
+ TH0 = T0_RELOAD>>8;
+ TL0 = T0_RELOAD&0xFF;
  count++;
 }
 
+void ie0_isr() __interrupt IE0_ISR {
+ alert_pending=TRUE;
+}
+
 
 // set *alt_ifc to the current alt interface for ifc
 BOOL handle_get_interface(BYTE ifc, BYTE* alt_ifc) {
@@ -8,7 +8,7 @@ if NOT "%1"=="32" (
 		exit 0
 	)
 )
-gcc -m%1 -Wall -shared smbusb.c fxloader.c -I../libusb_win%1 -L../libusb_win%1 -lusb-1.0 -olibsmbusb.dll
+gcc -m%1 -Wall -shared smbusb.c fxloader.c -I../libusb_win%1 -L../libusb_win%1 -lusb-1.0 -pthread -olibsmbusb.dll
 if %ERRORLEVEL% GTR 0 (
 	echo Error building library
 	exit 1
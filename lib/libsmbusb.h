@@ -24,6 +24,19 @@
 #define ERR_DEVICE_OPEN	-1000
 #define ERR_ALREADY_OPEN -1005
 #define ERR_CLAIM_INTERFACE -1010
+#define ERR_PEC_FAIL -1030
+#define ERR_FIRMWARE_VERSION -1035
+#define ERR_NAK_ADDRESS -1040
+#define ERR_NAK_COMMAND -1041
+#define ERR_NAK_DATA -1042
+#define ERR_BUS_ERROR -1043
+#define ERR_BUS_TIMEOUT -1044
+#define ERR_BAD_BLOCK_LENGTH -1045
+#define ERR_SHORT_REPLY -1046
+#define ERR_TRACE_FORMAT -1050
+#define ERR_TRACE_MISMATCH -1051
+#define ERR_TRACE_END -1052
+#define ERR_QUEUE_STOPPING -1060
 
 #define INIT_RETRY -1020
 
@@ -34,6 +47,36 @@
 #define SMB_FIRMWARE_VERSION 0x98
 
 #define SMB_ENABLE_PEC 0x5
+// SMB_ENABLE_PEC modes, in host mode the firmware passes the PEC bytes through
+#define SMB_PEC_OFF 0
+#define SMB_PEC_FIRMWARE 1
+#define SMB_PEC_HOST 2
+
+#define SMB_SELECT_BUS 0x6		// smb_addr = bus, the following requests go to that bus
+#define SMB_BUS_I2C 0			// the FX2's I2C controller
+#define SMB_BUSES 8			// bit-banged buses 1-4 on PORTB, 5-8 on PORTD
+
+#define SMB_ALERT_ENABLE 0x7		// smb_addr = 1 watch SMBALERT#, the firmware answers it with an ARA read
+#define SMB_ALERT_EP 0x81		// interrupt IN, status, address, sequence number per alert
+
+#define SMB_SNIFF 0x8			// smb_addr = bit-banged bus to watch, 0 stops
+
+#define SMB_SET_TIMEOUT 0x9		// smb_addr = clock low limit in ms, 0 = the default. smb_cmd = bus, 0xFF all
+#define SMB_ALL_BUSES 0xFF
+#define SMB_SNIFF_EP 0x86		// bulk IN, type, data, timestamp low, high per record
+#define SMB_SNIFF_TICK_NS 250		// firmware timestamp tick, CLKOUT/12
+
+// smb_sniff_event types
+#define SMB_SNIFF_START 0x1
+#define SMB_SNIFF_STOP 0x2
+#define SMB_SNIFF_BYTE 0x3
+#define SMB_SNIFF_WRAP 0x4		// timestamp wrap, folded into the time and never handed out
+#define SMB_SNIFF_LOST 0x5		// data = records the firmware dropped while its buffers were full
+
+// A device behind a PCA9548 style mux, usable wherever an address is taken
+#define SMB_MUX_FLAG 0x800
+#define SMB_MUX_ADDRESS(mux,channel,addr) ((((mux)&0xFF)<<16) | (((channel)&7)<<8) | SMB_MUX_FLAG | ((addr)&0xFF))
+#define SMB_MUX_CHANNEL_MASK 0xFFFF00	// the mux and channel part of an SMB_MUX_ADDRESS
 
 // Standard SMB protocol convenience commands
 
@@ -43,10 +86,27 @@
 
 #define SMB_READ_WORD 0x20
 #define SMB_WRITE_WORD 0x21
+#define SMB_READ_WORDS 0x22		// smb_cmd = first command | count<<8, replies status,lo,hi per word
+#define SMB_READ_WORD_MULTI 0x23	// smb_addr = address | bus mask<<8, replies status,lo,hi per bus
 
 #define SMB_READ_BLOCK 0x30
 #define SMB_WRITE_BLOCK 0x32
 
+// START, ADDR, write bytes, RESTART, ADDR+1, read bytes, (PEC), STOP in one request
+#define SMB_WRITE_READ 0x40		// smb_addr = address | flags<<8, smb_cmd = inline write bytes
+#define SMB_WR_INLINE_MASK 0x3		// 1-2 write bytes are in smb_cmd, 0 = the staged ones
+#define SMB_WR_CONTINUE 0x4		// leave the read open, SMB_READ finishes it
+#define SMB_STAGE_WRITE 0x41		// OUT, write bytes for the SMB_WRITE_READ/BLOCK_PROCESS_CALL/READ_*_LIST that follows
+
+#define SMB_PROCESS_CALL 0x24		// smb_addr = address | command<<8, smb_cmd = data word
+#define SMB_READ_WORD_LIST 0x25		// Read Words of the staged command list from entry smb_cmd on
+#define SMB_BLOCK_PROCESS_CALL 0x34	// writes the staged block, replies with the block read back
+#define SMB_READ_BLOCK_LIST 0x35	// Block Reads of the staged command list from entry smb_cmd on
+#define SMB_LIST_MAX 128		// commands in a staged list
+#define SMB_BLOCK_STRIDE 256		// bytes per block in SMBReadBlocks' buffer
+
+#define SMB_WRITE_READ_NO_STOP 0x1	// SMBWriteRead flag: leave the read open for SMBRead(..., lastRead)
+
 #define SMB_GET_CLEAR_PEC_FAIL 0x54
 
 // Arbitrary SMB(/I2C) operations
@@ -60,8 +120,27 @@
 #define SMB_READ_CMD_LAST_READ 0x2	// last read block, handles LASTRD, STOP
 
 #define SMB_GET_MRQ_PECS	0x55
+#define SMB_GET_STATUS		0x56	// status and ACKed byte count of the last SMBus operation
+
+// Replies to SMBus IN requests start with a status header: status byte, number of bytes
+// the slave ACKed, then the payload. Failed OUT requests stall, SMB_GET_STATUS tells why.
+// Data stages span as many EP0 packets as needed, up to SMB_RESP_MAX bytes of payload.
+
+#define SMB_RESP_HDR 2
+#define SMB_RESP_MAX 256
+
+#define SMB_STATUS_OK 0
+#define SMB_STATUS_NAK_ADDRESS 1
+#define SMB_STATUS_NAK_COMMAND 2
+#define SMB_STATUS_NAK_DATA 3
+#define SMB_STATUS_BUS_ERROR 4
+#define SMB_STATUS_TIMEOUT 5
+#define SMB_STATUS_PEC 6
+#define SMB_STATUS_BAD_LENGTH 7
 
-#define SMB_STOP 0x60
+#define SMB_STOP 0x60			// deprecated, the firmware never had it. SMB_RESET_INTERFACE sends STOP
+#define SMB_RESET_INTERFACE 0x61	// clears the PEC and status state, sends STOP
+#define SMB_RECOVER_BUS 0x62		// frees a hung bit-banged bus: up to 9 SCL clocks, STOP, stalls if it stays hung
                                  
 // SMB Hacking and Discovery
 
@@ -69,6 +148,207 @@
 #define SMB_TEST_COMMAND_ACK 0x91
 #define SMB_TEST_COMMAND_WRITE 0x92
 
+// Batched versions of the above. wIndex (wValue for addresses) = begin | end<<8
+#define SMB_SCAN_ADDRESS_ACK 0x93	// replies with a 256 bit ACK bitmap
+#define SMB_SCAN_COMMAND_ACK 0x94	// replies with a 256 bit ACK bitmap
+#define SMB_SCAN_COMMAND_WRITE 0x95	// replies with a writability level per command
+#define SMB_SET_SCAN_SKIP 0x96		// OUT, 256 bit bitmap of addresses/commands the scans skip
+
+#define SMB_SCAN_MAP_SIZE 32		// bytes in a skip/ACK bitmap, bit n = byte n>>3, bit n&7
+
+// Retry policy, errors that make a transaction retry
+
+#define SMB_RETRY_ON_PEC 0x1		// PEC mismatch on a read
+#define SMB_RETRY_ON_TIMEOUT 0x2	// USB timeout
+#define SMB_RETRY_ON_STALL 0x4		// firmware stalled the request without telling why
+#define SMB_RETRY_ON_OTHER 0x8		// any other libusb error
+#define SMB_RETRY_ON_NAK 0x10		// slave NAKed the address, command or data
+#define SMB_RETRY_ON_BUS 0x20		// SMBus bus error or clock stretching timeout
+#define SMB_RETRY_ON_ALL 0x3F
+
+struct smb_retry_policy {
+	unsigned int maxAttempts;	// total attempts per transaction, 1 = never retry
+	unsigned int backoffUs;		// delay before the first retry
+	unsigned int backoffFactor;	// the delay is multiplied by this for every further retry
+	unsigned int retryOn;		// SMB_RETRY_ON_* mask
+};
+
+struct smb_result {
+	int status;			// what the last transaction returned
+	unsigned int attempts;		// attempts it took, retries = attempts-1
+	unsigned char pecFailed;	// last attempt failed on PEC mismatch
+	unsigned char acked;		// bytes the slave ACKed in the last attempt (reads and failed writes)
+	unsigned long totalRetries;	// retries since the library was loaded
+};
+
+// Timeouts. The USB ones bound how long the host waits for a reply, the clock low
+// limit is SMBus tTIMEOUT: the firmware fails the transaction with ERR_BUS_TIMEOUT
+// once a slave has held SCL low that long, well before the USB timeout runs out
+#define SMB_TIMEOUT_TRANSFER 100	// ms
+#define SMB_TIMEOUT_BATCH 1000		// ms
+#define SMB_CLOCK_LOW_DEFAULT 35	// ms, the top of the 25-35ms tTIMEOUT range
+
+struct smb_timeouts {
+	unsigned int transfer;		// USB timeout of a request that runs one transaction
+	unsigned int batch;		// of one that runs many: lists, multi-bus reads, Block Process Call, Write-Read, scans (x2)
+	unsigned char clockLow;		// firmware clock low limit in ms, 0 = leave the buses' own
+};
+
+struct smb_recovery_stats {
+	unsigned long attempts;		// bus recoveries run, by SMBRecoverBus or after a bus error/timeout
+	unsigned long recovered;	// the bus was free afterwards
+	unsigned long failed;		// it stayed hung
+};
+
+// Read cache register classes
+#define SMB_CACHE_VOLATILE 0		// never cached, undeclared registers are volatile
+#define SMB_CACHE_SLOW 1		// cached for the slow TTL
+#define SMB_CACHE_STATIC 2		// cached for the static TTL, by default until invalidated
+#define SMB_CACHE_REGISTERS 64		// declarations, and values cached, at most
+
+struct smb_cache_stats {
+	unsigned long hits;		// reads answered from the cache
+	unsigned long misses;		// reads of declared registers that went to the device
+	unsigned long invalidations;	// values dropped by writes, reopens and SMBCacheInvalidate
+};
+
+// Completion of an SMBAsync* request: status is what the synchronous call would return, 
+// data/len the block for SMBAsyncReadBlock
+typedef void (*smb_async_done)(int status, const unsigned char *data, unsigned int len, void *user);
+
+// A unit of work for the submission queue, any sequence of SMB* calls that has to run uninterrupted
+typedef int (*smb_unit_fn)(void *arg);
+typedef void (*smb_unit_done)(int result, void *arg);
+
+struct smb_sniff_event {
+	unsigned long long time;	// ns since SMBSniffStart
+	unsigned char type;		// SMB_SNIFF_*
+	unsigned char data;		// the byte, or records lost (saturates at 255)
+	unsigned char nak;		// the byte was NAKed
+};
+
+// pcapng captures of the vendor requests, see smbusb.lua for the record layout
+#define SMB_CAPTURE_LINKTYPE 147	// LINKTYPE_USER0
+#define SMB_CAPTURE_VERSION 1
+
+struct smb_replay_stats {
+	unsigned long requests;		// vendor requests replayed
+	unsigned long mismatches;	// requests whose result or reply differs from the trace
+	unsigned long long recordedUs;	// time the requests took when recorded
+	unsigned long long replayUs;	// and on replay
+};
+
+// Event log levels. Events above SMB_LOG_MAX, if the library was built with it, aren't compiled in
+#define SMB_LOG_ERROR 1
+#define SMB_LOG_WARN 2
+#define SMB_LOG_INFO 3
+#define SMB_LOG_DEBUG 4
+
+#define SMB_EVENT_MESSAGE 0		// text, status = error code if any
+#define SMB_EVENT_SUBMIT 1		// request about to be sent: request, value, index
+#define SMB_EVENT_COMPLETE 2		// request done: request, status, index = us it took
+#define SMB_EVENT_RETRY 3		// transaction retried: status that caused it, value = attempt
+#define SMB_EVENT_STALL 4		// firmware stalled a request: request, status = the error it reported
+#define SMB_EVENT_FIRMWARE 5		// firmware version mismatch: value = version found
+#define SMB_EVENT_DROPPED 6		// value = events lost because the log wasn't read in time
+#define SMB_EVENT_RECOVERY 7		// bus recovery ran: status = 0 or why the bus stayed hung, value = bus
+
+struct smb_log_event {
+	unsigned long long timeUs;	// monotonic clock
+	unsigned char level;		// SMB_LOG_*
+	unsigned char type;		// SMB_EVENT_*
+	unsigned char request;
+	int status;
+	unsigned int value;
+	unsigned int index;
+	const char *text;		// static string or NULL
+};
+
+// Smart Battery Specification registers
+
+#define SBS_DEFAULT_ADDRESS 0x16
+
+#define SBS_MANUFACTURER_ACCESS 0x00
+#define SBS_REMAINING_CAPACITY_ALARM 0x01
+#define SBS_REMAINING_TIME_ALARM 0x02
+#define SBS_BATTERY_MODE 0x03
+#define SBS_AT_RATE 0x04
+#define SBS_AT_RATE_TIME_TO_FULL 0x05
+#define SBS_AT_RATE_TIME_TO_EMPTY 0x06
+#define SBS_AT_RATE_OK 0x07
+#define SBS_TEMPERATURE 0x08
+#define SBS_VOLTAGE 0x09
+#define SBS_CURRENT 0x0A
+#define SBS_AVERAGE_CURRENT 0x0B
+#define SBS_MAX_ERROR 0x0C
+#define SBS_RELATIVE_STATE_OF_CHARGE 0x0D
+#define SBS_ABSOLUTE_STATE_OF_CHARGE 0x0E
+#define SBS_REMAINING_CAPACITY 0x0F
+#define SBS_FULL_CHARGE_CAPACITY 0x10
+#define SBS_RUN_TIME_TO_EMPTY 0x11
+#define SBS_AVERAGE_TIME_TO_EMPTY 0x12
+#define SBS_AVERAGE_TIME_TO_FULL 0x13
+#define SBS_CHARGING_CURRENT 0x14
+#define SBS_CHARGING_VOLTAGE 0x15
+#define SBS_BATTERY_STATUS 0x16
+#define SBS_CYCLE_COUNT 0x17
+#define SBS_DESIGN_CAPACITY 0x18
+#define SBS_DESIGN_VOLTAGE 0x19
+#define SBS_SPECIFICATION_INFO 0x1A
+#define SBS_MANUFACTURE_DATE 0x1B
+#define SBS_SERIAL_NUMBER 0x1C
+#define SBS_MANUFACTURER_NAME 0x20
+#define SBS_DEVICE_NAME 0x21
+#define SBS_DEVICE_CHEMISTRY 0x22
+#define SBS_MANUFACTURER_DATA 0x23
+
+#define SBS_WORD_REGISTERS 0x1D		// 0x00 - 0x1C are words
+#define SBS_REGISTERS 0x24
+
+struct sbs_snapshot {
+	int status[SBS_REGISTERS];	// per register: 0 if read, <0 error code. Reserved 0x1D-0x1F read as ERR_NAK_COMMAND
+
+	unsigned short manufacturerAccess;
+	unsigned short remainingCapacityAlarm;	// mAh or 10mWh
+	unsigned short remainingTimeAlarm;	// min
+	unsigned short batteryMode;
+	short atRate;				// mA or 10mW
+	unsigned short atRateTimeToFull;	// min
+	unsigned short atRateTimeToEmpty;	// min
+	unsigned short atRateOK;
+	unsigned short temperature;		// 0.1K
+	unsigned short voltage;			// mV
+	short current;				// mA
+	short averageCurrent;			// mA
+	unsigned short maxError;		// %
+	unsigned short relativeStateOfCharge;	// %
+	unsigned short absoluteStateOfCharge;	// %
+	unsigned short remainingCapacity;	// mAh or 10mWh
+	unsigned short fullChargeCapacity;	// mAh or 10mWh
+	unsigned short runTimeToEmpty;		// min
+	unsigned short averageTimeToEmpty;	// min
+	unsigned short averageTimeToFull;	// min
+	unsigned short chargingCurrent;		// mA
+	unsigned short chargingVoltage;		// mV
+	unsigned short batteryStatus;
+	unsigned short cycleCount;
+	unsigned short designCapacity;		// mAh or 10mWh
+	unsigned short designVoltage;		// mV
+	unsigned short specificationInfo;
+	unsigned short manufactureDate;		// (year-1980)<<9 | month<<5 | day
+	unsigned short serialNumber;
+
+	char manufacturerName[256];		// 0 terminated
+	char deviceName[256];
+	char deviceChemistry[256];
+	unsigned char manufacturerData[256];
+	int manufacturerDataLen;
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 extern int SMBOpenDeviceVIDPID(unsigned int vid,unsigned int pid);
 extern int SMBOpenDeviceBusAddr(unsigned int bus, unsigned int addr);
 extern void SMBCloseDevice();
@@ -81,10 +361,75 @@ extern int SMBReadWord(unsigned int address, unsigned char command);
 extern int SMBWriteWord(unsigned int address, unsigned char command, unsigned int data);
 extern int SMBReadBlock(unsigned int address, unsigned char command, unsigned char *data);
 extern int SMBWriteBlock(unsigned int address, unsigned char command, unsigned char *data, unsigned char len);
+extern int SMBProcessCall(unsigned int address, unsigned char command, unsigned int data);
+extern int SMBBlockProcessCall(unsigned int address, unsigned char command, unsigned char *wdata, unsigned char wlen, unsigned char *rdata);
+
+extern int SMBReadWords(unsigned int address, const unsigned char *commands, unsigned int count, unsigned short *words, int *wordStatus);
+extern int SMBReadBlocks(unsigned int address, const unsigned char *commands, unsigned int count, unsigned char *blocks, int *blockStatus);
+
+extern long SMBAsyncReadByte(unsigned int address, unsigned char command, unsigned int timeout, smb_async_done done, void *user);
+extern long SMBAsyncReadWord(unsigned int address, unsigned char command, unsigned int timeout, smb_async_done done, void *user);
+extern long SMBAsyncReadBlock(unsigned int address, unsigned char command, unsigned int timeout, smb_async_done done, void *user);
+extern long SMBAsyncWriteByte(unsigned int address, unsigned char command, unsigned char data, unsigned int timeout, smb_async_done done, void *user);
+extern long SMBAsyncWriteWord(unsigned int address, unsigned char command, unsigned int data, unsigned int timeout, smb_async_done done, void *user);
+extern int SMBAsyncCancel(long id);
+extern int SMBAsyncPending();
+extern int SMBAsyncPoll(unsigned int timeout);
+
+extern int SMBQueueStart();
+extern void SMBQueueStop();
+extern int SMBQueueRun(smb_unit_fn unit, void *arg);
+extern int SMBQueueSubmit(smb_unit_fn unit, void *arg, smb_unit_done done);
+
+extern int SMBSelectBus(unsigned char bus);
+extern int SMBReadWordMulti(unsigned char busMask, unsigned int address, unsigned char command, unsigned short *words, int *wordStatus);
+
+extern int SMBEnableAlert(unsigned char enable);
+extern int SMBWaitAlert(unsigned int timeout);
+
+extern int SMBSniffStart(unsigned char bus);
+extern int SMBSniffRead(struct smb_sniff_event *events, unsigned int max, unsigned int timeout);
+extern int SMBSniffStop();
+
+extern int SMBTraceStart(const char *path);
+extern void SMBTraceStop();
+extern int SMBOpenTrace(const char *path);
+extern int SMBReplayTrace(const char *path, struct smb_replay_stats *stats);
+
+extern int SMBCaptureStart(const char *path);
+extern void SMBCaptureStop();
+
+extern void SMBResetMuxCache();
+extern int SMBOrderByChannel(const unsigned int *addresses, unsigned int count, unsigned int *order);
+
+extern int SMBReadSBSSnapshot(unsigned int address, struct sbs_snapshot *snapshot);
+
+extern void SMBCacheEnable(unsigned char state);
+extern void SMBCacheSetTTL(unsigned char registerClass, unsigned int ttlMs);
+extern int SMBCacheDeclare(unsigned int address, unsigned char command, unsigned char registerClass);
+extern int SMBCacheDeclareSBS(unsigned int address);
+extern void SMBCacheInvalidate(unsigned int address);
+extern void SMBGetCacheStats(struct smb_cache_stats *stats);
 
 extern void SMBEnablePEC(unsigned char state);
+extern void SMBSetPECMode(unsigned char mode);
 extern unsigned char SMBGetLastReadPECFail();
 
+extern void SMBSetRetryPolicy(const struct smb_retry_policy *policy);
+extern void SMBGetRetryPolicy(struct smb_retry_policy *policy);
+extern void SMBGetLastResult(struct smb_result *result);
+
+extern int SMBRecoverBus();
+extern void SMBSetAutoRecover(unsigned char enable);
+extern void SMBGetRecoveryStats(struct smb_recovery_stats *stats);
+
+extern int SMBSetTimeouts(const struct smb_timeouts *timeouts);
+extern void SMBGetTimeouts(struct smb_timeouts *timeouts);
+extern int SMBSetBusTimeout(unsigned char bus, unsigned char clockLowMs);
+extern int SMBWithTimeouts(const struct smb_timeouts *timeouts, smb_unit_fn unit, void *arg);
+
+extern int SMBWriteRead(unsigned int address, unsigned char *wbuf, unsigned int wlen, unsigned char *rbuf, unsigned int rlen, unsigned char flags);
+
 extern int SMBWrite(unsigned char start, unsigned char restart, unsigned char stop, unsigned char *data, unsigned int len);
 extern int SMBRead(unsigned int len, unsigned char* data, unsigned char lastRead);
 extern unsigned int SMBGetArbPEC();
@@ -93,6 +438,18 @@ extern int SMBTestAddressACK(unsigned int address);
 extern int SMBTestCommandACK(unsigned int address, unsigned char command);
 extern int SMBTestCommandWrite(unsigned int address, unsigned char command);
 
+extern int SMBScanAddressACK(unsigned char begin, unsigned char end, const unsigned char *skipMap, unsigned char *ackMap);
+extern int SMBScanCommandACK(unsigned int address, unsigned char begin, unsigned char end, const unsigned char *skipMap, unsigned char *ackMap);
+extern int SMBScanCommandWrite(unsigned int address, unsigned char begin, unsigned char end, const unsigned char *skipMap, unsigned char *levels);
+
 void SMBSetDebugLogFunc(void *logFunc);
+extern void SMBSetLogLevel(unsigned char level);
+extern int SMBReadLogEvents(struct smb_log_event *events, unsigned int max);
+extern int SMBFormatLogEvent(const struct smb_log_event *event, char *buf, unsigned int len);
+extern void SMBFlushLog();
+
+const char* SMBGetErrorString(int errorCode);
 
-const char* SMBGetErrorString(int errorCode);
\ No newline at end of file
+#ifdef __cplusplus
+}
+#endif
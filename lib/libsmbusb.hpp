@@ -0,0 +1,322 @@
+/*
+* Copyright (c) 2016 Viktor <github@karosium.e4ward.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public
+* License as published by the Free Software Foundation; either
+* version 2.1 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+/*
+* Typed Smart Battery registers for C++17, header only.
+*
+*   smbusb::Device battery{SBS_DEFAULT_ADDRESS};
+*   auto r = smbusb::sbs::read<smbusb::sbs::Voltage, smbusb::sbs::Current>(battery);
+*   if (r.ok()) printf("%u mV %d mA\n", r.get<smbusb::sbs::Voltage>(), r.get<smbusb::sbs::Current>());
+*
+* The register list is resolved at compile time: the words become one
+* SMBReadWords, the blocks one SMBReadBlocks, a single register the plain
+* SMBReadWord/SMBReadBlock. Conversions are constexpr and inline.
+*/
+#ifndef LIBSMBUSB_HPP
+#define LIBSMBUSB_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "libsmbusb.h"
+
+namespace smbusb {
+
+// A device on the bus, the address as the C functions take it (SMB_MUX_ADDRESS too)
+struct Device {
+	unsigned int address;
+};
+
+namespace sbs {
+
+enum class Unit { None, MilliVolt, MilliAmp, Capacity, Minutes, Percent, Celsius, Date, Hex, Text, Data };
+
+// Capacity is mAh or 10mWh depending on BatteryMode CAPACITY_MODE
+constexpr const char *unitName(Unit unit) {
+	switch (unit) {
+		case Unit::MilliVolt: return "mV";
+		case Unit::MilliAmp: return "mA";
+		case Unit::Capacity: return "mAh(/10mWh)";
+		case Unit::Minutes: return "min";
+		case Unit::Percent: return "%";
+		case Unit::Celsius: return "degC";
+		default: return "";
+	}
+}
+
+struct Date {
+	unsigned year;
+	unsigned month;
+	unsigned day;
+};
+
+/*
+* Register descriptions. Raw is what's on the wire, value_type what read<>
+* returns after convert().
+*/
+template <unsigned char Command, typename Raw, Unit U>
+struct Word {
+	using raw_type = Raw;
+	using value_type = Raw;
+	static constexpr unsigned char command = Command;
+	static constexpr bool block = false;
+	static constexpr Unit unit = U;
+	static constexpr bool isSigned = std::is_signed<Raw>::value;
+
+	static constexpr value_type convert(std::uint16_t w) { return static_cast<Raw>(w); }
+};
+
+template <unsigned char Command, typename Value, Unit U>
+struct Block {
+	using raw_type = unsigned char;
+	using value_type = Value;
+	static constexpr unsigned char command = Command;
+	static constexpr bool block = true;
+	static constexpr Unit unit = U;
+	static constexpr bool isSigned = false;
+
+	static value_type convert(const unsigned char *data, int len) { return value_type(data, data+len); }
+};
+
+#define SBS_REGISTER(type,label,...) struct type : __VA_ARGS__ { static constexpr const char *name = label; }
+
+SBS_REGISTER(ManufacturerAccess, "Manufacturer Access", Word<SBS_MANUFACTURER_ACCESS, std::uint16_t, Unit::Hex>);
+SBS_REGISTER(RemainingCapacityAlarm, "Remaining Capacity Alarm", Word<SBS_REMAINING_CAPACITY_ALARM, std::uint16_t, Unit::Capacity>);
+SBS_REGISTER(RemainingTimeAlarm, "Remaining Time Alarm", Word<SBS_REMAINING_TIME_ALARM, std::uint16_t, Unit::Minutes>);
+SBS_REGISTER(BatteryMode, "Battery Mode", Word<SBS_BATTERY_MODE, std::uint16_t, Unit::Hex>);
+SBS_REGISTER(AtRate, "At Rate", Word<SBS_AT_RATE, std::int16_t, Unit::Capacity>);
+SBS_REGISTER(AtRateTimeToFull, "At Rate Time To Full", Word<SBS_AT_RATE_TIME_TO_FULL, std::uint16_t, Unit::Minutes>);
+SBS_REGISTER(AtRateTimeToEmpty, "At Rate Time To Empty", Word<SBS_AT_RATE_TIME_TO_EMPTY, std::uint16_t, Unit::Minutes>);
+SBS_REGISTER(AtRateOK, "At Rate OK", Word<SBS_AT_RATE_OK, std::uint16_t, Unit::None>);
+SBS_REGISTER(Voltage, "Voltage", Word<SBS_VOLTAGE, std::uint16_t, Unit::MilliVolt>);
+SBS_REGISTER(Current, "Current", Word<SBS_CURRENT, std::int16_t, Unit::MilliAmp>);
+SBS_REGISTER(AverageCurrent, "Average Current", Word<SBS_AVERAGE_CURRENT, std::int16_t, Unit::MilliAmp>);
+SBS_REGISTER(MaxError, "Max Error", Word<SBS_MAX_ERROR, std::uint16_t, Unit::Percent>);
+SBS_REGISTER(RelativeStateOfCharge, "Relative State Of Charge", Word<SBS_RELATIVE_STATE_OF_CHARGE, std::uint16_t, Unit::Percent>);
+SBS_REGISTER(AbsoluteStateOfCharge, "Absolute State Of Charge", Word<SBS_ABSOLUTE_STATE_OF_CHARGE, std::uint16_t, Unit::Percent>);
+SBS_REGISTER(RemainingCapacity, "Remaining Capacity", Word<SBS_REMAINING_CAPACITY, std::uint16_t, Unit::Capacity>);
+SBS_REGISTER(FullChargeCapacity, "Full Charge Capacity", Word<SBS_FULL_CHARGE_CAPACITY, std::uint16_t, Unit::Capacity>);
+SBS_REGISTER(RunTimeToEmpty, "Run Time To Empty", Word<SBS_RUN_TIME_TO_EMPTY, std::uint16_t, Unit::Minutes>);
+SBS_REGISTER(AverageTimeToEmpty, "Average Time To Empty", Word<SBS_AVERAGE_TIME_TO_EMPTY, std::uint16_t, Unit::Minutes>);
+SBS_REGISTER(AverageTimeToFull, "Average Time To Full", Word<SBS_AVERAGE_TIME_TO_FULL, std::uint16_t, Unit::Minutes>);
+SBS_REGISTER(ChargingCurrent, "Charging Current", Word<SBS_CHARGING_CURRENT, std::uint16_t, Unit::MilliAmp>);
+SBS_REGISTER(ChargingVoltage, "Charging Voltage", Word<SBS_CHARGING_VOLTAGE, std::uint16_t, Unit::MilliVolt>);
+SBS_REGISTER(BatteryStatus, "Battery Status", Word<SBS_BATTERY_STATUS, std::uint16_t, Unit::Hex>);
+SBS_REGISTER(CycleCount, "Cycle Count", Word<SBS_CYCLE_COUNT, std::uint16_t, Unit::None>);
+SBS_REGISTER(DesignCapacity, "Design Capacity", Word<SBS_DESIGN_CAPACITY, std::uint16_t, Unit::Capacity>);
+SBS_REGISTER(DesignVoltage, "Design Voltage", Word<SBS_DESIGN_VOLTAGE, std::uint16_t, Unit::MilliVolt>);
+SBS_REGISTER(SpecificationInfo, "Specification Info", Word<SBS_SPECIFICATION_INFO, std::uint16_t, Unit::Hex>);
+SBS_REGISTER(SerialNumber, "Serial Number", Word<SBS_SERIAL_NUMBER, std::uint16_t, Unit::None>);
+SBS_REGISTER(ManufacturerName, "Manufacturer Name", Block<SBS_MANUFACTURER_NAME, std::string, Unit::Text>);
+SBS_REGISTER(DeviceName, "Device Name", Block<SBS_DEVICE_NAME, std::string, Unit::Text>);
+SBS_REGISTER(DeviceChemistry, "Device Chemistry", Block<SBS_DEVICE_CHEMISTRY, std::string, Unit::Text>);
+SBS_REGISTER(ManufacturerData, "Manufacturer Data", Block<SBS_MANUFACTURER_DATA, std::vector<std::uint8_t>, Unit::Data>);
+
+#undef SBS_REGISTER
+
+// 0.1K on the wire
+struct Temperature : Word<SBS_TEMPERATURE, std::uint16_t, Unit::Celsius> {
+	using value_type = double;
+	static constexpr const char *name = "Temperature";
+	static constexpr value_type convert(std::uint16_t w) { return w*0.1 - 273.15; }
+};
+
+// (year-1980)<<9 | month<<5 | day
+struct ManufactureDate : Word<SBS_MANUFACTURE_DATE, std::uint16_t, Unit::Date> {
+	using value_type = sbs::Date;
+	static constexpr const char *name = "Manufacture Date";
+	static constexpr value_type convert(std::uint16_t w) { return { 1980u + (w>>9), (w>>5) & 0xFu, w & 0x1Fu }; }
+};
+
+/*
+* The same registers as a table, for code that walks all of them.
+*/
+struct RegisterInfo {
+	unsigned char command;
+	const char *name;
+	Unit unit;
+	bool isSigned;
+	bool block;
+};
+
+template <typename R>
+constexpr RegisterInfo info() {
+	return { R::command, R::name, R::unit, R::isSigned, R::block };
+}
+
+constexpr RegisterInfo registers[] = {
+	info<ManufacturerAccess>(), info<RemainingCapacityAlarm>(), info<RemainingTimeAlarm>(),
+	info<BatteryMode>(), info<AtRate>(), info<AtRateTimeToFull>(), info<AtRateTimeToEmpty>(),
+	info<AtRateOK>(), info<Temperature>(), info<Voltage>(), info<Current>(), info<AverageCurrent>(),
+	info<MaxError>(), info<RelativeStateOfCharge>(), info<AbsoluteStateOfCharge>(),
+	info<RemainingCapacity>(), info<FullChargeCapacity>(), info<RunTimeToEmpty>(),
+	info<AverageTimeToEmpty>(), info<AverageTimeToFull>(), info<ChargingCurrent>(),
+	info<ChargingVoltage>(), info<BatteryStatus>(), info<CycleCount>(), info<DesignCapacity>(),
+	info<DesignVoltage>(), info<SpecificationInfo>(), info<ManufactureDate>(), info<SerialNumber>(),
+	info<ManufacturerName>(), info<DeviceName>(), info<DeviceChemistry>(), info<ManufacturerData>()
+};
+
+static_assert(sizeof(registers)/sizeof(registers[0]) == SBS_WORD_REGISTERS + 4, "SBS register table is incomplete");
+
+namespace detail {
+
+template <typename R, typename... Regs>
+constexpr std::size_t indexOf() {
+	constexpr bool same[] = { std::is_same<R, Regs>::value... };
+	for (std::size_t i=0;i<sizeof...(Regs);i++) {
+		if (same[i]) return i;
+	}
+	return sizeof...(Regs);
+}
+
+template <bool IsBlock, typename... Regs>
+constexpr std::size_t countOf() {
+	constexpr bool block[] = { Regs::block... };
+	std::size_t n=0;
+	for (std::size_t i=0;i<sizeof...(Regs);i++) {
+		if (block[i] == IsBlock) n++;
+	}
+	return n;
+}
+
+// where register I goes among the registers of its kind
+template <std::size_t I, typename... Regs>
+constexpr std::size_t slotOf() {
+	constexpr bool block[] = { Regs::block... };
+	std::size_t n=0;
+	for (std::size_t i=0;i<I;i++) {
+		if (block[i] == block[I]) n++;
+	}
+	return n;
+}
+
+template <bool IsBlock, typename... Regs>
+constexpr std::array<unsigned char, countOf<IsBlock, Regs...>()> commandsOf() {
+	constexpr bool block[] = { Regs::block... };
+	constexpr unsigned char command[] = { Regs::command... };
+	std::array<unsigned char, countOf<IsBlock, Regs...>()> out{};
+	std::size_t n=0;
+	for (std::size_t i=0;i<sizeof...(Regs);i++) {
+		if (block[i] == IsBlock) out[n++] = command[i];
+	}
+	return out;
+}
+
+} // namespace detail
+
+template <typename... Regs>
+struct Reading {
+	std::tuple<typename Regs::value_type...> values;
+	std::array<int, sizeof...(Regs)> status{};	// per register, 0 or the error code
+
+	template <typename R>
+	const typename R::value_type &get() const {
+		static_assert(detail::indexOf<R, Regs...>() < sizeof...(Regs), "register wasn't read");
+		return std::get<detail::indexOf<R, Regs...>()>(values);
+	}
+
+	template <typename R>
+	int statusOf() const {
+		static_assert(detail::indexOf<R, Regs...>() < sizeof...(Regs), "register wasn't read");
+		return status[detail::indexOf<R, Regs...>()];
+	}
+
+	bool ok() const {
+		for (int s : status) {
+			if (s < 0) return false;
+		}
+		return true;
+	}
+};
+
+namespace detail {
+
+template <typename... Regs, std::size_t... I>
+void unpack(Reading<Regs...> &r, const unsigned short *words, const int *wordStatus,
+		const unsigned char *blocks, const int *blockStatus, std::index_sequence<I...>) {
+	auto one = [&](auto reg, auto index) {
+		using R = decltype(reg);
+		constexpr std::size_t i = decltype(index)::value;
+		constexpr std::size_t slot = slotOf<i, Regs...>();
+		if constexpr (R::block) {
+			r.status[i] = blockStatus[slot] < 0 ? blockStatus[slot] : 0;
+			if (blockStatus[slot] >= 0) std::get<i>(r.values) = R::convert(blocks + slot*SMB_BLOCK_STRIDE, blockStatus[slot]);
+		} else {
+			r.status[i] = wordStatus[slot];
+			if (wordStatus[slot] == 0) std::get<i>(r.values) = R::convert(words[slot]);
+		}
+	};
+	(one(Regs{}, std::integral_constant<std::size_t, I>{}), ...);
+}
+
+} // namespace detail
+
+/*
+* Reads the registers in one batched request per kind. A failed register
+* leaves its value default constructed and its status <0.
+*/
+template <typename... Regs>
+Reading<Regs...> read(const Device &dev) {
+	constexpr std::size_t words = detail::countOf<false, Regs...>();
+	constexpr std::size_t blocks = detail::countOf<true, Regs...>();
+	static constexpr auto wordCommands = detail::commandsOf<false, Regs...>();
+	static constexpr auto blockCommands = detail::commandsOf<true, Regs...>();
+
+	Reading<Regs...> r{};
+	std::array<unsigned short, words> w{};
+	std::array<int, words> ws{};
+	std::vector<unsigned char> b(blocks*SMB_BLOCK_STRIDE);
+	std::array<int, blocks> bs{};
+	int status;
+
+	static_assert(sizeof...(Regs) > 0, "nothing to read");
+
+	if constexpr (words == 1) {
+		status = SMBReadWord(dev.address, wordCommands[0]);
+		ws[0] = status < 0 ? status : 0;
+		w[0] = status < 0 ? 0 : status;
+	} else if constexpr (words > 1) {
+		if ((status = SMBReadWords(dev.address, wordCommands.data(), words, w.data(), ws.data())) < 0) {
+			r.status.fill(status);
+			return r;
+		}
+	}
+
+	if constexpr (blocks == 1) {
+		bs[0] = SMBReadBlock(dev.address, blockCommands[0], b.data());
+	} else if constexpr (blocks > 1) {
+		if ((status = SMBReadBlocks(dev.address, blockCommands.data(), blocks, b.data(), bs.data())) < 0) {
+			r.status.fill(status);
+			return r;
+		}
+	}
+
+	detail::unpack(r, w.data(), ws.data(), b.data(), bs.data(), std::index_sequence_for<Regs...>{});
+	return r;
+}
+
+} // namespace sbs
+} // namespace smbusb
+
+#endif
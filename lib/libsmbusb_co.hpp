@@ -0,0 +1,329 @@
+/*
+* Copyright (c) 2016 Viktor <github@karosium.e4ward.com>
+*
+* This library is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public
+* License as published by the Free Software Foundation; either
+* version 2.1 of the License, or (at your option) any later version.
+*
+* This library is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with this library; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+/*
+* C++20 coroutines over the SMBAsync* requests, header only.
+*
+*   smbusb::co::Task<> monitor(smbusb::co::Loop &smb) {
+*       for (;;) {
+*           int mv = co_await smb.readWord(0x16, SBS_VOLTAGE);
+*           ...
+*           co_await smb.sleep(std::chrono::seconds(1));
+*       }
+*   }
+*
+*   smbusb::co::Loop smb;
+*   smb.spawn(monitor(smb));
+*   smb.run();
+*
+* Every task runs on the thread that calls run(), which sleeps in libusb's
+* event handling until a transfer completes or the next timer is due. The
+* requests take a USB timeout and an optional std::stop_token, a stopped or
+* timed out request resumes with LIBUSB_ERROR_INTERRUPTED/TIMEOUT.
+* A task must not be destroyed while it's waiting on a request.
+*/
+#ifndef LIBSMBUSB_CO_HPP
+#define LIBSMBUSB_CO_HPP
+
+#include <chrono>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <map>
+#include <optional>
+#include <stdexcept>
+#include <stop_token>
+#include <utility>
+#include <vector>
+
+#include "libsmbusb.h"
+
+namespace smbusb::co {
+
+template <typename T = void>
+class Task;
+
+namespace detail {
+
+struct PromiseBase {
+	std::coroutine_handle<> continuation;
+	std::exception_ptr error;
+
+	struct Final {
+		bool await_ready() noexcept { return false; }
+		template <typename P>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+			auto next = h.promise().continuation;
+			return next ? next : std::noop_coroutine();
+		}
+		void await_resume() noexcept {}
+	};
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	Final final_suspend() noexcept { return {}; }
+	void unhandled_exception() { error = std::current_exception(); }
+};
+
+template <typename T>
+struct Promise : PromiseBase {
+	std::optional<T> value;
+
+	Task<T> get_return_object();
+	void return_value(T v) { value = std::move(v); }
+	T result() {
+		if (error) std::rethrow_exception(error);
+		return std::move(*value);
+	}
+};
+
+template <>
+struct Promise<void> : PromiseBase {
+	Task<void> get_return_object();
+	void return_void() {}
+	void result() {
+		if (error) std::rethrow_exception(error);
+	}
+};
+
+} // namespace detail
+
+// Lazily started, runs when awaited or spawned on a Loop
+template <typename T>
+class Task {
+public:
+	using promise_type = detail::Promise<T>;
+	using Handle = std::coroutine_handle<promise_type>;
+
+	explicit Task(Handle h) : handle(h) {}
+	Task(Task &&other) noexcept : handle(std::exchange(other.handle, {})) {}
+	Task &operator=(Task &&other) noexcept {
+		if (this != &other) {
+			if (handle) handle.destroy();
+			handle = std::exchange(other.handle, {});
+		}
+		return *this;
+	}
+	Task(const Task &) = delete;
+	Task &operator=(const Task &) = delete;
+	~Task() {
+		if (handle) handle.destroy();
+	}
+
+	bool await_ready() const noexcept { return !handle || handle.done(); }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> waiter) noexcept {
+		handle.promise().continuation = waiter;
+		return handle;
+	}
+	T await_resume() { return handle.promise().result(); }
+
+private:
+	friend class Loop;
+	Handle handle;
+};
+
+template <typename T>
+Task<T> detail::Promise<T>::get_return_object() {
+	return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+}
+
+inline Task<void> detail::Promise<void>::get_return_object() {
+	return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+}
+
+struct BlockResult {
+	int status;			// block length or the error code
+	std::vector<unsigned char> data;
+};
+
+class Loop;
+
+namespace detail {
+
+enum class Op { ReadByte, ReadWord, ReadBlock, WriteByte, WriteWord };
+
+struct Canceller {
+	long id;
+	void operator()() const noexcept { SMBAsyncCancel(id); }
+};
+
+template <typename Result>
+class Request {
+public:
+	Request(Loop &loop, Op op, unsigned int address, unsigned char command, unsigned int data,
+		std::chrono::milliseconds timeout, std::stop_token stop)
+		: loop(loop), op(op), address(address), command(command), data(data), timeout(timeout), stop(std::move(stop)) {}
+
+	bool await_ready() const noexcept { return false; }
+	bool await_suspend(std::coroutine_handle<> h);
+	Result await_resume() {
+		if constexpr (std::is_same_v<Result, BlockResult>) {
+			return BlockResult{ status, std::move(block) };
+		} else {
+			return status;
+		}
+	}
+
+private:
+	static void done(int status, const unsigned char *data, unsigned int len, void *user);
+
+	Loop &loop;
+	Op op;
+	unsigned int address;
+	unsigned char command;
+	unsigned int data;
+	std::chrono::milliseconds timeout;
+	std::stop_token stop;
+	std::optional<std::stop_callback<Canceller>> cancel;
+	std::coroutine_handle<> waiter;
+	int status = 0;
+	std::vector<unsigned char> block;
+};
+
+} // namespace detail
+
+class Loop {
+public:
+	using Clock = std::chrono::steady_clock;
+	using Timeout = std::chrono::milliseconds;
+
+	Loop() = default;
+	Loop(const Loop &) = delete;
+	Loop &operator=(const Loop &) = delete;
+
+	// starts the task on the next run(), the loop owns it from then on
+	void spawn(Task<void> task) {
+		ready.push_back(task.handle);
+		tasks.push_back(std::move(task));
+	}
+
+	/*
+	* Runs until every spawned task has finished. An exception a task let
+	* out is rethrown here, after the task is gone.
+	*/
+	void run() {
+		while (!tasks.empty()) {
+			while (!ready.empty()) {
+				auto h = ready.front();
+				ready.pop_front();
+				h.resume();
+			}
+			reap();
+			if (tasks.empty()) break;
+			if (ready.empty() && timers.empty() && SMBAsyncPending() == 0) {
+				throw std::logic_error("smbusb::co::Loop: tasks are waiting on something that isn't the loop");
+			}
+
+			int wait = 1000;
+			if (!timers.empty()) {
+				auto left = std::chrono::ceil<Timeout>(timers.begin()->first - Clock::now()).count();
+				wait = left < 0 ? 0 : left < wait ? static_cast<int>(left) : wait;
+			}
+			if (ready.empty()) {
+				int status = SMBAsyncPoll(wait);
+				if (status < 0) throw std::runtime_error(SMBGetErrorString(status));
+			}
+
+			auto now = Clock::now();
+			while (!timers.empty() && timers.begin()->first <= now) {
+				ready.push_back(timers.begin()->second);
+				timers.erase(timers.begin());
+			}
+		}
+	}
+
+	auto readByte(unsigned int address, unsigned char command, Timeout timeout = Timeout(100), std::stop_token stop = {}) {
+		return detail::Request<int>(*this, detail::Op::ReadByte, address, command, 0, timeout, std::move(stop));
+	}
+	auto readWord(unsigned int address, unsigned char command, Timeout timeout = Timeout(100), std::stop_token stop = {}) {
+		return detail::Request<int>(*this, detail::Op::ReadWord, address, command, 0, timeout, std::move(stop));
+	}
+	auto readBlock(unsigned int address, unsigned char command, Timeout timeout = Timeout(100), std::stop_token stop = {}) {
+		return detail::Request<BlockResult>(*this, detail::Op::ReadBlock, address, command, 0, timeout, std::move(stop));
+	}
+	auto writeByte(unsigned int address, unsigned char command, unsigned char data, Timeout timeout = Timeout(100), std::stop_token stop = {}) {
+		return detail::Request<int>(*this, detail::Op::WriteByte, address, command, data, timeout, std::move(stop));
+	}
+	auto writeWord(unsigned int address, unsigned char command, unsigned int data, Timeout timeout = Timeout(100), std::stop_token stop = {}) {
+		return detail::Request<int>(*this, detail::Op::WriteWord, address, command, data, timeout, std::move(stop));
+	}
+
+	auto sleep(Clock::duration d) {
+		struct Sleep {
+			Loop &loop;
+			Clock::time_point until;
+			bool await_ready() const noexcept { return until <= Clock::now(); }
+			void await_suspend(std::coroutine_handle<> h) { loop.timers.emplace(until, h); }
+			void await_resume() const noexcept {}
+		};
+		return Sleep{ *this, Clock::now() + d };
+	}
+
+private:
+	template <typename Result>
+	friend class detail::Request;
+
+	void reap() {
+		for (auto it = tasks.begin(); it != tasks.end();) {
+			if (!it->handle.done()) {
+				++it;
+				continue;
+			}
+			auto error = it->handle.promise().error;
+			it = tasks.erase(it);
+			if (error) std::rethrow_exception(error);
+		}
+	}
+
+	std::deque<std::coroutine_handle<>> ready;
+	std::multimap<Clock::time_point, std::coroutine_handle<>> timers;
+	std::vector<Task<void>> tasks;
+};
+
+template <typename Result>
+bool detail::Request<Result>::await_suspend(std::coroutine_handle<> h) {
+	unsigned int ms = static_cast<unsigned int>(timeout.count());
+	long id;
+
+	waiter = h;
+	switch (op) {
+		case Op::ReadByte: id = SMBAsyncReadByte(address, command, ms, &Request::done, this); break;
+		case Op::ReadWord: id = SMBAsyncReadWord(address, command, ms, &Request::done, this); break;
+		case Op::ReadBlock: id = SMBAsyncReadBlock(address, command, ms, &Request::done, this); break;
+		case Op::WriteByte: id = SMBAsyncWriteByte(address, command, data, ms, &Request::done, this); break;
+		default: id = SMBAsyncWriteWord(address, command, data, ms, &Request::done, this); break;
+	}
+	if (id < 0) {
+		status = static_cast<int>(id);
+		return false;	// resume right away with the error
+	}
+	if (stop.stop_possible()) cancel.emplace(stop, Canceller{ id });
+	return true;
+}
+
+template <typename Result>
+void detail::Request<Result>::done(int status, const unsigned char *data, unsigned int len, void *user) {
+	auto *r = static_cast<Request *>(user);
+
+	r->status = status;
+	if (data != nullptr) r->block.assign(data, data + len);
+	r->loop.ready.push_back(r->waiter);
+}
+
+} // namespace smbusb::co
+
+#endif
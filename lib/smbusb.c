@@ -22,6 +22,9 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/types.h>
 
 #include "libusb.h"
@@ -30,398 +33,2301 @@
 
 #include "firmware.h"
 #include <strings.h>
+#include <stddef.h>
+
+// major.minor of the firmware protocol this library speaks
+#define FIRMWARE_VERSION_MAJOR 1
+#define FIRMWARE_VERSION_MINOR 3
+
+// firmware.h is generated by firmware/Makefile, a stale copy would be uploaded and then refused
+#if !defined(FIRMWARE_IMAGE_MAJOR) || FIRMWARE_IMAGE_MAJOR != FIRMWARE_VERSION_MAJOR || FIRMWARE_IMAGE_MINOR != FIRMWARE_VERSION_MINOR
+#error "firmware.h doesn't match the firmware protocol version, rebuild it from firmware/ with SDCC"
+#endif
 
 static libusb_device *dev, **devs;
 static libusb_device_handle *device = NULL;
 
 void (*extLogFunc)(unsigned char* buf, unsigned int len) = NULL;
 
-void logerror(const char *format, ...)
-{
-	if (extLogFunc == NULL) return;
-	va_list ap;
-	va_start(ap, format);
-	char *outpBuf = malloc(10240);
-	vsnprintf(outpBuf,10240,format,ap);
+static struct smb_retry_policy retryPolicy = { 1, 1000, 2, SMB_RETRY_ON_PEC | SMB_RETRY_ON_TIMEOUT };
+static struct smb_result lastResult;
+static unsigned long totalRetries = 0;
+static struct smb_timeouts timeouts = { SMB_TIMEOUT_TRANSFER, SMB_TIMEOUT_BATCH, 0 };
+static unsigned char busTimeout[SMB_BUSES+1];	// clock low limit per bus, 0 = the firmware default
+static unsigned char autoRecover = 1;
+static struct smb_recovery_stats recoveryStats;
+static unsigned char busAcked = 0;
+static unsigned char pecMode = SMB_PEC_FIRMWARE;	// the firmware starts with PEC on
+static unsigned char pecTable[256];
+static unsigned char hostMrqPec = 0, hostRcvPec = 0;	// SMBWrite/SMBRead PECs in host PEC mode
+#define MUX_KNOWN 0x100
+static unsigned short muxState[SMB_BUSES+1][128];	// control byte | MUX_KNOWN, 0 = unknown
+static unsigned char currentBus = SMB_BUS_I2C;
+static unsigned int routedMux = 0;	// mux address | control<<8 of the transaction in progress
+#define SNIFF_SLOTS 4
+#define SNIFF_SLOT_SIZE 16384
+static struct libusb_transfer *sniffXfer[SNIFF_SLOTS];	// ring of bulk reads, all in flight but the one being decoded
+static int sniffDone[SNIFF_SLOTS];
+static unsigned int sniffSlot = 0, sniffPos = 0;
+static unsigned long long sniffEpoch = 0;		// ticks of the wraps seen
+static FILE *traceOut = NULL;		// SMBTraceStart
+static FILE *traceIn = NULL;		// SMBOpenTrace, answers instead of the device
+static unsigned long long traceLast = 0;
+static FILE *capOut = NULL;		// SMBCaptureStart
+static long long capEpoch = 0;		// wall clock - nowUs()
+
+/*
+* Event log: fixed size binary events go into a ring that producers never
+* wait on, the oldest are overwritten when nobody reads it. Formatting only
+* happens when the events are read out as text. Slot seq is the event 
+* number +1 once it's complete, 0 while it's being written.
+*/
+#ifndef SMB_LOG_MAX
+#define SMB_LOG_MAX SMB_LOG_DEBUG
+#endif
+#define LOG_RING 256
+
+#define smbLog(lvl,type,request,status,value,index,text) do { \
+		if ((lvl) <= SMB_LOG_MAX && (lvl) <= logLevel) logEvent(lvl,type,request,status,value,index,text); \
+	} while (0)
+
+struct logSlot {
+	unsigned long seq;
+	struct smb_log_event event;
+};
+
+static struct logSlot logRing[LOG_RING];
+static unsigned long logHead = 0;	// next event number, shared by the producers
+static unsigned long logTail = 0;	// next one to read
+static unsigned long logDropped = 0;	// overwritten before they were read
+static pthread_mutex_t logReadLock = PTHREAD_MUTEX_INITIALIZER;	// the reading side, producers never take it
+static unsigned char logLevel = SMB_LOG_WARN;
+
+static unsigned long long nowUs() {
+#ifdef _WIN32
+	LARGE_INTEGER f,c;
+
+	QueryPerformanceFrequency(&f);
+	QueryPerformanceCounter(&c);
+	return (c.QuadPart / f.QuadPart) * 1000000ULL + (c.QuadPart % f.QuadPart) * 1000000ULL / f.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#endif
 }
 
-int InitDevice(){
+static void flushLog();
+
+static void logEvent(unsigned char level, unsigned char type, unsigned char request, int status,
+			unsigned int value, unsigned int index, const char *text) {
+	unsigned long n = __atomic_fetch_add(&logHead, 1, __ATOMIC_RELAXED);
+	struct logSlot *slot = &logRing[n % LOG_RING];
+
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->event.timeUs = nowUs();
+	slot->event.level = level;
+	slot->event.type = type;
+	slot->event.request = request;
+	slot->event.status = status;
+	slot->event.value = value;
+	slot->event.index = index;
+	slot->event.text = text;
+	__atomic_store_n(&slot->seq, n+1, __ATOMIC_RELEASE);
+
+	// errors go out right away unless a reader is busy, it or the next flush gets them
+	if (level == SMB_LOG_ERROR && extLogFunc != NULL && pthread_mutex_trylock(&logReadLock) == 0) {
+		flushLog();
+		pthread_mutex_unlock(&logReadLock);
+	}
+}
+
+/*
+* Read cache: registers declared slow or static keep their last good value
+* for the TTL of their class. Values are kept per bus, address and command,
+* a write to the address or a reopen drops them.
+*/
+#define CACHE_WORD 0
+#define CACHE_BLOCK 1
+
+struct cacheDecl {
+	unsigned int address;
+	unsigned char command;
+	unsigned char cls;
+};
+
+struct cacheValue {
+	unsigned char used;
+	unsigned char bus;
+	unsigned char command;
+	unsigned char kind;		// CACHE_WORD or CACHE_BLOCK
+	unsigned int address;
+	unsigned int len;
+	unsigned long long time;	// nowUs() when it was read
+	unsigned char data[255];
+};
+
+static unsigned char cacheOn = 0;
+static unsigned int cacheTTL[3] = { 0, 10000, 0 };	// ms per class, 0 = no expiry
+static struct cacheDecl cacheDecls[SMB_CACHE_REGISTERS];
+static unsigned int cacheDeclared = 0;
+static struct cacheValue cacheValues[SMB_CACHE_REGISTERS];
+static struct smb_cache_stats cacheStats;
+
+static unsigned char cacheClass(unsigned int address, unsigned char command) {
+	unsigned int i;
+
+	for (i=0;i<cacheDeclared;i++) {
+		if (cacheDecls[i].address == address && cacheDecls[i].command == command) return cacheDecls[i].cls;
+	}
+	return SMB_CACHE_VOLATILE;
+}
+
+static struct cacheValue *cacheFind(unsigned int address, unsigned char command, unsigned char kind) {
+	unsigned int i;
+	struct cacheValue *v;
+
+	for (i=0;i<SMB_CACHE_REGISTERS;i++) {
+		v = &cacheValues[i];
+		if (v->used && v->bus == currentBus && v->address == address && v->command == command && v->kind == kind) return v;
+	}
+	return NULL;
+}
+
+/*
+* Copies the cached value to data and returns its length, or -1 if the
+* register has to be read from the device.
+*/
+static int cacheGet(unsigned int address, unsigned char command, unsigned char kind, unsigned char *data) {
+	unsigned char cls;
+	struct cacheValue *v;
+
+	if (!cacheOn || (cls = cacheClass(address,command)) == SMB_CACHE_VOLATILE) return -1;
+	v = cacheFind(address,command,kind);
+	if (v == NULL || (cacheTTL[cls] && nowUs() - v->time >= cacheTTL[cls]*1000ULL)) {
+		cacheStats.misses++;
+		return -1;
+	}
+	cacheStats.hits++;
+	memcpy(data,v->data,v->len);
+	return v->len;
+}
+
+static void cachePut(unsigned int address, unsigned char command, unsigned char kind, const unsigned char *data, unsigned int len) {
+	unsigned int i;
+	struct cacheValue *v;
+
+	if (!cacheOn || cacheClass(address,command) == SMB_CACHE_VOLATILE) return;
+	if ((v = cacheFind(address,command,kind)) == NULL) {
+		// a free slot or the oldest value
+		v = &cacheValues[0];
+		for (i=0;i<SMB_CACHE_REGISTERS && v->used;i++) {
+			if (!cacheValues[i].used || cacheValues[i].time < v->time) v = &cacheValues[i];
+		}
+	}
+	v->used = 1;
+	v->bus = currentBus;
+	v->address = address;
+	v->command = command;
+	v->kind = kind;
+	v->len = len;
+	v->time = nowUs();
+	memcpy(v->data,data,len);
+}
+
+/*
+* Drops everything cached for the device a write goes to. Matched on the 
+* address byte alone so a write through any mux channel counts.
+*/
+static void cacheDrop(unsigned int address) {
+	unsigned int i;
+
+	for (i=0;i<SMB_CACHE_REGISTERS;i++) {
+		if (cacheValues[i].used && cacheValues[i].bus == currentBus && ((cacheValues[i].address ^ address) & 0xFE) == 0) {
+			cacheValues[i].used = 0;
+			cacheStats.invalidations++;
+		}
+	}
+}
+
+static void cacheClear() {
+	unsigned int i;
+
+	for (i=0;i<SMB_CACHE_REGISTERS;i++) {
+		if (cacheValues[i].used) cacheStats.invalidations++;
+		cacheValues[i].used = 0;
+	}
+}
+
+static void buildPecTable() {
+	unsigned int i,j;
+	unsigned char crc;
+
+	// CRC-8, x^8+x^2+x+1
+	for (i=0;i<256;i++) {
+		crc = i;
+		for (j=0;j<8;j++) crc = (crc & 0x80) ? (crc<<1) ^ 0x07 : crc<<1;
+		pecTable[i] = crc;
+	}
+}
+
+static unsigned char pecUpdate(unsigned char pec, const unsigned char *data, unsigned int len) {
+	while (len--) pec = pecTable[pec ^ *data++];
+	return pec;
+}
+
+/*
+* PEC of a write transaction: the address and the bytes written
+*/
+static unsigned char pecWrite(unsigned int address, const unsigned char *wdata, unsigned int wlen) {
+	unsigned char a = address&0xFF;
+
+	return pecUpdate(pecUpdate(0,&a,1),wdata,wlen);
+}
+
+/*
+* PEC of a read transaction: the address, the bytes written, the read address and the bytes read
+*/
+static unsigned char pecRead(unsigned int address, const unsigned char *wdata, unsigned int wlen, 
+				const unsigned char *rdata, unsigned int rlen) {
+	unsigned char a = (address&0xFF) | 1;
+
+	return pecUpdate(pecUpdate(pecWrite(address,wdata,wlen),&a,1),rdata,rlen);
+}
+
+/*
+* Traces: "SMBTRACE", version, 3 reserved bytes, then one record per vendor
+* request, little endian: direction, request, value (2), index (2), 
+* length (2), result (4), us since the previous request started (4), 
+* us it took (4), followed by the data sent or the result bytes received.
+*/
+#define TRACE_MAGIC "SMBTRACE"
+#define TRACE_VERSION 1
+#define TRACE_RECORD 20
+#define TRACE_DATA_MAX 4096
+
+struct traceRecord {
+	unsigned char direction, request;
+	unsigned int value, index, length;
+	int result;
+	unsigned int sinceUs, durationUs;
+	unsigned int dataLen;
+};
+
+static void putLE(unsigned char *p, unsigned int v, unsigned int len) {
+	while (len--) {
+		*p++ = v & 0xFF;
+		v >>= 8;
+	}
+}
+
+static unsigned int getLE(const unsigned char *p, unsigned int len) {
+	unsigned int v = 0;
+
+	while (len--) v = (v<<8) | p[len];
+	return v;
+}
+
+static void traceWrite(unsigned char direction, unsigned char request, unsigned int value, unsigned int index,
+			unsigned char *data, unsigned int len, int result, unsigned long long start) {
+	unsigned char rec[TRACE_RECORD];
+	unsigned long long since = traceLast ? start - traceLast : 0;
+	unsigned int dataLen = (direction == LIBUSB_ENDPOINT_IN) ? (result > 0 ? result : 0) : len;
+
+	rec[0] = direction;
+	rec[1] = request;
+	putLE(rec+2,value,2);
+	putLE(rec+4,index,2);
+	putLE(rec+6,len,2);
+	putLE(rec+8,result,4);
+	putLE(rec+12,since > 0xFFFFFFFF ? 0xFFFFFFFF : since,4);
+	putLE(rec+16,nowUs() - start,4);
+	traceLast = start;
+
+	fwrite(rec,TRACE_RECORD,1,traceOut);
+	if (dataLen) fwrite(data,dataLen,1,traceOut);
+}
+
+static int traceRead(FILE *f, struct traceRecord *r, unsigned char *data) {
+	unsigned char rec[TRACE_RECORD];
+
+	if (fread(rec,TRACE_RECORD,1,f) != 1) return ERR_TRACE_END;
+	r->direction = rec[0];
+	r->request = rec[1];
+	r->value = getLE(rec+2,2);
+	r->index = getLE(rec+4,2);
+	r->length = getLE(rec+6,2);
+	r->result = (int)getLE(rec+8,4);
+	r->sinceUs = getLE(rec+12,4);
+	r->durationUs = getLE(rec+16,4);
+	r->dataLen = (r->direction == LIBUSB_ENDPOINT_IN) ? (r->result > 0 ? r->result : 0) : r->length;
+
+	if (r->length > TRACE_DATA_MAX || r->dataLen > r->length) return ERR_TRACE_FORMAT;
+	if (r->dataLen && fread(data,r->dataLen,1,f) != 1) return ERR_TRACE_END;
+	return 0;
+}
+
+static FILE *traceOpen(const char *path) {
+	FILE *f;
+	unsigned char hdr[12];
+
+	if ((f = fopen(path,"rb")) == NULL) return NULL;
+	if (fread(hdr,12,1,f) != 1 || memcmp(hdr,TRACE_MAGIC,8) || hdr[8] != TRACE_VERSION) {
+		fclose(f);
+		return NULL;
+	}
+	return f;
+}
+
+/*
+* Stands in for the device when a trace is open: the next record has to be
+* the same request, its result and reply are returned. A request that 
+* doesn't match leaves the trace where it is.
+*/
+static int traceAnswer(unsigned char direction, unsigned char request, unsigned int value, unsigned int index,
+			unsigned char *data, unsigned int len) {
+	struct traceRecord r;
+	unsigned char buf[TRACE_DATA_MAX];
+	long pos = ftell(traceIn);
 	int status;
-	unsigned int fwver=0;
-	/* We need to claim the first interface */
-	libusb_set_auto_detach_kernel_driver(device, 1);
-	status = libusb_claim_interface(device, 0);
-	if (status != LIBUSB_SUCCESS) {
-		libusb_close(device);
-		logerror("libusb_claim_interface failed: %s\n", libusb_error_name(status));
-		return ERR_CLAIM_INTERFACE;
+
+	if ((status = traceRead(traceIn,&r,buf)) < 0) return status;
+	if (r.direction != direction || r.request != request || r.value != (value & 0xFFFF) ||
+	    r.index != (index & 0xFFFF) || r.length != len || 
+	    (direction == LIBUSB_ENDPOINT_OUT && len && memcmp(buf,data,len))) {
+		fseek(traceIn,pos,SEEK_SET);
+		smbLog(SMB_LOG_WARN, SMB_EVENT_MESSAGE, request, ERR_TRACE_MISMATCH, value, index, "trace mismatch");
+		return ERR_TRACE_MISMATCH;
 	}
+	if (direction == LIBUSB_ENDPOINT_IN && r.dataLen) memcpy(data,buf,r.dataLen);
+	return r.result;
+}
 
-	if (SMBInterfaceID() != 0x4d5355) 
-	{
-		// try loading firmware
-		if ((status = CypressUploadIhxFirmware(device, (char *)&build_smbusb_firmware_ihx, build_smbusb_firmware_ihx_len)) <0) return status;
-		sleep(2);	
-		return INIT_RETRY;
+/*
+* pcapng capture, one enhanced packet block per vendor request. The packet
+* is a 24 byte header, little endian: version, direction, request, bus, 
+* PEC mode, flags (bit 0 address valid, bit 1 command valid), address, 
+* command, value (2), index (2), length (2), reserved (2), result (4), 
+* us it took (4). The data sent or the bytes received follow.
+*/
+#define CAP_HDR 24
+#define CAP_ADDRESS 0x1
+#define CAP_COMMAND 0x2
+
+static void capU32(unsigned int v) {
+	unsigned char b[4];
+
+	putLE(b,v,4);
+	fwrite(b,4,1,capOut);
+}
+
+static unsigned char capMeaning(unsigned char request, unsigned int value, unsigned int index, 
+				unsigned char *address, unsigned char *command) {
+	*address = value & 0xFF;
+	*command = index & 0xFF;
+	switch (request) {
+		case SMB_READ_BYTE:
+		case SMB_WRITE_BYTE:
+		case SMB_SEND_BYTE:
+		case SMB_READ_WORD:
+		case SMB_WRITE_WORD:
+		case SMB_READ_WORDS:
+		case SMB_READ_WORD_MULTI:
+		case SMB_READ_BLOCK:
+		case SMB_WRITE_BLOCK:
+		case SMB_BLOCK_PROCESS_CALL:
+		case SMB_TEST_COMMAND_ACK:
+		case SMB_TEST_COMMAND_WRITE:
+			return CAP_ADDRESS | CAP_COMMAND;
+		case SMB_PROCESS_CALL:
+			*command = (value>>8) & 0xFF;
+			return CAP_ADDRESS | CAP_COMMAND;
+		case SMB_WRITE_READ:
+			return ((value>>8) & SMB_WR_INLINE_MASK) ? CAP_ADDRESS | CAP_COMMAND : CAP_ADDRESS;
+		case SMB_READ_WORD_LIST:
+		case SMB_READ_BLOCK_LIST:
+		case SMB_TEST_ADDRESS_ACK:
+		case SMB_SCAN_COMMAND_ACK:
+		case SMB_SCAN_COMMAND_WRITE:
+			return CAP_ADDRESS;
+		default:
+			return 0;
+	}
+}
+
+static void captureWrite(unsigned char direction, unsigned char request, unsigned int value, unsigned int index,
+			unsigned char *data, unsigned int len, int result, unsigned long long start) {
+	unsigned char hdr[CAP_HDR] = {0};
+	unsigned long long ts = capEpoch + start;
+	unsigned int dataLen = (direction == LIBUSB_ENDPOINT_IN) ? (result > 0 ? result : 0) : len;
+	unsigned int caplen = CAP_HDR + dataLen, pad = (4 - (caplen&3)) & 3;
+	uint32_t zero = 0;
+
+	hdr[0] = SMB_CAPTURE_VERSION;
+	hdr[1] = direction;
+	hdr[2] = request;
+	hdr[3] = currentBus;
+	hdr[4] = pecMode;
+	hdr[5] = capMeaning(request,value,index,&hdr[6],&hdr[7]);
+	putLE(hdr+8,value,2);
+	putLE(hdr+10,index,2);
+	putLE(hdr+12,len,2);
+	putLE(hdr+16,result,4);
+	putLE(hdr+20,nowUs() - start,4);
+
+	capU32(6);
+	capU32(32+caplen+pad);
+	capU32(0);
+	capU32(ts>>32);
+	capU32(ts&0xFFFFFFFF);
+	capU32(caplen);
+	capU32(caplen);
+	fwrite(hdr,CAP_HDR,1,capOut);
+	if (dataLen) fwrite(data,dataLen,1,capOut);
+	fwrite(&zero,pad,1,capOut);
+	capU32(32+caplen+pad);
+
+	// a fifo reader wants it now. If it went away, stop
+	if (fflush(capOut) != 0 || ferror(capOut)) {
+		smbLog(SMB_LOG_WARN, SMB_EVENT_MESSAGE, request, 0, 0, 0, "capture write failed, stopped");
+		SMBCaptureStop();
 	}
+}
+
+static int smbControl(unsigned char direction, unsigned char request, unsigned int value, unsigned int index,
+			unsigned char *data, unsigned int len, unsigned int timeout) {
+	int status;
+	unsigned long long start;
+
+	if (traceIn != NULL) return traceAnswer(direction, request, value, index, data, len);
 
+	smbLog(SMB_LOG_DEBUG, SMB_EVENT_SUBMIT, request, 0, value, index, NULL);
+	start = (traceOut != NULL || capOut != NULL || SMB_LOG_DEBUG <= logLevel) ? nowUs() : 0;
 	status = libusb_control_transfer(device,
-					LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
-					SMB_FIRMWARE_VERSION,
-					0, 
-					0,
-					(void*)&fwver, 
-					3, 
-					1000);
-  	if (status==3) {return fwver;} else {return status;}
+					direction | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+					request,
+					value, 
+					index,
+					data, 
+					len, 
+					timeout);
+	if (traceOut != NULL) traceWrite(direction, request, value, index, data, len, status, start);
+	if (capOut != NULL) captureWrite(direction, request, value, index, data, len, status, start);
+	smbLog(SMB_LOG_DEBUG, SMB_EVENT_COMPLETE, request, status, value, start ? nowUs() - start : 0, NULL);
+	return status;
+}
+
+static int statusToError(unsigned char smbStatus) {
+	switch (smbStatus) {
+		case SMB_STATUS_OK:
+			return 0;
+		case SMB_STATUS_NAK_ADDRESS:
+			return ERR_NAK_ADDRESS;
+		case SMB_STATUS_NAK_COMMAND:
+			return ERR_NAK_COMMAND;
+		case SMB_STATUS_NAK_DATA:
+			return ERR_NAK_DATA;
+		case SMB_STATUS_TIMEOUT:
+			return ERR_BUS_TIMEOUT;
+		case SMB_STATUS_PEC:
+			return ERR_PEC_FAIL;
+		case SMB_STATUS_BAD_LENGTH:
+			return ERR_BAD_BLOCK_LENGTH;
+		default:
+			return ERR_BUS_ERROR;
+	}
+}
+
+/*
+* IN request to the firmware. Strips the status header off the reply and
+* returns the payload length or the error the firmware reported.
+* len can't be more than SMB_RESP_MAX, +1 for a raw PEC in host PEC mode.
+*/
+static int smbRequest(unsigned char request, unsigned int value, unsigned int index,
+			unsigned char *data, unsigned int len, unsigned int timeout) {
+	int status;
+	unsigned char tmp[SMB_RESP_HDR+SMB_RESP_MAX+1];
+
+	status = smbControl(LIBUSB_ENDPOINT_IN, request, value, index, tmp, len+SMB_RESP_HDR, timeout);
+	if (status < 0) return status;
+	if (status < SMB_RESP_HDR) return ERR_SHORT_REPLY;
+
+	busAcked = tmp[1];
+	if (tmp[0] != SMB_STATUS_OK) return statusToError(tmp[0]);
+
+	memcpy(data,tmp+SMB_RESP_HDR,status-SMB_RESP_HDR);
+	return status-SMB_RESP_HDR;
+}
+
+/*
+* OUT request to the firmware. A failed SMBus operation stalls the request, 
+* in that case the reason is fetched with SMB_GET_STATUS.
+*/
+static int smbWriteRequest(unsigned char request, unsigned int value, unsigned int index,
+			unsigned char *data, unsigned int len, unsigned int timeout) {
+	int status;
+	unsigned char st[2];
+
+	status = smbControl(LIBUSB_ENDPOINT_OUT, request, value, index, data, len, timeout);
+	if (status != LIBUSB_ERROR_PIPE) return status;
+
+	if (smbControl(LIBUSB_ENDPOINT_IN, SMB_GET_STATUS, 0, 0, st, 2, timeouts.transfer) == 2 && st[0] != SMB_STATUS_OK) {
+		smbLog(SMB_LOG_INFO, SMB_EVENT_STALL, request, statusToError(st[0]), value, index, NULL);
+		busAcked = st[1];
+		return statusToError(st[0]);
+	}
+	return status;
+}
+
+/*
+* Asynchronous requests: one libusb transfer each, completed by SMBAsyncPoll
+* on the caller's thread. No mux routing and no retries. A stalled write
+* gets its reason with a second request like smbWriteRequest does. With
+* SMBOpenTrace they're answered from the trace as they're submitted.
+*/
+#define ASYNC_BYTE 0
+#define ASYNC_WORD 1
+#define ASYNC_BLOCK 2
+#define ASYNC_WRITE 3
+
+struct asyncOp {
+	struct asyncOp *next;
+	long id;
+	unsigned char kind;		// ASYNC_*
+	unsigned char command;
+	unsigned char hp;		// host PEC when it was submitted
+	unsigned char request;		// what's in flight, SMB_GET_STATUS after a stalled write
+	unsigned char direction;
+	unsigned int address;
+	unsigned int value;
+	unsigned int index;
+	unsigned int len;		// data stage length
+	unsigned int timeout;
+	unsigned char done;
+	unsigned char cancelled;
+	int status;			// transfer result
+	unsigned long long start;
+	struct libusb_transfer *xfer;	// NULL when answered from a trace
+	smb_async_done cb;
+	void *user;
+	unsigned char buf[LIBUSB_CONTROL_SETUP_SIZE+SMB_RESP_HDR+SMB_RESP_MAX+1];
+};
+
+static struct asyncOp *asyncOps = NULL;	// in submit order
+static long asyncNextId = 1;
+static unsigned int asyncInFlight = 0;
+
+static int asyncStart(struct asyncOp *op);
+
+static void asyncFinished(struct asyncOp *op) {
+	unsigned char *data = op->buf+LIBUSB_CONTROL_SETUP_SIZE;
+
+	if (traceOut != NULL) traceWrite(op->direction, op->request, op->value, op->index, data, op->len, op->status, op->start);
+	if (capOut != NULL) captureWrite(op->direction, op->request, op->value, op->index, data, op->len, op->status, op->start);
+	smbLog(SMB_LOG_DEBUG, SMB_EVENT_COMPLETE, op->request, op->status, op->value, nowUs() - op->start, NULL);
+
+	if (op->kind == ASYNC_WRITE && op->request != SMB_GET_STATUS && op->status == LIBUSB_ERROR_PIPE && !op->cancelled) {
+		op->request = SMB_GET_STATUS;
+		op->direction = LIBUSB_ENDPOINT_IN;
+		op->value = 0;
+		op->index = 0;
+		op->len = 2;
+		op->timeout = timeouts.transfer;
+		if (asyncStart(op) == 0) return;
+		op->status = 0;		// couldn't ask, asyncResult reports the stall
+	}
+	op->done = 1;
+}
+
+static void LIBUSB_CALL asyncCallback(struct libusb_transfer *xfer) {
+	struct asyncOp *op = xfer->user_data;
+
+	asyncInFlight--;
+	switch (xfer->status) {
+		case LIBUSB_TRANSFER_COMPLETED:
+			op->status = xfer->actual_length;
+			break;
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			op->status = LIBUSB_ERROR_TIMEOUT;
+			break;
+		case LIBUSB_TRANSFER_CANCELLED:
+			op->status = LIBUSB_ERROR_INTERRUPTED;
+			break;
+		case LIBUSB_TRANSFER_STALL:
+			op->status = LIBUSB_ERROR_PIPE;
+			break;
+		case LIBUSB_TRANSFER_NO_DEVICE:
+			op->status = LIBUSB_ERROR_NO_DEVICE;
+			break;
+		case LIBUSB_TRANSFER_OVERFLOW:
+			op->status = LIBUSB_ERROR_OVERFLOW;
+			break;
+		default:
+			op->status = LIBUSB_ERROR_IO;
+	}
+	asyncFinished(op);
+}
+
+static int asyncStart(struct asyncOp *op) {
+	int status;
+
+	smbLog(SMB_LOG_DEBUG, SMB_EVENT_SUBMIT, op->request, 0, op->value, op->index, NULL);
+	op->start = nowUs();
+	if (traceIn != NULL) {
+		op->status = traceAnswer(op->direction, op->request, op->value, op->index, op->buf+LIBUSB_CONTROL_SETUP_SIZE, op->len);
+		asyncFinished(op);
+		return 0;
+	}
+
+	if (op->xfer == NULL && (op->xfer = libusb_alloc_transfer(0)) == NULL) return LIBUSB_ERROR_NO_MEM;
+	libusb_fill_control_setup(op->buf, op->direction | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+					op->request, op->value, op->index, op->len);
+	libusb_fill_control_transfer(op->xfer, device, op->buf, asyncCallback, op, op->timeout);
+	if ((status = libusb_submit_transfer(op->xfer)) < 0) return status;
+	asyncInFlight++;
+	return 0;
+}
+
+/*
+* The transfer result as the synchronous function would have returned it.
+* payload points at a read block.
+*/
+static int asyncResult(struct asyncOp *op, unsigned char **payload) {
+	unsigned char *data = op->buf+LIBUSB_CONTROL_SETUP_SIZE;
+	int status = op->status, total;
+
+	*payload = NULL;
+	if (op->cancelled) return LIBUSB_ERROR_INTERRUPTED;
+	if (op->kind == ASYNC_WRITE) {
+		if (op->request != SMB_GET_STATUS) return status < 0 ? status : 0;
+		if (status == 2 && data[0] != SMB_STATUS_OK) return statusToError(data[0]);
+		return LIBUSB_ERROR_PIPE;
+	}
+
+	if (status < 0) return status;
+	if (status < SMB_RESP_HDR) return ERR_SHORT_REPLY;
+	if (data[0] != SMB_STATUS_OK) return statusToError(data[0]);
+	data += SMB_RESP_HDR;
+	status -= SMB_RESP_HDR;
+
+	switch (op->kind) {
+		case ASYNC_BYTE:
+			if (status != 1+op->hp) return ERR_SHORT_REPLY;
+			if (op->hp && data[1] != pecRead(op->address,&op->command,1,data,1)) return ERR_PEC_FAIL;
+			return data[0];
+		case ASYNC_WORD:
+			if (status != 2+op->hp) return ERR_SHORT_REPLY;
+			if (op->hp && data[2] != pecRead(op->address,&op->command,1,data,2)) return ERR_PEC_FAIL;
+			return data[0] | (data[1]<<8);
+		default:
+			if (status == 0) return ERR_SHORT_REPLY;
+			total = data[0];
+			if (status-1-op->hp < total) return ERR_SHORT_REPLY;
+			if (op->hp && data[total+1] != pecRead(op->address,&op->command,1,data,total+1)) return ERR_PEC_FAIL;
+			*payload = data+1;
+			return total;
+	}
+}
+
+static void asyncFree(struct asyncOp *op) {
+	if (op->xfer != NULL) libusb_free_transfer(op->xfer);
+	free(op);
+}
+
+static long asyncSubmit(unsigned char kind, unsigned char direction, unsigned char request, unsigned int address, 
+			unsigned char command, const unsigned char *data, unsigned int len, unsigned int timeout, 
+			smb_async_done done, void *user) {
+	struct asyncOp *op, **p;
+	int status;
+
+	if (device == NULL && traceIn == NULL) return LIBUSB_ERROR_NO_DEVICE;
+	if (address & SMB_MUX_FLAG) return LIBUSB_ERROR_INVALID_PARAM;	// a mux select can't be slipped in between
+	if ((op = calloc(1,sizeof(struct asyncOp))) == NULL) return LIBUSB_ERROR_NO_MEM;
+
+	op->id = asyncNextId++;
+	op->kind = kind;
+	op->command = command;
+	op->hp = (pecMode == SMB_PEC_HOST);
+	op->request = request;
+	op->direction = direction;
+	op->address = address & 0xFF;
+	op->value = address & 0xFF;
+	op->index = command;
+	op->len = len;
+	op->timeout = timeout;
+	op->cb = done;
+	op->user = user;
+	if (direction == LIBUSB_ENDPOINT_OUT) memcpy(op->buf+LIBUSB_CONTROL_SETUP_SIZE,data,len);
+
+	for (p=&asyncOps;*p!=NULL;p=&(*p)->next);
+	*p = op;
+
+	if ((status = asyncStart(op)) < 0) {
+		*p = NULL;
+		asyncFree(op);
+		return status;
+	}
+	return op->id;
+}
+
+long SMBAsyncReadByte(unsigned int address, unsigned char command, unsigned int timeout, smb_async_done done, void *user) {
+	return asyncSubmit(ASYNC_BYTE, LIBUSB_ENDPOINT_IN, SMB_READ_BYTE, address, command, NULL, 
+				SMB_RESP_HDR+1+(pecMode == SMB_PEC_HOST), timeout, done, user);
+}
+
+long SMBAsyncReadWord(unsigned int address, unsigned char command, unsigned int timeout, smb_async_done done, void *user) {
+	return asyncSubmit(ASYNC_WORD, LIBUSB_ENDPOINT_IN, SMB_READ_WORD, address, command, NULL, 
+				SMB_RESP_HDR+2+(pecMode == SMB_PEC_HOST), timeout, done, user);
+}
+
+long SMBAsyncReadBlock(unsigned int address, unsigned char command, unsigned int timeout, smb_async_done done, void *user) {
+	return asyncSubmit(ASYNC_BLOCK, LIBUSB_ENDPOINT_IN, SMB_READ_BLOCK, address, command, NULL, 
+				SMB_RESP_HDR+SMB_RESP_MAX+(pecMode == SMB_PEC_HOST), timeout, done, user);
+}
+
+long SMBAsyncWriteByte(unsigned int address, unsigned char command, unsigned char data, unsigned int timeout, smb_async_done done, void *user) {
+	int hp = (pecMode == SMB_PEC_HOST);
+	unsigned char buf[3] = { command, data };
+
+	if (hp) buf[2] = pecWrite(address,buf,2);
+	cacheDrop(address);
+	return asyncSubmit(ASYNC_WRITE, LIBUSB_ENDPOINT_OUT, SMB_WRITE_BYTE, address, command, buf+1, 1+hp, timeout, done, user);
+}
+
+long SMBAsyncWriteWord(unsigned int address, unsigned char command, unsigned int data, unsigned int timeout, smb_async_done done, void *user) {
+	int hp = (pecMode == SMB_PEC_HOST);
+	unsigned char buf[4] = { command, data&0xFF, (data>>8)&0xFF };
+
+	if (hp) buf[3] = pecWrite(address,buf,3);
+	cacheDrop(address);
+	return asyncSubmit(ASYNC_WRITE, LIBUSB_ENDPOINT_OUT, SMB_WRITE_WORD, address, command, buf+1, 2+hp, timeout, done, user);
+}
+
+int SMBAsyncCancel(long id) {
+	struct asyncOp *op;
+
+	for (op=asyncOps;op!=NULL;op=op->next) {
+		if (op->id != id) continue;
+		if (!op->cancelled && !op->done && op->xfer != NULL) libusb_cancel_transfer(op->xfer);
+		op->cancelled = 1;
+		return 0;
+	}
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+int SMBAsyncPending() {
+	struct asyncOp *op;
+	int n=0;
+
+	for (op=asyncOps;op!=NULL;op=op->next) n++;
+	return n;
+}
+
+int SMBAsyncPoll(unsigned int timeout) {
+	struct asyncOp *op, **p, *finished = NULL, **tail = &finished;
+	struct timeval tv;
+	unsigned char *payload;
+	int status, n=0;
+
+	for (op=asyncOps;op!=NULL && !op->done;op=op->next);
+	if (op == NULL && asyncInFlight) {
+		tv.tv_sec = timeout/1000;
+		tv.tv_usec = (timeout%1000)*1000;
+		status = libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+		if (status < 0 && status != LIBUSB_ERROR_INTERRUPTED) return status;
+	} else if (op == NULL && timeout) {
+		usleep(timeout*1000);	// nothing that could complete
+	}
+
+	// take the finished ones off first, the callbacks may submit more
+	for (p=&asyncOps;*p!=NULL;) {
+		op = *p;
+		if (!op->done) {
+			p = &op->next;
+			continue;
+		}
+		*p = op->next;
+		op->next = NULL;
+		*tail = op;
+		tail = &op->next;
+	}
+
+	while ((op = finished) != NULL) {
+		finished = op->next;
+		status = asyncResult(op,&payload);
+		op->cb(status, payload, payload != NULL ? status : 0, op->user);
+		asyncFree(op);
+		n++;
+	}
+	return n;
+}
+
+/*
+* Submission queue: any thread pushes units of work, one owner thread runs
+* them one at a time so a unit's requests never interleave with another's.
+* Intrusive MPSC list: producers swap the head and link the old one, they
+* never wait on each other. The owner only takes the lock to sleep when the
+* queue is empty, producers only to wake it.
+*/
+#define QUEUE_IDLE 0
+#define QUEUE_RUNNING 1
+#define QUEUE_STOPPING 2
+
+struct queueNode {
+	struct queueNode *next;
+	smb_unit_fn unit;
+	void *arg;
+	smb_unit_done done;		// SMBQueueSubmit, the node is freed after it
+	int result;
+	int finished;			// SMBQueueRun waits for this
+};
+
+static struct queueNode queueStub;
+static struct queueNode *queueHead = &queueStub;	// producers push here
+static struct queueNode *queueTail = &queueStub;	// the owner pops here
+static pthread_t queueThread;
+static int queueState = QUEUE_IDLE;
+static int queueStopping = 0, queueSleeping = 0;
+static unsigned int queueUsers = 0;	// producers between seeing QUEUE_RUNNING and finishing their push
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueWake = PTHREAD_COND_INITIALIZER;	// the owner waits for work
+static pthread_cond_t queueDone = PTHREAD_COND_INITIALIZER;	// SMBQueueRun waits for its unit
+
+static void queueLink(struct queueNode *n) {
+	struct queueNode *prev;
+
+	__atomic_store_n(&n->next, NULL, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n(&queueHead, n, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&prev->next, n, __ATOMIC_RELEASE);
+}
+
+static void queuePush(struct queueNode *n) {
+	queueLink(n);
+	// the link has to be visible before queueSleeping is read, the owner fences the other way round
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&queueSleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&queueLock);
+		pthread_cond_signal(&queueWake);
+		pthread_mutex_unlock(&queueLock);
+	}
+}
+
+/*
+* Owner side. NULL when empty or when a push is half done, the pusher 
+* wakes the owner once it's linked.
+*/
+static struct queueNode *queuePop() {
+	struct queueNode *tail = queueTail, *next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+
+	if (tail == &queueStub) {
+		if (next == NULL) return NULL;
+		queueTail = tail = next;
+		next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	}
+	if (next != NULL) {
+		queueTail = next;
+		return tail;
+	}
+	if (tail != __atomic_load_n(&queueHead, __ATOMIC_SEQ_CST)) return NULL;
+
+	// the last node can only go once something is behind it
+	queueLink(&queueStub);
+	next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+	if (next == NULL) return NULL;
+	queueTail = next;
+	return tail;
+}
+
+static void *queueOwner(void *unused) {
+	struct queueNode *n;
+
+	(void)unused;
+	for (;;) {
+		if ((n = queuePop()) == NULL) {
+			pthread_mutex_lock(&queueLock);
+			__atomic_store_n(&queueSleeping, 1, __ATOMIC_SEQ_CST);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			while ((n = queuePop()) == NULL && !queueStopping) pthread_cond_wait(&queueWake, &queueLock);
+			__atomic_store_n(&queueSleeping, 0, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&queueLock);
+			if (n == NULL) break;	// stopping and drained
+		}
+
+		n->result = n->unit(n->arg);
+		if (n->done != NULL) {
+			n->done(n->result, n->arg);
+			free(n);
+		} else {
+			pthread_mutex_lock(&queueLock);
+			n->finished = 1;
+			pthread_cond_broadcast(&queueDone);
+			pthread_mutex_unlock(&queueLock);
+		}
+	}
+	return NULL;
+}
+
+int SMBQueueStart() {
+	int status;
+
+	if (__atomic_load_n(&queueState, __ATOMIC_SEQ_CST) != QUEUE_IDLE) return ERR_ALREADY_OPEN;
+	queueStopping = 0;
+	if ((status = pthread_create(&queueThread, NULL, queueOwner, NULL)) != 0) {
+		smbLog(SMB_LOG_ERROR, SMB_EVENT_MESSAGE, 0, status, 0, 0, "pthread_create() failed");
+		return LIBUSB_ERROR_OTHER;
+	}
+	__atomic_store_n(&queueState, QUEUE_RUNNING, __ATOMIC_SEQ_CST);
+	return 0;
+}
+
+void SMBQueueStop() {
+	int running = QUEUE_RUNNING;
+
+	if (!__atomic_compare_exchange_n(&queueState, &running, QUEUE_STOPPING, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) return;
+	// pushes that saw the queue running land before the owner is told to drain and stop
+	while (__atomic_load_n(&queueUsers, __ATOMIC_SEQ_CST) != 0) sched_yield();
+	pthread_mutex_lock(&queueLock);
+	queueStopping = 1;
+	pthread_cond_signal(&queueWake);
+	pthread_mutex_unlock(&queueLock);
+	pthread_join(queueThread, NULL);
+	__atomic_store_n(&queueState, QUEUE_IDLE, __ATOMIC_SEQ_CST);
+}
+
+/*
+* How a unit from this thread runs. 1: it's pushed to the owner, queueLeave()
+* once it is. 0: right here, without the queue or from the owner itself.
+* ERR_QUEUE_STOPPING while SMBQueueStop drains, the owner won't take it and
+* running it here would interleave with the owner's.
+*/
+static int queueEnter() {
+	int state;
+
+	if (__atomic_load_n(&queueState, __ATOMIC_SEQ_CST) != QUEUE_IDLE && pthread_equal(pthread_self(), queueThread)) return 0;
+
+	__atomic_add_fetch(&queueUsers, 1, __ATOMIC_SEQ_CST);
+	state = __atomic_load_n(&queueState, __ATOMIC_SEQ_CST);
+	if (state == QUEUE_RUNNING) return 1;
+	__atomic_sub_fetch(&queueUsers, 1, __ATOMIC_SEQ_CST);
+	return state == QUEUE_STOPPING ? ERR_QUEUE_STOPPING : 0;
+}
+
+static void queueLeave() {
+	__atomic_sub_fetch(&queueUsers, 1, __ATOMIC_SEQ_CST);
+}
+
+int SMBQueueRun(smb_unit_fn unit, void *arg) {
+	struct queueNode n = { NULL, unit, arg, NULL, 0, 0 };
+	int status;
+
+	if ((status = queueEnter()) <= 0) return status < 0 ? status : unit(arg);
+
+	queuePush(&n);
+	queueLeave();
+	pthread_mutex_lock(&queueLock);
+	while (!n.finished) pthread_cond_wait(&queueDone, &queueLock);
+	pthread_mutex_unlock(&queueLock);
+	return n.result;
+}
+
+static void queueNoDone(int result, void *arg) {
+	(void)result;
+	(void)arg;
+}
+
+int SMBQueueSubmit(smb_unit_fn unit, void *arg, smb_unit_done done) {
+	struct queueNode *n;
+	int status;
+
+	if (done == NULL) done = queueNoDone;
+	if ((status = queueEnter()) < 0) return status;
+	if (status == 0) {
+		done(unit(arg), arg);
+		return 0;
+	}
+	if ((n = calloc(1,sizeof(struct queueNode))) == NULL) {
+		queueLeave();
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	n->unit = unit;
+	n->arg = arg;
+	n->done = done;
+	queuePush(n);
+	queueLeave();
+	return 0;
+}
+
+int InitDevice(){
+	int status;
+	unsigned int fwver=0;
+	/* We need to claim the first interface */
+	libusb_set_auto_detach_kernel_driver(device, 1);
+	status = libusb_claim_interface(device, 0);
+	if (status != LIBUSB_SUCCESS) {
+		libusb_close(device);
+		smbLog(SMB_LOG_ERROR, SMB_EVENT_MESSAGE, 0, status, 0, 0, "libusb_claim_interface failed");
+		return ERR_CLAIM_INTERFACE;
+	}
+
+	if (SMBInterfaceID() != 0x4d5355) 
+	{
+		// try loading firmware
+		if ((status = CypressUploadIhxFirmware(device, (char *)&build_smbusb_firmware_ihx, build_smbusb_firmware_ihx_len)) <0) return status;
+		sleep(2);	
+		return INIT_RETRY;
+	}
+
+	status = smbControl(LIBUSB_ENDPOINT_IN, SMB_FIRMWARE_VERSION, 0, 0, (void*)&fwver, 3, timeouts.batch);
+  	if (status!=3) return status;
+
+	if ((fwver & 0xFFFF) != (FIRMWARE_VERSION_MAJOR | (FIRMWARE_VERSION_MINOR<<8))) {
+		// older firmware doesn't send the status header, talking to it would misparse every reply
+		smbLog(SMB_LOG_ERROR, SMB_EVENT_FIRMWARE, SMB_FIRMWARE_VERSION, ERR_FIRMWARE_VERSION, fwver, 0, NULL);
+		SMBCloseDevice();
+		return ERR_FIRMWARE_VERSION;
+	}
+	cacheClear();	// whatever is on the bus now may not be what was cached
+
+	// a previous user may have left other clock low limits behind
+	smbControl(LIBUSB_ENDPOINT_OUT, SMB_SET_TIMEOUT, 0, SMB_ALL_BUSES, NULL, 0, timeouts.transfer);
+	memset(busTimeout,0,sizeof(busTimeout));
+	return fwver;
+}
+
+int SMBOpenDeviceVIDPID(unsigned int vid,unsigned int pid){
+	int status;
+	if (device != NULL) return ERR_ALREADY_OPEN;
+
+
+	status = libusb_init(NULL);
+	if (status < 0) {
+		smbLog(SMB_LOG_ERROR, SMB_EVENT_MESSAGE, 0, status, 0, 0, "libusb_init() failed");
+		return status;
+	}
+	libusb_set_debug(NULL, 0);
+	
+	openvidpid_retry:
+	device = libusb_open_device_with_vid_pid(NULL, (uint16_t)vid, (uint16_t)pid);
+		if (device == NULL) {
+			smbLog(SMB_LOG_ERROR, SMB_EVENT_MESSAGE, 0, ERR_DEVICE_OPEN, 0, 0, "libusb_open() failed");
+			return ERR_DEVICE_OPEN;		
+		}	
+	status = InitDevice();
+	if (status == INIT_RETRY) goto openvidpid_retry;
+	return status;
+}
+
+int SMBOpenDeviceBusAddr(unsigned int bus, unsigned int addr){
+	int i,status;
+	
+	if (device != NULL) return ERR_ALREADY_OPEN;
+
+	status = libusb_init(NULL);
+	if (status < 0) {
+		smbLog(SMB_LOG_ERROR, SMB_EVENT_MESSAGE, 0, status, 0, 0, "libusb_init() failed");
+		return status;
+	}
+	libusb_set_debug(NULL, 0);
+
+
+	openbusadd_retry:
+	if ((status = libusb_get_device_list(NULL, &devs)) < 0) {
+		smbLog(SMB_LOG_ERROR, SMB_EVENT_MESSAGE, 0, status, 0, 0, "libusb_get_device_list() failed");
+		return status;
+	}
+	for (i=0; (dev=devs[i]) != NULL; i++) {
+		if ((libusb_get_bus_number(dev) == bus) && (libusb_get_device_address(dev) == addr)) {
+			status = libusb_open(dev, &device);
+			libusb_free_device_list(devs, 1);
+			if (status < 0) {
+				smbLog(SMB_LOG_ERROR, SMB_EVENT_MESSAGE, 0, status, 0, 0, "libusb_open() failed");
+				return status;
+			}				
+			status = InitDevice();
+			if (status == INIT_RETRY) goto openbusadd_retry;
+			return status;
+		}
+	}
+	return -1;
+}
+
+void SMBCloseDevice() {
+	struct asyncOp *op;
+	int i;
+
+	if (device == NULL && traceIn == NULL) return;
+	// pending async requests complete with LIBUSB_ERROR_INTERRUPTED
+	for (i=0;i<10 && asyncOps != NULL;i++) {
+		for (op=asyncOps;op!=NULL;op=op->next) SMBAsyncCancel(op->id);
+		SMBAsyncPoll(100);
+	}
+	SMBSniffStop();
+	SMBResetMuxCache();
+	cacheClear();
+	currentBus = SMB_BUS_I2C;
+	if (traceIn != NULL) {
+		fclose(traceIn);
+		traceIn = NULL;
+		return;
+	}
+	libusb_release_interface(device, 0);
+	libusb_close(device);
+	libusb_exit(NULL);
+	device=NULL;
+}
+
+int SMBTraceStart(const char *path) {
+	unsigned char hdr[12] = TRACE_MAGIC;
+
+	SMBTraceStop();
+	if ((traceOut = fopen(path,"wb")) == NULL) return ERR_TRACE_FORMAT;
+	hdr[8] = TRACE_VERSION;
+	fwrite(hdr,12,1,traceOut);
+	traceLast = 0;
+	return 0;
+}
+
+void SMBTraceStop() {
+	if (traceOut == NULL) return;
+	fclose(traceOut);
+	traceOut = NULL;
+}
+
+int SMBOpenTrace(const char *path) {
+	struct traceRecord r;
+	unsigned char buf[TRACE_DATA_MAX];
+	unsigned int fwver = FIRMWARE_VERSION_MAJOR | (FIRMWARE_VERSION_MINOR<<8);
+	long pos;
+
+	if (device != NULL || traceIn != NULL) return ERR_ALREADY_OPEN;
+	if ((traceIn = traceOpen(path)) == NULL) return ERR_TRACE_FORMAT;
+
+	// a trace started before the device was opened has the open handshake first
+	for (pos = ftell(traceIn);traceRead(traceIn,&r,buf) == 0;pos = ftell(traceIn)) {
+		if (r.request == SMB_FIRMWARE_VERSION && r.result == 3) {
+			fwver = buf[0] | (buf[1]<<8) | (buf[2]<<16);
+		} else if (r.request != SMB_INTERFACE_ID) {
+			break;
+		}
+	}
+	fseek(traceIn,pos,SEEK_SET);
+	return fwver;
+}
+
+int SMBReplayTrace(const char *path, struct smb_replay_stats *stats) {
+	FILE *f;
+	struct traceRecord r;
+	unsigned char buf[TRACE_DATA_MAX], reply[TRACE_DATA_MAX];
+	unsigned long long start;
+	int status;
+
+	if (device == NULL && traceIn == NULL) return ERR_DEVICE_OPEN;
+	if ((f = traceOpen(path)) == NULL) return ERR_TRACE_FORMAT;
+	memset(stats,0,sizeof(*stats));
+
+	while ((status = traceRead(f,&r,buf)) == 0) {
+		start = nowUs();
+		if (r.direction == LIBUSB_ENDPOINT_IN) {
+			status = smbControl(LIBUSB_ENDPOINT_IN, r.request, r.value, r.index, reply, r.length, timeouts.batch);
+			if (status != r.result || (r.dataLen && memcmp(reply,buf,r.dataLen))) stats->mismatches++;
+		} else {
+			status = smbControl(LIBUSB_ENDPOINT_OUT, r.request, r.value, r.index, buf, r.length, timeouts.batch);
+			if (status != r.result) stats->mismatches++;
+		}
+		stats->replayUs += nowUs() - start;
+		stats->recordedUs += r.durationUs;
+		stats->requests++;
+	}
+	fclose(f);
+	return status == ERR_TRACE_END ? (int)stats->requests : status;
+}
+
+int SMBCaptureStart(const char *path) {
+	SMBCaptureStop();
+	if ((capOut = fopen(path,"wb")) == NULL) return ERR_TRACE_FORMAT;
+	capEpoch = (long long)time(NULL) * 1000000LL - (long long)nowUs();
+
+	// section header
+	capU32(0x0A0D0D0A);
+	capU32(28);
+	capU32(0x1A2B3C4D);
+	capU32(0x00000001);	// version 1.0
+	capU32(0xFFFFFFFF);	// section length unknown
+	capU32(0xFFFFFFFF);
+	capU32(28);
+
+	// interface, default microsecond timestamps
+	capU32(1);
+	capU32(20);
+	capU32(SMB_CAPTURE_LINKTYPE);
+	capU32(0);		// no snap length
+	capU32(20);
+	fflush(capOut);
+	return 0;
+}
+
+void SMBCaptureStop() {
+	if (capOut == NULL) return;
+	fclose(capOut);
+	capOut = NULL;
+}
+
+static void resetInterface() {
+	smbControl(LIBUSB_ENDPOINT_OUT, SMB_RESET_INTERFACE, 0, 0, NULL, 0, timeouts.transfer);
+}
+
+/*
+* Muxes: an SMB_MUX_ADDRESS reaches its device through a PCA9548 style mux.
+* The control byte last written to each mux is cached per bus so the 
+* channel select is only sent when the channel changes. Only one mux 
+* channel is kept open per bus, the same address behind two muxes would
+* answer at once otherwise.
+*/
+static int muxWrite(unsigned int mux, unsigned char control) {
+	int status, ret=0;
+
+	// PCA9548s take the control byte as a plain one byte write, that's a Send Byte
+	status = smbWriteRequest(SMB_SEND_BYTE, mux, control, (void*)&ret, 1, timeouts.transfer);
+	muxState[currentBus][mux>>1] = status < 0 ? 0 : control|MUX_KNOWN;
+	return status;
+}
+
+static int muxSelect(unsigned int mux, unsigned char control) {
+	int status;
+	unsigned int i;
+
+	for (i=0;i<128;i++) {
+		if (i != mux>>1 && (muxState[currentBus][i] & MUX_KNOWN) && (muxState[currentBus][i] & 0xFF)) {
+			if ((status = muxWrite(i<<1,0)) < 0) return status;
+		}
+	}
+	return muxWrite(mux,control);
+}
+
+static int muxNeedsSwitch(unsigned int address) {
+	if (!(address & SMB_MUX_FLAG)) return 0;
+	return muxState[currentBus][(address>>17) & 0x7F] != ((1 << ((address>>8) & 7)) | MUX_KNOWN);
+}
+
+/*
+* Puts the mux of an SMB_MUX_ADDRESS on its channel unless it's already there.
+* Returns the device address on the bus or <0 if the mux couldn't be set.
+*/
+static int route(unsigned int address) {
+	int status;
+	unsigned int mux;
+	unsigned char control;
+
+	routedMux = 0;
+	if (!(address & SMB_MUX_FLAG)) return address & 0xFF;
+
+	mux = (address>>16) & 0xFE;
+	control = 1 << ((address>>8) & 7);
+	routedMux = mux | (control<<8);
+	if (muxNeedsSwitch(address)) {
+		if ((status = muxSelect(mux,control)) < 0) return status;
+	}
+	return address & 0xFF;
+}
+
+int SMBEnableAlert(unsigned char enable) {
+	return smbControl(LIBUSB_ENDPOINT_OUT, SMB_ALERT_ENABLE, enable>0, 0, NULL, 0, timeouts.transfer);
+}
+
+int SMBWaitAlert(unsigned int timeout) {
+	int status, transferred=0;
+	unsigned char report[64];
+
+	status = libusb_interrupt_transfer(device, SMB_ALERT_EP, report, sizeof(report), &transferred, timeout);
+	if (status < 0) return status;
+	if (transferred < 3) return ERR_SHORT_REPLY;
+	if (report[0] != SMB_STATUS_OK) return statusToError(report[0]);
+
+	// the ARA read returns the alerting device's address in the upper 7 bits
+	return report[1] & 0xFE;
+}
+
+/*
+* Sniffer: SNIFF_SLOTS bulk reads are kept queued so the endpoint is polled
+* while the caller decodes one, the firmware only buffers two packets.
+*/
+static void LIBUSB_CALL sniffCallback(struct libusb_transfer *transfer) {
+	*(int *)transfer->user_data = 1;
+}
+
+static void sniffFree() {
+	unsigned int i;
+
+	for (i=0;i<SNIFF_SLOTS;i++) {
+		if (sniffXfer[i] == NULL) continue;
+		free(sniffXfer[i]->buffer);
+		libusb_free_transfer(sniffXfer[i]);
+		sniffXfer[i] = NULL;
+	}
+}
+
+int SMBSniffStart(unsigned char bus) {
+	int status;
+	unsigned int i;
+	unsigned char *buf;
+
+	if (bus == SMB_BUS_I2C || bus > SMB_BUSES) return LIBUSB_ERROR_INVALID_PARAM;
+	SMBSniffStop();
+
+	for (i=0;i<SNIFF_SLOTS;i++) {
+		if ((sniffXfer[i] = libusb_alloc_transfer(0)) == NULL || (buf = malloc(SNIFF_SLOT_SIZE)) == NULL) {
+			if (sniffXfer[i] != NULL) libusb_free_transfer(sniffXfer[i]);
+			sniffXfer[i] = NULL;
+			sniffFree();
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		libusb_fill_bulk_transfer(sniffXfer[i], device, SMB_SNIFF_EP, buf, SNIFF_SLOT_SIZE, 
+						sniffCallback, &sniffDone[i], 0);
+		sniffDone[i] = 1;
+	}
+	sniffSlot = 0;
+	sniffPos = 0;
+	sniffEpoch = 0;
+
+	if ((status = smbControl(LIBUSB_ENDPOINT_OUT, SMB_SNIFF, bus, 0, NULL, 0, timeouts.transfer)) < 0) {
+		sniffFree();
+		return status;
+	}
+	for (i=0;i<SNIFF_SLOTS;i++) {
+		sniffDone[i] = 0;
+		if ((status = libusb_submit_transfer(sniffXfer[i])) < 0) {
+			sniffDone[i] = 1;
+			SMBSniffStop();
+			return status;
+		}
+	}
+	return 0;
+}
+
+int SMBSniffRead(struct smb_sniff_event *events, unsigned int max, unsigned int timeout) {
+	struct libusb_transfer *t;
+	struct timeval tv;
+	unsigned char *rec;
+	unsigned int ticks, n=0;
+	int status;
+
+	if (sniffXfer[0] == NULL) return LIBUSB_ERROR_INVALID_PARAM;
+
+	while (n < max) {
+		if (!sniffDone[sniffSlot]) {
+			if (n) break;
+			tv.tv_sec = timeout/1000;
+			tv.tv_usec = (timeout%1000)*1000;
+			status = libusb_handle_events_timeout_completed(NULL, &tv, &sniffDone[sniffSlot]);
+			if (status < 0) return status;
+			if (!sniffDone[sniffSlot]) return 0;
+		}
+		t = sniffXfer[sniffSlot];
+		if (t->status == LIBUSB_TRANSFER_OVERFLOW) return LIBUSB_ERROR_OVERFLOW;
+		if (t->status != LIBUSB_TRANSFER_COMPLETED) return LIBUSB_ERROR_IO;
+
+		for (;sniffPos + 4 <= (unsigned int)t->actual_length && n < max;sniffPos+=4) {
+			rec = t->buffer + sniffPos;
+			ticks = rec[2] | (rec[3]<<8);
+			switch (rec[0] & 0x7F) {
+				case SMB_SNIFF_WRAP:
+					sniffEpoch += 0x10000;
+					continue;
+				case SMB_SNIFF_LOST:
+					// the wraps that went with the lost records
+					sniffEpoch += (unsigned long long)ticks<<16;
+					ticks = 0;
+					break;
+			}
+			events[n].time = (sniffEpoch + ticks) * SMB_SNIFF_TICK_NS;
+			events[n].type = rec[0] & 0x7F;
+			events[n].data = rec[1];
+			events[n].nak = (rec[0] & 0x80) != 0;
+			n++;
+		}
+		if (sniffPos + 4 > (unsigned int)t->actual_length) {
+			sniffDone[sniffSlot] = 0;
+			if ((status = libusb_submit_transfer(t)) < 0) {
+				sniffDone[sniffSlot] = 1;
+				return status;
+			}
+			sniffPos = 0;
+			sniffSlot = (sniffSlot+1) % SNIFF_SLOTS;
+		}
+	}
+	return n;
+}
+
+int SMBSniffStop() {
+	unsigned int i;
+	struct timeval tv = { 1, 0 };
+
+	if (sniffXfer[0] == NULL) return 0;
+	smbControl(LIBUSB_ENDPOINT_OUT, SMB_SNIFF, 0, 0, NULL, 0, timeouts.transfer);
+	for (i=0;i<SNIFF_SLOTS;i++) {
+		if (!sniffDone[i]) libusb_cancel_transfer(sniffXfer[i]);
+	}
+	for (i=0;i<SNIFF_SLOTS;i++) {
+		while (!sniffDone[i]) {
+			if (libusb_handle_events_timeout_completed(NULL, &tv, &sniffDone[i]) < 0) break;
+		}
+	}
+	sniffFree();
+	return 0;
+}
+
+void SMBResetMuxCache() {
+	memset(muxState,0,sizeof(muxState));
+}
+
+int SMBOrderByChannel(const unsigned int *addresses, unsigned int count, unsigned int *order) {
+	unsigned int i,j,n=0,key;
+	int switches=0;
+	unsigned char *placed;
+
+	if ((placed = calloc(count ? count : 1,1)) == NULL) return LIBUSB_ERROR_NO_MEM;
+
+	// what can go without a switch goes first
+	for (i=0;i<count;i++) {
+		if (!muxNeedsSwitch(addresses[i])) {
+			order[n++] = i;
+			placed[i] = 1;
+		}
+	}
+	// then one channel at a time, in the order they first show up
+	for (i=0;i<count;i++) {
+		if (placed[i]) continue;
+		key = addresses[i] & SMB_MUX_CHANNEL_MASK;
+		switches++;
+		for (j=i;j<count;j++) {
+			if (!placed[j] && (addresses[j] & SMB_MUX_CHANNEL_MASK) == key) {
+				order[n++] = j;
+				placed[j] = 1;
+			}
+		}
+	}
+	free(placed);
+	return switches;
+}
+
+/*
+* Called after every attempt of a retryable transaction with its result.
+* Records the result and returns 1 after sleeping the backoff if the policy says
+* the transaction should be tried again.
+*/
+static int retryTransaction(int status, unsigned int *attempt) {
+	unsigned int errClass,backoff,i;
+
+	(*attempt)++;
+	lastResult.status = status;
+	lastResult.attempts = *attempt;
+	lastResult.pecFailed = (status == ERR_PEC_FAIL);
+	lastResult.acked = busAcked;
+
+	if (status >= 0) return 0;
+	// the mux may have been reset along with whatever failed, select the channel again next time
+	if (routedMux) muxState[currentBus][(routedMux>>1) & 0x7F] = 0;
+	// a slave may be holding the bus, free it whether this is retried or not
+	if (autoRecover && (status == ERR_BUS_ERROR || status == ERR_BUS_TIMEOUT)) SMBRecoverBus();
+	if (*attempt >= retryPolicy.maxAttempts) return 0;
+
+	switch (status) {
+		case ERR_PEC_FAIL:
+			errClass = SMB_RETRY_ON_PEC;
+			break;
+		case LIBUSB_ERROR_TIMEOUT:
+			errClass = SMB_RETRY_ON_TIMEOUT;
+			break;
+		case LIBUSB_ERROR_PIPE:
+			errClass = SMB_RETRY_ON_STALL;
+			break;
+		case ERR_NAK_ADDRESS:
+		case ERR_NAK_COMMAND:
+		case ERR_NAK_DATA:
+			errClass = SMB_RETRY_ON_NAK;
+			break;
+		case ERR_BUS_ERROR:
+		case ERR_BUS_TIMEOUT:
+			errClass = SMB_RETRY_ON_BUS;
+			break;
+		default:
+			errClass = SMB_RETRY_ON_OTHER;
+	}
+	if (!(retryPolicy.retryOn & errClass)) return 0;
+
+	backoff = retryPolicy.backoffUs;
+	for (i=1;i<*attempt;i++) backoff *= retryPolicy.backoffFactor;
+	if (backoff > 0) usleep(backoff);
+
+	if (routedMux && muxSelect(routedMux&0xFF,routedMux>>8) < 0) return 0;
+
+	totalRetries++;
+	smbLog(SMB_LOG_INFO, SMB_EVENT_RETRY, 0, status, *attempt, 0, NULL);
+	return 1;
+}
+
+unsigned int SMBInterfaceID() {
+	unsigned int magic=0;
+	int status;
+	status = smbControl(LIBUSB_ENDPOINT_IN, SMB_INTERFACE_ID, 0, 0, (void*)&magic, 3, timeouts.transfer);
+	if ((status <=0) | (magic != 0x4d5355)) {
+		return 0;	
+	} else {
+		return magic;
+	}	
+}
+
+int SMBReadByte(unsigned int address, unsigned char command) {
+	int status, hp = (pecMode == SMB_PEC_HOST);
+	unsigned int attempt=0;
+	unsigned char buf[2];
+
+	if ((status = route(address)) < 0) return status;
+	address = status;
+
+	do {
+		busAcked=0;
+		status = smbRequest(SMB_READ_BYTE, address, command, buf, 1+hp, timeouts.transfer);
+		if (status==1+hp) { 
+			status=buf[0];
+			if (hp && buf[1] != pecRead(address,&command,1,buf,1)) status=ERR_PEC_FAIL;
+		} else if (status>=0) {
+			status=ERR_SHORT_REPLY;
+		}
+	} while (retryTransaction(status,&attempt));
+
+	return status;
+}
+
+int SMBSendByte(unsigned int address, unsigned char command) {
+	int status, ret=0;
+	unsigned int attempt=0;
+
+	cacheDrop(address);
+	if ((status = route(address)) < 0) return status;
+	address = status;
+
+	do {
+		busAcked=0;
+		status = smbWriteRequest(SMB_SEND_BYTE, address, command, (void*)&ret, 1, timeouts.transfer);
+	} while (retryTransaction(status,&attempt));
+
+	return status;
+}
+
+
+int SMBWriteByte(unsigned int address, unsigned char command, unsigned char data) {
+	int status, hp = (pecMode == SMB_PEC_HOST);
+	unsigned int attempt=0;
+	unsigned char buf[3] = { command, data };
+
+	cacheDrop(address);
+	if ((status = route(address)) < 0) return status;
+	address = status;
+
+	if (hp) buf[2] = pecWrite(address,buf,2);
+
+	do {
+		busAcked=0;
+		status = smbWriteRequest(SMB_WRITE_BYTE, address, command, buf+1, 1+hp, timeouts.transfer);
+		if (status==1+hp) status=0;
+	} while (retryTransaction(status,&attempt));
+
+	return status;
+}
+
+
+int SMBReadWord(unsigned int address, unsigned char command) {
+	int status, hp = (pecMode == SMB_PEC_HOST);
+	unsigned int attempt=0, key=address;
+	unsigned char buf[3];
+
+	if (cacheGet(key,command,CACHE_WORD,buf) == 2) return buf[0] | (buf[1]<<8);
+
+	if ((status = route(address)) < 0) return status;
+	address = status;
+
+	do {
+		busAcked=0;
+		status = smbRequest(SMB_READ_WORD, address, command, buf, 2+hp, timeouts.transfer);
+		if (status==2+hp) { 
+			status=buf[0] | (buf[1]<<8);
+			if (hp && buf[2] != pecRead(address,&command,1,buf,2)) status=ERR_PEC_FAIL;
+		} else if (status>=0) {
+			status=ERR_SHORT_REPLY;
+		}
+	} while (retryTransaction(status,&attempt));
+
+	if (status >= 0) cachePut(key,command,CACHE_WORD,buf,2);
+	return status;
+}
+
+int SMBWriteWord(unsigned int address, unsigned char command, unsigned int data) {
+	int status, hp = (pecMode == SMB_PEC_HOST);
+	unsigned int attempt=0;
+	unsigned char buf[4] = { command, data&0xFF, (data>>8)&0xFF };
+
+	cacheDrop(address);
+	if ((status = route(address)) < 0) return status;
+	address = status;
+
+	if (hp) buf[3] = pecWrite(address,buf,3);
+
+	do {
+		busAcked=0;
+		status = smbWriteRequest(SMB_WRITE_WORD, address, command, buf+1, 2+hp, timeouts.transfer);
+		if (status==2+hp) status=0;
+	} while (retryTransaction(status,&attempt));
+
+	return status;
+}
+
+
+static int readBlock(unsigned int address, unsigned char command, unsigned char *data) {
+	int status, total, hp = (pecMode == SMB_PEC_HOST);
+	unsigned char tmp[SMB_RESP_MAX+1];
+
+	busAcked=0;
+	// blocksz byte and the whole block come in one multi-packet reply
+	status = smbRequest(SMB_READ_BLOCK, address, command, tmp, SMB_RESP_MAX+hp, timeouts.transfer);
+
+	if (status <0) return status;
+	if (status ==0) return ERR_SHORT_REPLY;
+
+	total = tmp[0];
+	if (status-1-hp < total) return ERR_SHORT_REPLY;
+	if (hp && tmp[total+1] != pecRead(address,&command,1,tmp,total+1)) return ERR_PEC_FAIL;
+
+	memcpy(data,tmp+1,total);
+		
+	return total;
+}
+
+int SMBReadBlock(unsigned int address, unsigned char command, unsigned char *data) {
+	int status;
+	unsigned int attempt=0, key=address;
+
+	if ((status = cacheGet(key,command,CACHE_BLOCK,data)) >= 0) return status;
+
+	if ((status = route(address)) < 0) return status;
+	address = status;
+
+	do {
+		if (attempt>0) resetInterface(); // make sure the failed read released the bus
+		status = readBlock(address,command,data);
+	} while (retryTransaction(status,&attempt));
+
+	if (status >= 0) cachePut(key,command,CACHE_BLOCK,data,status);
+	return status;
+}
+
+static int writeBlock(unsigned int address, unsigned char command, unsigned char *data, unsigned char len) {
+	int status, hp = (pecMode == SMB_PEC_HOST);
+	unsigned char tmp[SMB_RESP_MAX+2];
+	
+	tmp[0]=command;
+	tmp[1]=len;
+	memcpy(tmp+2,data,len);
+	if (hp) tmp[len+2] = pecWrite(address,tmp,len+2);
+	busAcked=0;
+
+	status = smbWriteRequest(SMB_WRITE_BLOCK, address, command, tmp+1, len+1+hp, timeouts.transfer);
+	if (status != len+1+hp) return status < 0 ? status : ERR_SHORT_REPLY;
+	
+	return len;			
+}
+
+int SMBWriteBlock(unsigned int address, unsigned char command, unsigned char *data, unsigned char len) {
+	int status;
+	unsigned int attempt=0;
+
+	cacheDrop(address);
+	if ((status = route(address)) < 0) return status;
+	address = status;
+
+	do {
+		if (attempt>0) resetInterface(); // make sure the failed write released the bus
+		status = writeBlock(address,command,data,len);
+	} while (retryTransaction(status,&attempt));
+
+	return status;
+}
+
+
+int SMBProcessCall(unsigned int address, unsigned char command, unsigned int data) {
+	int status, hp = (pecMode == SMB_PEC_HOST);
+	unsigned int attempt=0;
+	unsigned char w[3] = { command, data&0xFF, (data>>8)&0xFF };
+	unsigned char buf[3];
+
+	cacheDrop(address);
+	if ((status = route(address)) < 0) return status;
+	address = status;
+
+	do {
+		busAcked=0;
+		status = smbRequest(SMB_PROCESS_CALL, (address&0xFF) | (command<<8), data&0xFFFF, buf, 2+hp, timeouts.transfer);
+		if (status==2+hp) { 
+			status=buf[0] | (buf[1]<<8);
+			if (hp && buf[2] != pecRead(address,w,3,buf,2)) status=ERR_PEC_FAIL;
+		} else if (status>=0) {
+			status=ERR_SHORT_REPLY;
+		}
+	} while (retryTransaction(status,&attempt));
+
+	return status;
+}
+
+static int blockProcessCall(unsigned int address, unsigned char command, unsigned char *wdata, unsigned char wlen, unsigned char *rdata) {
+	int status, total, hp = (pecMode == SMB_PEC_HOST);
+	unsigned char tmp[SMB_RESP_MAX+1], w[SMB_RESP_MAX+1];
+
+	status = smbWriteRequest(SMB_STAGE_WRITE, 0, 0, wdata, wlen, timeouts.transfer);
+	if (status < 0) return status;
+	if (status != wlen) return ERR_SHORT_REPLY;
+
+	busAcked=0;
+	status = smbRequest(SMB_BLOCK_PROCESS_CALL, address, command, tmp, SMB_RESP_MAX+hp, timeouts.batch);
+
+	if (status <0) return status;
+	if (status ==0) return ERR_SHORT_REPLY;
+
+	total = tmp[0];
+	if (status-1-hp < total) return ERR_SHORT_REPLY;
+	if (hp) {
+		// one PEC over both halves
+		w[0] = command;
+		w[1] = wlen;
+		memcpy(w+2,wdata,wlen);
+		if (tmp[total+1] != pecRead(address,w,wlen+2,tmp,total+1)) return ERR_PEC_FAIL;
+	}
+
+	memcpy(rdata,tmp+1,total);
+		
+	return total;
+}
+
+int SMBBlockProcessCall(unsigned int address, unsigned char command, unsigned char *wdata, unsigned char wlen, unsigned char *rdata) {
+	int status;
+	unsigned int attempt=0;
+
+	if (wlen == 0) return LIBUSB_ERROR_INVALID_PARAM;	// before a mux gets switched for nothing
+
+	cacheDrop(address);
+	if ((status = route(address)) < 0) return status;
+	address = status;
+
+	do {
+		if (attempt>0) resetInterface(); // make sure the failed call released the bus
+		status = blockProcessCall(address,command,wdata,wlen,rdata);
+	} while (retryTransaction(status,&attempt));
+
+	return status;
+}
+
+/*
+* Reads count consecutive word registers with as few requests as fit in the replies.
+* Every word gets its own status, the return value is <0 only if the USB side failed.
+*/
+static int readWords(unsigned int address, unsigned char first, unsigned int count, unsigned short *words, int *wordStatus) {
+	int status, got, i;
+	unsigned int done=0, chunk, attempt, stride;
+	unsigned char tmp[SMB_RESP_MAX], reg;
+
+	// in host PEC mode every word carries its raw PEC
+	stride = pecMode == SMB_PEC_HOST ? 4 : 3;
+	while (done < count) {
+		chunk = count-done > SMB_RESP_MAX/stride ? SMB_RESP_MAX/stride : count-done;
+		attempt=0;
+		do {
+			status = smbRequest(SMB_READ_WORDS, address, ((first+done)&0xFF) | (chunk<<8), tmp, chunk*stride, timeouts.batch);
+		} while (retryTransaction(status,&attempt));
+		if (status < 0) return status;
+
+		got = status/stride;
+		for (i=0;i<got;i++) {
+			wordStatus[done+i] = statusToError(tmp[i*stride]);
+			words[done+i] = tmp[i*stride+1] | (tmp[i*stride+2]<<8);
+			reg = first+done+i;
+			if (stride == 4 && wordStatus[done+i] == 0 && tmp[i*stride+3] != pecRead(address,&reg,1,tmp+i*stride+1,2)) {
+				wordStatus[done+i] = ERR_PEC_FAIL;
+			}
+		}
+		// the firmware stops early on bus errors, the rest of the chunk shares the last one's fate
+		for (;i<(int)chunk;i++) {
+			wordStatus[done+i] = got > 0 ? wordStatus[done+got-1] : ERR_SHORT_REPLY;
+		}
+		done+=chunk;
+	}
+	return count;
+}
+
+/*
+* Command lists: the commands are staged once, then every SMB_READ_*_LIST
+* request reads as many as fit in a reply, starting at the entry given.
+* The result for commands[j] goes to entry slot[j] of the output arrays.
+*/
+static int readWordList(unsigned int address, const unsigned char *commands, const unsigned int *slot, unsigned int count, 
+			unsigned short *words, int *wordStatus) {
+	int status, got, i;
+	unsigned int done=0, chunk, attempt, stride, k;
+	unsigned char tmp[SMB_RESP_MAX];
+
+	if ((status = smbWriteRequest(SMB_STAGE_WRITE, 0, 0, (unsigned char *)commands, count, timeouts.transfer)) < 0) return status;
+
+	stride = pecMode == SMB_PEC_HOST ? 4 : 3;
+	while (done < count) {
+		chunk = count-done > SMB_RESP_MAX/stride ? SMB_RESP_MAX/stride : count-done;
+		attempt=0;
+		do {
+			status = smbRequest(SMB_READ_WORD_LIST, address, done, tmp, chunk*stride, timeouts.batch);
+		} while (retryTransaction(status,&attempt));
+		if (status < 0) return status;
+
+		got = status/stride;
+		for (i=0;i<got;i++) {
+			k = slot[done+i];
+			wordStatus[k] = statusToError(tmp[i*stride]);
+			words[k] = tmp[i*stride+1] | (tmp[i*stride+2]<<8);
+			if (stride == 4 && wordStatus[k] == 0 && tmp[i*stride+3] != pecRead(address,&commands[done+i],1,tmp+i*stride+1,2)) {
+				wordStatus[k] = ERR_PEC_FAIL;
+			}
+		}
+		if (got < (int)chunk) {
+			// the firmware stops on bus errors, the rest shares the last one's fate
+			for (i=done+got;i<(int)count;i++) wordStatus[slot[i]] = got > 0 ? wordStatus[slot[done+got-1]] : ERR_SHORT_REPLY;
+			break;
+		}
+		done+=chunk;
+	}
+	return count;
+}
+
+int SMBReadWords(unsigned int address, const unsigned char *commands, unsigned int count, unsigned short *words, int *wordStatus) {
+	int status, routed=-1;
+	unsigned int i, j, n, done, chunk, slot[SMB_LIST_MAX];
+	unsigned char missed[SMB_LIST_MAX], buf[2];
+
+	for (done=0;done<count;done+=chunk) {
+		chunk = count-done > SMB_LIST_MAX ? SMB_LIST_MAX : count-done;
+
+		// cached registers are answered here, the rest goes in the list
+		for (i=done,n=0;i<done+chunk;i++) {
+			if (cacheGet(address,commands[i],CACHE_WORD,buf) == 2) {
+				words[i] = buf[0] | (buf[1]<<8);
+				wordStatus[i] = 0;
+			} else {
+				missed[n] = commands[i];
+				slot[n++] = i;
+			}
+		}
+		if (n == 0) continue;
+
+		if (routed < 0 && (routed = route(address)) < 0) return routed;
+		if ((status = readWordList(routed, missed, slot, n, words, wordStatus)) < 0) return status;
+
+		for (j=0;j<n;j++) {
+			if (wordStatus[slot[j]] != 0) continue;
+			buf[0] = words[slot[j]] & 0xFF;
+			buf[1] = words[slot[j]] >> 8;
+			cachePut(address,missed[j],CACHE_WORD,buf,2);
+		}
+	}
+	return count;
+}
+
+static int readBlockList(unsigned int address, const unsigned char *commands, const unsigned int *slot, unsigned int count, 
+			unsigned char *blocks, int *blockStatus) {
+	int status, got, pos, len, hp = (pecMode == SMB_PEC_HOST);
+	unsigned int done=0, attempt, k;
+	unsigned char tmp[SMB_RESP_MAX+1];
+
+	if ((status = smbWriteRequest(SMB_STAGE_WRITE, 0, 0, (unsigned char *)commands, count, timeouts.transfer)) < 0) return status;
+
+	while (done < count) {
+		attempt=0;
+		do {
+			status = smbRequest(SMB_READ_BLOCK_LIST, address, done, tmp, SMB_RESP_MAX, timeouts.batch);
+		} while (retryTransaction(status,&attempt));
+		if (status < 0) return status;
+
+		// status, blocksz, block (, raw PEC) per command, a failed one is status, 0
+		for (pos=0,got=0;pos+2 <= status && done+got < count;got++) {
+			k = slot[done+got];
+			blockStatus[k] = statusToError(tmp[pos]);
+			len = tmp[pos+1];
+			if (blockStatus[k] < 0) {
+				pos += 2;
+				continue;
+			}
+			if (pos+2+len+hp > status) return ERR_SHORT_REPLY;
+			if (hp && tmp[pos+2+len] != pecRead(address,&commands[done+got],1,tmp+pos+1,len+1)) {
+				blockStatus[k] = ERR_PEC_FAIL;
+			} else {
+				memcpy(blocks+k*SMB_BLOCK_STRIDE,tmp+pos+2,len);
+				blockStatus[k] = len;
+			}
+			pos += 2+len+hp;
+		}
+		if (got == 0) return ERR_SHORT_REPLY;
+		k = slot[done+got-1];
+		if (blockStatus[k] == ERR_BUS_ERROR || blockStatus[k] == ERR_BUS_TIMEOUT) {
+			for (;done+got<count;got++) blockStatus[slot[done+got]] = blockStatus[k];
+		}
+		done += got;
+	}
+	return count;
+}
+
+int SMBReadBlocks(unsigned int address, const unsigned char *commands, unsigned int count, unsigned char *blocks, int *blockStatus) {
+	int status, routed=-1;
+	unsigned int i, j, n, done, chunk, attempt, slot[SMB_LIST_MAX];
+	unsigned char missed[SMB_LIST_MAX];
+
+	for (done=0;done<count;done+=chunk) {
+		chunk = count-done > SMB_LIST_MAX ? SMB_LIST_MAX : count-done;
+
+		for (i=done,n=0;i<done+chunk;i++) {
+			if ((blockStatus[i] = cacheGet(address,commands[i],CACHE_BLOCK,blocks+i*SMB_BLOCK_STRIDE)) < 0) {
+				missed[n] = commands[i];
+				slot[n++] = i;
+			}
+		}
+		if (n == 0) continue;
+
+		if (routed < 0 && (routed = route(address)) < 0) return routed;
+		if ((status = readBlockList(routed, missed, slot, n, blocks, blockStatus)) < 0) return status;
+
+		for (j=0;j<n;j++) {
+			i = slot[j];
+			// a block that didn't fit in what was left of a reply gets a request of its own
+			if (blockStatus[i] == ERR_BAD_BLOCK_LENGTH) {
+				attempt=0;
+				do {
+					if (attempt>0) resetInterface();
+					blockStatus[i] = readBlock(routed, missed[j], blocks+i*SMB_BLOCK_STRIDE);
+				} while (retryTransaction(blockStatus[i],&attempt));
+			}
+			if (blockStatus[i] >= 0) cachePut(address,missed[j],CACHE_BLOCK,blocks+i*SMB_BLOCK_STRIDE,blockStatus[i]);
+		}
+	}
+	return count;
 }
 
-int SMBOpenDeviceVIDPID(unsigned int vid,unsigned int pid){
+int SMBSelectBus(unsigned char bus) {
 	int status;
-	if (device != NULL) return ERR_ALREADY_OPEN;
-
 
-	status = libusb_init(NULL);
-	if (status < 0) {
-		logerror("libusb_init() failed: %s\n", libusb_error_name(status));
-		return status;
-	}
-	libusb_set_debug(NULL, 0);
-	
-	openvidpid_retry:
-	device = libusb_open_device_with_vid_pid(NULL, (uint16_t)vid, (uint16_t)pid);
-		if (device == NULL) {
-			logerror("libusb_open() failed\n");
-			return ERR_DEVICE_OPEN;		
-		}	
-	status = InitDevice();
-	if (status == INIT_RETRY) goto openvidpid_retry;
+	if (bus > SMB_BUSES) return LIBUSB_ERROR_INVALID_PARAM;
+	status = smbControl(LIBUSB_ENDPOINT_OUT, SMB_SELECT_BUS, bus, 0, NULL, 0, timeouts.transfer);
+	if (status >= 0) currentBus = bus;
 	return status;
 }
 
-int SMBOpenDeviceBusAddr(unsigned int bus, unsigned int addr){
-	int i,status;
-	
-	if (device != NULL) return ERR_ALREADY_OPEN;
+int SMBReadWordMulti(unsigned char busMask, unsigned int address, unsigned char command, unsigned short *words, int *wordStatus) {
+	int status, i, n=0, stride;
+	unsigned int attempt=0;
+	unsigned char tmp[SMB_RESP_MAX];
 
-	status = libusb_init(NULL);
-	if (status < 0) {
-		logerror("libusb_init() failed: %s\n", libusb_error_name(status));
-		return status;
-	}
-	libusb_set_debug(NULL, 0);
+	// lockstep only works for buses on the same port
+	if (busMask == 0 || ((busMask & 0x0F) && (busMask & 0xF0))) return LIBUSB_ERROR_INVALID_PARAM;
+	if (address & SMB_MUX_FLAG) return LIBUSB_ERROR_INVALID_PARAM;	// no mux selects in lockstep
 
+	stride = pecMode == SMB_PEC_HOST ? 4 : 3;
+	do {
+		busAcked=0;
+		status = smbRequest(SMB_READ_WORD_MULTI, (address&0xFF) | (busMask<<8), command, tmp, SMB_BUSES/2*stride, timeouts.batch);
+	} while (retryTransaction(status,&attempt));
+	if (status < 0) return status;
 
-	openbusadd_retry:
-	if (libusb_get_device_list(NULL, &devs) < 0) {
-		logerror("libusb_get_device_list() failed: %s\n", libusb_error_name(status));
-		return status;
-	}
-	for (i=0; (dev=devs[i]) != NULL; i++) {
-		if ((libusb_get_bus_number(dev) == bus) && (libusb_get_device_address(dev) == addr)) {
-			status = libusb_open(dev, &device);
-			libusb_free_device_list(devs, 1);
-			if (status < 0) {
-				logerror("libusb_open() failed: %s\n", libusb_error_name(status));
-				return status;
-			}				
-			status = InitDevice();
-			if (status == INIT_RETRY) goto openbusadd_retry;
-			return status;
+	for (i=0;i<SMB_BUSES;i++) {
+		if (!(busMask & (1<<i))) continue;
+		if ((n+1)*stride > status) return ERR_SHORT_REPLY;
+		wordStatus[i] = statusToError(tmp[n*stride]);
+		words[i] = tmp[n*stride+1] | (tmp[n*stride+2]<<8);
+		if (stride == 4 && wordStatus[i] == 0 && tmp[n*stride+3] != pecRead(address,&command,1,tmp+n*stride+1,2)) {
+			wordStatus[i] = ERR_PEC_FAIL;
 		}
+		n++;
 	}
-	return -1;
+	return n;
 }
 
-void SMBCloseDevice() {
-	if (device == NULL) return;
-	libusb_release_interface(device, 0);
-	libusb_close(device);
-	libusb_exit(NULL);
-	device=NULL;
-}
+static const size_t sbsWordFields[SBS_WORD_REGISTERS] = {
+	offsetof(struct sbs_snapshot, manufacturerAccess),
+	offsetof(struct sbs_snapshot, remainingCapacityAlarm),
+	offsetof(struct sbs_snapshot, remainingTimeAlarm),
+	offsetof(struct sbs_snapshot, batteryMode),
+	offsetof(struct sbs_snapshot, atRate),
+	offsetof(struct sbs_snapshot, atRateTimeToFull),
+	offsetof(struct sbs_snapshot, atRateTimeToEmpty),
+	offsetof(struct sbs_snapshot, atRateOK),
+	offsetof(struct sbs_snapshot, temperature),
+	offsetof(struct sbs_snapshot, voltage),
+	offsetof(struct sbs_snapshot, current),
+	offsetof(struct sbs_snapshot, averageCurrent),
+	offsetof(struct sbs_snapshot, maxError),
+	offsetof(struct sbs_snapshot, relativeStateOfCharge),
+	offsetof(struct sbs_snapshot, absoluteStateOfCharge),
+	offsetof(struct sbs_snapshot, remainingCapacity),
+	offsetof(struct sbs_snapshot, fullChargeCapacity),
+	offsetof(struct sbs_snapshot, runTimeToEmpty),
+	offsetof(struct sbs_snapshot, averageTimeToEmpty),
+	offsetof(struct sbs_snapshot, averageTimeToFull),
+	offsetof(struct sbs_snapshot, chargingCurrent),
+	offsetof(struct sbs_snapshot, chargingVoltage),
+	offsetof(struct sbs_snapshot, batteryStatus),
+	offsetof(struct sbs_snapshot, cycleCount),
+	offsetof(struct sbs_snapshot, designCapacity),
+	offsetof(struct sbs_snapshot, designVoltage),
+	offsetof(struct sbs_snapshot, specificationInfo),
+	offsetof(struct sbs_snapshot, manufactureDate),
+	offsetof(struct sbs_snapshot, serialNumber)
+};
 
-unsigned int SMBInterfaceID() {
-	unsigned int magic=0;
-	int status;
-	status = libusb_control_transfer(device,
-					LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
-					SMB_INTERFACE_ID,
-					0, 
-					0,
-					(void*)&magic, 
-					3, 
-					100);
-	if ((status <=0) | (magic != 0x4d5355)) {
-		return 0;	
-	} else {
-		return magic;
-	}	
-}
+int SMBReadSBSSnapshot(unsigned int address, struct sbs_snapshot *snapshot) {
+	int status, i, n, read=0;
+	unsigned int key=address;
+	unsigned short words[SBS_WORD_REGISTERS];
+	unsigned char *strings[3], buf[2];
+	static const unsigned char blockCommands[4] = { SBS_MANUFACTURER_NAME, SBS_DEVICE_NAME, SBS_DEVICE_CHEMISTRY, SBS_MANUFACTURER_DATA };
+	unsigned char blocks[4*SMB_BLOCK_STRIDE];
+	int blockStatus[4];
 
-int SMBReadByte(unsigned int address, unsigned char command) {
-	int status, ret=0;
-	
-	status = libusb_control_transfer(device,
-					LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
-					SMB_READ_BYTE,
-					address, 
-					command,
-					(void*)&ret, 
-					1, 
-					100);
-	if (status==1) { return ret;} else {return status;}
-}
+	if ((status = route(address)) < 0) return status;
+	address = status;
 
-int SMBSendByte(unsigned int address, unsigned char command) {
-	int status, ret=0;
-	
-	status = libusb_control_transfer(device,
-					LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
-					SMB_SEND_BYTE,
-					address, 
-					command,
-					(void*)&ret, 
-					1, 
-					100);
-	return status;
-}
+	memset(snapshot,0,sizeof(struct sbs_snapshot));
+	for (i=SBS_WORD_REGISTERS;i<SBS_MANUFACTURER_NAME;i++) snapshot->status[i] = ERR_NAK_COMMAND;
 
+	// the identification words are at the end, when they're cached the range stops short of them
+	for (n=SBS_WORD_REGISTERS;n>0 && cacheGet(key,n-1,CACHE_WORD,buf) == 2;n--) {
+		words[n-1] = buf[0] | (buf[1]<<8);
+		snapshot->status[n-1] = 0;
+	}
+	if (n > 0) {
+		status = readWords(address, SBS_MANUFACTURER_ACCESS, n, words, snapshot->status);
+		if (status < 0) return status;
+	}
+	for (i=0;i<n;i++) {
+		if (snapshot->status[i] != 0) continue;
+		buf[0] = words[i] & 0xFF;
+		buf[1] = words[i] >> 8;
+		cachePut(key,i,CACHE_WORD,buf,2);
+	}
 
-int SMBWriteByte(unsigned int address, unsigned char command, unsigned char data) {
-	int status, ret=0;
-	
-	status = libusb_control_transfer(device,
-					LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
-					SMB_WRITE_BYTE,
-					address, 
-					command,
-					&data, 
-					1, 
-					100);
-	if (status==1) { return ret;} else {return status;}
-}
+	for (i=0;i<SBS_WORD_REGISTERS;i++) {
+		if (snapshot->status[i] == 0) {
+			*(unsigned short*)((char*)snapshot+sbsWordFields[i]) = words[i];
+			read++;
+		}
+	}
 
+	// the three strings and ManufacturerData in one list
+	status = SMBReadBlocks(key, blockCommands, 4, blocks, blockStatus);
+	if (status < 0) return status;
 
-int SMBReadWord(unsigned int address, unsigned char command) {
-	int status, ret=0;
-	
-	status = libusb_control_transfer(device,
-					LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
-					SMB_READ_WORD,
-					address, 
-					command,
-					(void*)&ret, 
-					2, 
-					100);
-	if (status==2) { return ret;} else {return status;}
+	strings[0] = (unsigned char*)snapshot->manufacturerName;
+	strings[1] = (unsigned char*)snapshot->deviceName;
+	strings[2] = (unsigned char*)snapshot->deviceChemistry;
+	for (i=0;i<3;i++) {
+		status = blockStatus[i];
+		snapshot->status[SBS_MANUFACTURER_NAME+i] = status < 0 ? status : 0;
+		if (status < 0) {
+			strings[i][0] = 0;
+		} else {
+			if (status > 255) status = 255;
+			memcpy(strings[i],blocks+i*SMB_BLOCK_STRIDE,status);
+			strings[i][status] = 0;
+			read++;
+		}
+	}
+
+	status = blockStatus[3];
+	snapshot->status[SBS_MANUFACTURER_DATA] = status < 0 ? status : 0;
+	if (status >= 0) {
+		memcpy(snapshot->manufacturerData,blocks+3*SMB_BLOCK_STRIDE,status);
+		snapshot->manufacturerDataLen = status;
+		read++;
+	}
+
+	return read;
 }
 
-int SMBWriteWord(unsigned int address, unsigned char command, unsigned int data) {
-	int status, ret=0;
-	
-	status = libusb_control_transfer(device,
-					LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
-					SMB_WRITE_WORD,
-					address, 
-					command,
-					(void*)&data, 
-					2, 
-					100);
-	if (status==2) { return ret;} else {return status;}
+void SMBCacheEnable(unsigned char state) {
+	cacheOn = state > 0;
+	if (!cacheOn) cacheClear();
 }
 
+void SMBCacheSetTTL(unsigned char registerClass, unsigned int ttlMs) {
+	if (registerClass == SMB_CACHE_SLOW || registerClass == SMB_CACHE_STATIC) cacheTTL[registerClass] = ttlMs;
+}
 
-int SMBReadBlock(unsigned int address, unsigned char command, unsigned char *data) {
-	int status, rcvd=0, total = 0;
-	unsigned char *tmp = malloc(64);
+int SMBCacheDeclare(unsigned int address, unsigned char command, unsigned char registerClass) {
+	unsigned int i;
+	struct cacheValue *v;
 
-	status = libusb_control_transfer(device,
-					LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
-					SMB_READ_BLOCK,
-					address, 
-					command,
-					(void*)tmp, 
-					64, 
-					100);
-
-	if (status <=0) {
-		 free(tmp);
-		 return status;
+	if (registerClass > SMB_CACHE_STATIC) return LIBUSB_ERROR_INVALID_PARAM;
+
+	// a value cached under the old class shouldn't outlive the change
+	for (i=0;i<SMB_CACHE_REGISTERS;i++) {
+		v = &cacheValues[i];
+		if (v->used && v->address == address && v->command == command) v->used = 0;
 	}
-	total = tmp[0];
-	rcvd+=status-1;
 
-	memcpy(data,tmp+1,rcvd);
-	
-	while (rcvd < total) {
-		
-		status = libusb_control_transfer(device,
-					LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
-					SMB_READ_BLOCK,
-					address, 
-					command,
-					(void*)tmp, 
-					64, 
-					100);
-
-		if (status <0) {
-			 free(tmp);
-			 return status;
-		}
-		memcpy(data+rcvd,tmp,status);
-		rcvd+=status;
+	for (i=0;i<cacheDeclared;i++) {
+		if (cacheDecls[i].address == address && cacheDecls[i].command == command) break;
 	}
-		
-	free(tmp);
-	return total;
+	if (i == cacheDeclared) {
+		if (cacheDeclared == SMB_CACHE_REGISTERS) return LIBUSB_ERROR_NO_MEM;
+		cacheDeclared++;
+	}
+	cacheDecls[i].address = address;
+	cacheDecls[i].command = command;
+	cacheDecls[i].cls = registerClass;
+	return 0;
 }
 
-int SMBWriteBlock(unsigned int address, unsigned char command, unsigned char *data, unsigned char len) {
-	int status, i=0, wholeWrites=0, remainder=0;
-	unsigned char *tmp = malloc(256);
-	
-	wholeWrites = (len+1) / 64;
-	remainder = (len+1) - wholeWrites*64;
-
-	tmp[0]=len;
-	memcpy(tmp+1,data,len);
+int SMBCacheDeclareSBS(unsigned int address) {
+	static const unsigned char staticRegisters[] = {
+		SBS_DESIGN_CAPACITY, SBS_DESIGN_VOLTAGE, SBS_SPECIFICATION_INFO, SBS_MANUFACTURE_DATE,
+		SBS_SERIAL_NUMBER, SBS_MANUFACTURER_NAME, SBS_DEVICE_NAME, SBS_DEVICE_CHEMISTRY
+	};
+	static const unsigned char slowRegisters[] = { SBS_FULL_CHARGE_CAPACITY, SBS_CYCLE_COUNT };
+	unsigned int i;
+	int status;
 
-	while (i<wholeWrites) {
-		status = libusb_control_transfer(device,
-					LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
-					SMB_WRITE_BLOCK,
-					address, 
-					command,
-					(void*)(tmp+(i*64)), 
-					64, 
-					100);		
-		if (status != 64) {
-			free(tmp);
-			return status;
-		}
-		i++;
+	for (i=0;i<sizeof(staticRegisters);i++) {
+		if ((status = SMBCacheDeclare(address, staticRegisters[i], SMB_CACHE_STATIC)) < 0) return status;
 	}
-
-	if (remainder>0) {
-		status = libusb_control_transfer(device,
-					LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
-					SMB_WRITE_BLOCK,
-					address, 
-					command,
-					(void*)(tmp+(wholeWrites*64)), 
-					remainder, 
-					100);	
-		if (status != remainder) {
-			free(tmp);
-			return status;
-		}
+	for (i=0;i<sizeof(slowRegisters);i++) {
+		if ((status = SMBCacheDeclare(address, slowRegisters[i], SMB_CACHE_SLOW)) < 0) return status;
 	}
-	
-	free(tmp);
-	return len;			
+	return 0;
+}
+
+void SMBCacheInvalidate(unsigned int address) {
+	cacheDrop(address);
 }
 
+void SMBGetCacheStats(struct smb_cache_stats *stats) {
+	memcpy(stats,&cacheStats,sizeof(struct smb_cache_stats));
+}
 
 unsigned char SMBGetLastReadPECFail() {
-	int status;
-	unsigned char pec_failed=0;
-	status = libusb_control_transfer(device,
-					LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
-					SMB_GET_CLEAR_PEC_FAIL,
-					1, 
-					0,
-					(void*)&pec_failed, 
-					1, 
-					100);
+	unsigned char pec_failed = lastResult.pecFailed ? 0xFF : 0;
+
+	lastResult.pecFailed = 0;
+	return pec_failed;
+}
 
-	if (status==1) { return pec_failed;} else return status;	
+void SMBSetPECMode(unsigned char mode) {
+	if (mode > SMB_PEC_HOST) mode = SMB_PEC_FIRMWARE;
+	if (mode == SMB_PEC_HOST && pecTable[1] == 0) buildPecTable();
+	pecMode = mode;
+	hostMrqPec = 0; hostRcvPec = 0;
+	smbControl(LIBUSB_ENDPOINT_OUT, SMB_ENABLE_PEC, mode, 0, NULL, 0, timeouts.transfer);
 }
 
 void SMBEnablePEC(unsigned char state) {
-		libusb_control_transfer(device,
-					LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
-					SMB_ENABLE_PEC,
-					state>0?1:0, 
-					0,
-					NULL, 
-					0, 
-					100);
+	SMBSetPECMode(state>0 ? SMB_PEC_FIRMWARE : SMB_PEC_OFF);
+}
+
+/*
+* One SMB_WRITE. In host PEC mode the PEC is kept here and sent as the last 
+* data byte before the STOP.
+*/
+static int writeChunk(unsigned char rs, unsigned char *data, unsigned int len) {
+	int status;
+	unsigned char tmp[SMB_RESP_MAX+1];
+
+	if (pecMode != SMB_PEC_HOST) return smbWriteRequest(SMB_WRITE, len, rs, data, len, timeouts.transfer);
+
+	if (rs & SMB_WRITE_CMD_START_FIRST) hostMrqPec = 0;
+	hostMrqPec = pecUpdate(hostMrqPec,data,len);
+	if (!(rs & SMB_WRITE_CMD_STOP_AFTER)) return smbWriteRequest(SMB_WRITE, len, rs, data, len, timeouts.transfer);
+
+	memcpy(tmp,data,len);
+	tmp[len] = hostMrqPec;
+	status = smbWriteRequest(SMB_WRITE, len+1, rs, tmp, len+1, timeouts.transfer);
+	return status > (int)len ? (int)len : status;
 }
 
 int SMBWrite(unsigned char start, unsigned char restart, unsigned char stop, unsigned char *data, unsigned int len) {
 	int status,i,wholeWrites,remainder;
 	unsigned char rs;	
 
-	wholeWrites = len / 64;
-	remainder = len-wholeWrites*64;
+	wholeWrites = len / SMB_RESP_MAX;
+	remainder = len-wholeWrites*SMB_RESP_MAX;
 
 	rs=0;
 
 	if (start) rs |= SMB_WRITE_CMD_START_FIRST;
 	if (restart) rs |= SMB_WRITE_CMD_RESTART_FIRST;
+	if ((start || restart) && len > 0) cacheDrop(data[0]);
 
 	i=0;
 
 	while (i<wholeWrites) {
 		if ((i==wholeWrites-1) && (remainder==0) && (stop)) rs |= SMB_WRITE_CMD_STOP_AFTER;
-		status = libusb_control_transfer(device,
-						LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
-						SMB_WRITE,
-						64, 
-						rs,
-						(void*)(data+(i*64)), 
-						64, 
-						100);
+		status = writeChunk(rs, data+(i*SMB_RESP_MAX), SMB_RESP_MAX);
 		rs &= ~SMB_WRITE_CMD_START_FIRST;
 		rs &= ~SMB_WRITE_CMD_RESTART_FIRST;
 
-		if (status < 64) return status;
+		if (status < SMB_RESP_MAX) return status;
 
 		i++;
 	}
 	 
        	if (remainder>0) { 
 		if (stop) rs |= SMB_WRITE_CMD_STOP_AFTER;
-		status = libusb_control_transfer(device,
-						LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
-						SMB_WRITE,
-						remainder, 
-						rs,
-						(void*)(data+(wholeWrites*64)), 
-						remainder, 
-						100);		
+		status = writeChunk(rs, data+(wholeWrites*SMB_RESP_MAX), remainder);
 	}
 	if (status >0) { return len; } else { return status; }
 	
 }
 
-int SMBRead(unsigned int len, unsigned char* data, unsigned char lastRead) {
+/*
+* One SMB_READ. In host PEC mode the PEC is kept here and the last read 
+* brings the raw PEC along.
+*/
+static int readChunk(unsigned char rs, unsigned char *data, unsigned int len) {
+	int status;
+	unsigned int extra;
+	unsigned char tmp[SMB_RESP_MAX+1];
+
+	if (pecMode != SMB_PEC_HOST) return smbRequest(SMB_READ, len, rs, data, len, timeouts.transfer);
+
+	extra = (rs & SMB_READ_CMD_LAST_READ) ? 1 : 0;
+	status = smbRequest(SMB_READ, len, rs, tmp, len+extra, timeouts.transfer);
+	if (status < 0) return status;
+	if (status < (int)(len+extra)) return ERR_SHORT_REPLY;
+
+	memcpy(data,tmp,len);
+	hostMrqPec = pecUpdate(hostMrqPec,data,len);
+	if (extra) hostRcvPec = tmp[len];
+	return len;
+}
+
+static int readBytes(unsigned int len, unsigned char* data, unsigned char lastRead, unsigned char firstRead) {
 	int status,i,wholeReads,remainder;
 	unsigned char rs;	
 	
-	wholeReads = len / 64;
-	remainder = len-wholeReads*64;
-//	printf("wholeReads:%d, remainder:%d\n",wholeReads,remainder);
+	wholeReads = len / SMB_RESP_MAX;
+	remainder = len-wholeReads*SMB_RESP_MAX;
 	
 	rs=0;
 
-	rs |= SMB_READ_CMD_FIRST_READ;
+	if (firstRead) rs |= SMB_READ_CMD_FIRST_READ;
 	i=0;
 	while (i<wholeReads) {
 		if ((lastRead) && (i==wholeReads-1) && (remainder == 0)) rs |= SMB_READ_CMD_LAST_READ;
-		status = libusb_control_transfer(device,
-						LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
-						SMB_READ,
-						64, 
-						rs,
-						(void*)(data+(i*64)), 
-						64, 
-						100);		
+		status = readChunk(rs, data+(i*SMB_RESP_MAX), SMB_RESP_MAX);
 		
 		rs &= ~SMB_READ_CMD_FIRST_READ;
-//               	printf("wholeRead:%d, status:%d\n",i,status);
-		if (status<64) return status;		
+		if (status<0) return status;		
+		if (status<SMB_RESP_MAX) return ERR_SHORT_REPLY;		
 		i++;
 	}
 
@@ -429,30 +2335,88 @@ int SMBRead(unsigned int len, unsigned char* data, unsigned char lastRead) {
 		if (lastRead) {
 			rs |= SMB_READ_CMD_LAST_READ;
 		}
-		status = libusb_control_transfer(device,
-						LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
-						SMB_READ,
-						remainder, 
-						rs,
-						(void*)(data+(wholeReads*64)), 
-						remainder, 
-						100);		
+		status = readChunk(rs, data+(wholeReads*SMB_RESP_MAX), remainder);
+		if (status<0) return status;		
+		if (status<remainder) return ERR_SHORT_REPLY;		
 	}	
-//            	printf("remainder:%d, status:%d\n",i,status);
+	return len;
+}
+
+int SMBRead(unsigned int len, unsigned char* data, unsigned char lastRead) {
+	return readBytes(len,data,lastRead,1);
+}
+
+static int writeRead(unsigned int address, unsigned char *wbuf, unsigned int wlen, unsigned char *rbuf, unsigned int rlen, unsigned char flags) {
+	int status, pecs, hp = (pecMode == SMB_PEC_HOST);
+	unsigned int first, fwFlags=0, inlineBytes=0, rawPec;
+	unsigned char tmp[SMB_RESP_MAX+1];
+
+	first = rlen > SMB_RESP_MAX ? SMB_RESP_MAX : rlen;
+
+	// register pointers fit in the setup packet, anything longer is staged first
+	if (wlen > 0 && wlen <= 2) {
+		fwFlags = wlen;
+		inlineBytes = wbuf[0] | (wlen>1 ? wbuf[1]<<8 : 0);
+	} else if (wlen > 0) {
+		status = smbWriteRequest(SMB_STAGE_WRITE, 0, 0, wbuf, wlen, timeouts.transfer);
+		if (status < 0) return status;
+		if (status != (int)wlen) return ERR_SHORT_REPLY;
+	}
+	if (first < rlen || (flags & SMB_WRITE_READ_NO_STOP)) fwFlags |= SMB_WR_CONTINUE;
+
+	rawPec = hp && !(fwFlags & SMB_WR_CONTINUE);	// the raw PEC comes along if the read ends here
+
+	busAcked=0;
+	status = smbRequest(SMB_WRITE_READ, (address&0xFF) | (fwFlags<<8), inlineBytes, tmp, first+rawPec, timeouts.batch);
+	if (status < 0) return status;
+	if (status < (int)(first+rawPec)) return ERR_SHORT_REPLY;
+	memcpy(rbuf,tmp,first);
+
+	if (hp) {
+		hostMrqPec = pecRead(address,wbuf,wlen,rbuf,first);
+		if (rawPec && tmp[first] != hostMrqPec) return ERR_PEC_FAIL;
+	}
+
+	if (first < rlen) {
+		// the rest continues the same read, PEC is checked on the host like for SMBRead
+		status = readBytes(rlen-first, rbuf+first, !(flags & SMB_WRITE_READ_NO_STOP), 0);
+		if (status < 0) return status;
+		if (pecMode != SMB_PEC_OFF && !(flags & SMB_WRITE_READ_NO_STOP)) {
+			pecs = SMBGetArbPEC();
+			if (pecs < 0) return pecs;
+			if ((pecs & 0xFF) != ((pecs>>8) & 0xFF)) return ERR_PEC_FAIL;
+		}
+	}
+	return rlen;
+}
+
+int SMBWriteRead(unsigned int address, unsigned char *wbuf, unsigned int wlen, unsigned char *rbuf, unsigned int rlen, unsigned char flags) {
+	int status;
+	unsigned int attempt=0;
+
+	if (wlen > SMB_RESP_MAX || rlen == 0) return LIBUSB_ERROR_INVALID_PARAM;
+
+	cacheDrop(address);
+	if ((status = route(address)) < 0) return status;
+	address = status;
+
+	// a read left open can't be redone
+	if (flags & SMB_WRITE_READ_NO_STOP) return writeRead(address,wbuf,wlen,rbuf,rlen,flags);
+
+	do {
+		if (attempt>0) resetInterface(); // make sure the failed read released the bus
+		status = writeRead(address,wbuf,wlen,rbuf,rlen,flags);
+	} while (retryTransaction(status,&attempt));
+
 	return status;
 }
 
 unsigned int SMBGetArbPEC() {
 	int status;
 	short pecs=0;
-	status = libusb_control_transfer(device,
-					LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
-					SMB_GET_MRQ_PECS,
-					2, 
-					0,
-					(void*)&pecs, 
-					2, 
-					100);
+
+	if (pecMode == SMB_PEC_HOST) return hostMrqPec | (hostRcvPec<<8);
+	status = smbControl(LIBUSB_ENDPOINT_IN, SMB_GET_MRQ_PECS, 2, 0, (void*)&pecs, 2, timeouts.transfer);
 
 	if (status==2) { return pecs;} else return status;
 	
@@ -462,14 +2426,10 @@ int SMBTestAddressACK(unsigned int address) {
 	int status;
 	unsigned char res;
 
-	status = libusb_control_transfer(device,
-				LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
-				SMB_TEST_ADDRESS_ACK,
-				address, 
-				0,
-				(void*)&res, 
-				1, 
-				200);
+	if ((status = route(address)) < 0) return status;
+	address = status;
+
+	status = smbRequest(SMB_TEST_ADDRESS_ACK, address, 0, &res, 1, timeouts.transfer);
 
 	if (status ==1) { return res; } else {return status;}
 
@@ -477,14 +2437,10 @@ int SMBTestAddressACK(unsigned int address) {
 int SMBTestCommandACK(unsigned int address, unsigned char command){
 	int status;
 	unsigned char res;
-	status = libusb_control_transfer(device,
-				LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
-				SMB_TEST_COMMAND_ACK,
-				address, 
-				command,
-				(void*)&res, 
-				1, 
-				100);
+
+	if ((status = route(address)) < 0) return status;
+	address = status;
+	status = smbRequest(SMB_TEST_COMMAND_ACK, address, command, &res, 1, timeouts.transfer);
 
 	if (status ==1) { return res; } else {return status;}
 
@@ -492,26 +2448,290 @@ int SMBTestCommandACK(unsigned int address, unsigned char command){
 int SMBTestCommandWrite(unsigned int address, unsigned char command){
 	int status;
 	unsigned char res;
-	status = libusb_control_transfer(device,
-				LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
-				SMB_TEST_COMMAND_WRITE,
-				address, 
-				command,
-				(void*)&res, 
-				1, 
-				100);
+
+	cacheDrop(address);
+	if ((status = route(address)) < 0) return status;
+	address = status;
+	status = smbRequest(SMB_TEST_COMMAND_WRITE, address, command, &res, 1, timeouts.transfer);
 
 	if (status ==1) { return res; } else {return status;}
 }
 
+static int setScanSkip(const unsigned char *skipMap) {
+	unsigned char none[SMB_SCAN_MAP_SIZE] = {0};
+
+	return smbWriteRequest(SMB_SET_SCAN_SKIP, 0, 0, (unsigned char*)(skipMap != NULL ? skipMap : none), SMB_SCAN_MAP_SIZE, timeouts.transfer);
+}
+
+static int countBits(const unsigned char *map) {
+	int i,count=0;
+
+	for (i=0;i<SMB_SCAN_MAP_SIZE*8;i++) {
+		if (map[i>>3] & (1<<(i&7))) count++;
+	}
+	return count;
+}
+
+static int scanACK(unsigned char request, unsigned int address, unsigned char begin, unsigned char end, 
+			const unsigned char *skipMap, unsigned char *ackMap) {
+	int status;
+	unsigned int range = begin | (end<<8);
+
+	if ((status = setScanSkip(skipMap)) < 0) return status;
+
+	if (request == SMB_SCAN_ADDRESS_ACK) {
+		status = smbRequest(request, range, 0, ackMap, SMB_SCAN_MAP_SIZE, 2*timeouts.batch);
+	} else {
+		status = smbRequest(request, address, range, ackMap, SMB_SCAN_MAP_SIZE, 2*timeouts.batch);
+	}
+	if (status < 0) return status;
+	if (status != SMB_SCAN_MAP_SIZE) return ERR_SHORT_REPLY;
+
+	return countBits(ackMap);
+}
+
+int SMBScanAddressACK(unsigned char begin, unsigned char end, const unsigned char *skipMap, unsigned char *ackMap) {
+	return scanACK(SMB_SCAN_ADDRESS_ACK, 0, begin, end, skipMap, ackMap);
+}
+
+int SMBScanCommandACK(unsigned int address, unsigned char begin, unsigned char end, const unsigned char *skipMap, unsigned char *ackMap) {
+	int status;
+
+	if ((status = route(address)) < 0) return status;
+	address = status;
+	return scanACK(SMB_SCAN_COMMAND_ACK, address, begin, end, skipMap, ackMap);
+}
+
+int SMBScanCommandWrite(unsigned int address, unsigned char begin, unsigned char end, const unsigned char *skipMap, unsigned char *levels) {
+	int status, acked=0;
+	unsigned int i, chunkEnd;
+
+	if ((status = route(address)) < 0) return status;
+	address = status;
+
+	if ((status = setScanSkip(skipMap)) < 0) return status;
+
+	for (i=begin;i<=end;i=chunkEnd+1) {
+		chunkEnd = i+SMB_RESP_MAX-1 > end ? end : i+SMB_RESP_MAX-1;
+		status = smbRequest(SMB_SCAN_COMMAND_WRITE, address, i | (chunkEnd<<8), levels+i, chunkEnd-i+1, 2*timeouts.batch);
+		if (status < 0) return status;
+		if (status != (int)(chunkEnd-i+1)) return ERR_SHORT_REPLY;
+	}
+	for (i=begin;i<=end;i++) {
+		if (levels[i] > 0) acked++;
+	}
+	return acked;
+}
+
+void SMBSetRetryPolicy(const struct smb_retry_policy *policy) {
+	retryPolicy = *policy;
+	if (retryPolicy.maxAttempts == 0) retryPolicy.maxAttempts = 1;
+}
+
+void SMBGetRetryPolicy(struct smb_retry_policy *policy) {
+	*policy = retryPolicy;
+}
+
+void SMBGetLastResult(struct smb_result *result) {
+	*result = lastResult;
+	result->totalRetries = totalRetries;
+}
+
+int SMBRecoverBus() {
+	int status;
+
+	recoveryStats.attempts++;
+	status = smbWriteRequest(SMB_RECOVER_BUS, 0, 0, NULL, 0, timeouts.batch);
+	if (status < 0) {
+		recoveryStats.failed++;
+		smbLog(SMB_LOG_WARN, SMB_EVENT_RECOVERY, SMB_RECOVER_BUS, status, currentBus, 0, NULL);
+		return status;
+	}
+	recoveryStats.recovered++;
+	smbLog(SMB_LOG_INFO, SMB_EVENT_RECOVERY, SMB_RECOVER_BUS, 0, currentBus, 0, NULL);
+	return 0;
+}
+
+void SMBSetAutoRecover(unsigned char enable) {
+	autoRecover = enable > 0;
+}
+
+void SMBGetRecoveryStats(struct smb_recovery_stats *stats) {
+	*stats = recoveryStats;
+}
+
+int SMBSetBusTimeout(unsigned char bus, unsigned char clockLowMs) {
+	int status, i;
+
+	if (bus > SMB_BUSES && bus != SMB_ALL_BUSES) return LIBUSB_ERROR_INVALID_PARAM;
+	status = smbControl(LIBUSB_ENDPOINT_OUT, SMB_SET_TIMEOUT, clockLowMs, bus, NULL, 0, timeouts.transfer);
+	if (status < 0) return status;
+	for (i=0;i<=SMB_BUSES;i++) {
+		if (bus == SMB_ALL_BUSES || bus == i) busTimeout[i] = clockLowMs;
+	}
+	return 0;
+}
+
+int SMBSetTimeouts(const struct smb_timeouts *t) {
+	int status;
+
+	if (t->transfer == 0 || t->batch == 0) return LIBUSB_ERROR_INVALID_PARAM;
+	if (t->clockLow && (status = SMBSetBusTimeout(SMB_ALL_BUSES, t->clockLow)) < 0) return status;
+	timeouts.transfer = t->transfer;
+	timeouts.batch = t->batch;
+	return 0;
+}
+
+void SMBGetTimeouts(struct smb_timeouts *t) {
+	*t = timeouts;
+	t->clockLow = busTimeout[currentBus] ? busTimeout[currentBus] : SMB_CLOCK_LOW_DEFAULT;
+}
+
+/*
+* Runs unit with other timeouts and puts the previous ones back after it. The clock
+* low limit applies to the bus selected when the unit starts.
+*/
+int SMBWithTimeouts(const struct smb_timeouts *t, smb_unit_fn unit, void *arg) {
+	struct smb_timeouts saved = timeouts;
+	unsigned char bus = currentBus, savedLimit = busTimeout[bus];
+	int status;
+
+	if (t->transfer == 0 || t->batch == 0) return LIBUSB_ERROR_INVALID_PARAM;
+	if (t->clockLow && t->clockLow != savedLimit && (status = SMBSetBusTimeout(bus, t->clockLow)) < 0) return status;
+	timeouts.transfer = t->transfer;
+	timeouts.batch = t->batch;
+
+	status = unit(arg);
 
+	timeouts = saved;
+	if (busTimeout[bus] != savedLimit) SMBSetBusTimeout(bus, savedLimit);
+	return status;
+}
 
 void SMBSetDebugLogFunc(void *logFunc) {
 	extLogFunc = logFunc;
 }
 
+void SMBSetLogLevel(unsigned char level) {
+	logLevel = level;
+}
+
+static int readLogEvents(struct smb_log_event *events, unsigned int max) {
+	unsigned long head, seq;
+	struct logSlot *slot;
+	unsigned int n=0;
+
+	while (n < max) {
+		head = __atomic_load_n(&logHead, __ATOMIC_ACQUIRE);
+		if (head - logTail > LOG_RING) {
+			logDropped += head - LOG_RING - logTail;
+			logTail = head - LOG_RING;
+		}
+		if (logTail == head) break;
+
+		slot = &logRing[logTail % LOG_RING];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == 0) break;		// still being written
+		if (seq == logTail+1) {
+			events[n] = slot->event;
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			// overwritten while it was copied
+			if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) seq = 0;
+		}
+		if (seq != logTail+1) {
+			logDropped++;
+		} else if (logDropped) {
+			// the drop notice goes first, the event is picked up again next round
+			memset(&events[n],0,sizeof(events[n]));
+			events[n].timeUs = slot->event.timeUs;
+			events[n].level = SMB_LOG_WARN;
+			events[n].type = SMB_EVENT_DROPPED;
+			events[n].value = logDropped;
+			logDropped = 0;
+			n++;
+			continue;
+		} else {
+			n++;
+		}
+		logTail++;
+	}
+	return n;
+}
+
+int SMBFormatLogEvent(const struct smb_log_event *event, char *buf, unsigned int len) {
+	static const char *levels[] = { "", "error", "warning", "info", "debug" };
+	const char *level = event->level <= SMB_LOG_DEBUG ? levels[event->level] : "";
+	int n;
+
+	n = snprintf(buf, len, "[%llu.%06llu] %s: ", event->timeUs/1000000, event->timeUs%1000000, level);
+	if (n < 0 || (unsigned int)n >= len) return n;
+
+	switch (event->type) {
+		case SMB_EVENT_SUBMIT:
+			return n + snprintf(buf+n, len-n, "request %02x value %04x index %04x", 
+						event->request, event->value, event->index);
+		case SMB_EVENT_COMPLETE:
+			return n + snprintf(buf+n, len-n, "request %02x done, %d in %uus", 
+						event->request, event->status, event->index);
+		case SMB_EVENT_RETRY:
+			return n + snprintf(buf+n, len-n, "retry %u after %s", 
+						event->value, SMBGetErrorString(event->status));
+		case SMB_EVENT_STALL:
+			return n + snprintf(buf+n, len-n, "request %02x stalled: %s", 
+						event->request, SMBGetErrorString(event->status));
+		case SMB_EVENT_FIRMWARE:
+			return n + snprintf(buf+n, len-n, "firmware version %d.%d.%d doesn't match the library", 
+						event->value & 0xFF, (event->value>>8) & 0xFF, (event->value>>16) & 0xFF);
+		case SMB_EVENT_DROPPED:
+			return n + snprintf(buf+n, len-n, "%u events dropped", event->value);
+		case SMB_EVENT_RECOVERY:
+			if (event->status) {
+				return n + snprintf(buf+n, len-n, "bus %u still hung after recovery: %s", 
+							event->value, SMBGetErrorString(event->status));
+			}
+			return n + snprintf(buf+n, len-n, "bus %u recovered", event->value);
+		default:
+			if (event->status) {
+				return n + snprintf(buf+n, len-n, "%s: %s", event->text ? event->text : "", 
+							SMBGetErrorString(event->status));
+			}
+			return n + snprintf(buf+n, len-n, "%s", event->text ? event->text : "");
+	}
+}
+
+int SMBReadLogEvents(struct smb_log_event *events, unsigned int max) {
+	int n;
+
+	pthread_mutex_lock(&logReadLock);
+	n = readLogEvents(events, max);
+	pthread_mutex_unlock(&logReadLock);
+	return n;
+}
+
+static void flushLog() {
+	struct smb_log_event events[16];
+	char line[256];
+	int i,n,len;
+
+	if (extLogFunc == NULL) return;
+	while ((n = readLogEvents(events, 16)) > 0) {
+		for (i=0;i<n;i++) {
+			len = SMBFormatLogEvent(&events[i], line, sizeof(line));
+			if (len < 0) continue;
+			if (len >= (int)sizeof(line)) len = sizeof(line)-1;
+			extLogFunc((unsigned char *)line, len);
+		}
+	}
+}
+
+void SMBFlushLog() {
+	pthread_mutex_lock(&logReadLock);
+	flushLog();
+	pthread_mutex_unlock(&logReadLock);
+}
+
 const char* SMBGetErrorString(int errorCode) {
-	char* errorMsgBuf = malloc(128);
+	static char errorMsgBuf[64];
 	switch (errorCode) {
 		case LIBUSB_ERROR_INVALID_PARAM:
 			return "libusb error: Invalid parameter";
@@ -539,12 +2759,38 @@ const char* SMBGetErrorString(int errorCode) {
 			return "libusb error: Other error";
 		case ERR_DEVICE_OPEN:
 			return "Unable to open device. (insufficient permissions? connection issue?)";
+		case ERR_QUEUE_STOPPING:
+			return "The submission queue is stopping";
 		case ERR_ALREADY_OPEN:
 			return "Device already in use";
 		case ERR_CLAIM_INTERFACE:
 			return "Unable to claim interface (insufficient permissions?)";
+		case ERR_PEC_FAIL:
+			return "SMBus PEC mismatch";
+		case ERR_FIRMWARE_VERSION:
+			return "Firmware version mismatch (replug the device to load the bundled firmware)";
+		case ERR_NAK_ADDRESS:
+			return "SMBus error: Address NAK (no such device?)";
+		case ERR_NAK_COMMAND:
+			return "SMBus error: Command NAK";
+		case ERR_NAK_DATA:
+			return "SMBus error: Data NAK";
+		case ERR_BUS_ERROR:
+			return "SMBus error: Bus error";
+		case ERR_BUS_TIMEOUT:
+			return "SMBus error: Bus timeout";
+		case ERR_BAD_BLOCK_LENGTH:
+			return "SMBus error: Invalid block length";
+		case ERR_SHORT_REPLY:
+			return "Short reply from the firmware";
+		case ERR_TRACE_FORMAT:
+			return "Can't open the trace or it's not a trace";
+		case ERR_TRACE_MISMATCH:
+			return "Request doesn't match the trace";
+		case ERR_TRACE_END:
+			return "End of the trace";
 		default:	
-			sprintf(errorMsgBuf,"Unknown libusb error code (%d)",errorCode);		
+			snprintf(errorMsgBuf,sizeof(errorMsgBuf),"Unknown libusb error code (%d)",errorCode);
 			return (const char*)errorMsgBuf;
 	}
 }
\ No newline at end of file
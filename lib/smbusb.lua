@@ -0,0 +1,148 @@
+--
+-- Wireshark dissector for libsmbusb captures (SMBCaptureStart)
+--
+-- Copy to the Wireshark personal plugins directory or load with
+--   wireshark -X lua_script:smbusb.lua capture.pcapng
+--
+-- Every packet is one vendor request to the SMBusb firmware, link type
+-- LINKTYPE_USER0. 24 byte header, little endian:
+--   version, direction, request, bus, PEC mode, flags, address, command,
+--   value (2), index (2), length (2), reserved (2), result (4), us (4)
+-- then the data sent (OUT) or the bytes received (IN).
+--
+
+local smbusb = Proto("smbusb", "SMBusb vendor request")
+
+local requests = {
+	[0x05] = "Enable PEC",
+	[0x06] = "Select bus",
+	[0x07] = "Alert enable",
+	[0x08] = "Sniff",
+	[0x09] = "Set timeout",
+	[0x10] = "Read Byte",
+	[0x11] = "Write Byte",
+	[0x12] = "Send Byte",
+	[0x20] = "Read Word",
+	[0x21] = "Write Word",
+	[0x22] = "Read Words",
+	[0x23] = "Read Word multi-bus",
+	[0x24] = "Process Call",
+	[0x25] = "Read Word list",
+	[0x30] = "Read Block",
+	[0x32] = "Write Block",
+	[0x34] = "Block Process Call",
+	[0x35] = "Read Block list",
+	[0x40] = "Write-Read",
+	[0x41] = "Stage write",
+	[0x50] = "Write",
+	[0x51] = "Read",
+	[0x54] = "Get/clear PEC fail",
+	[0x55] = "Get MRQ PECs",
+	[0x56] = "Get status",
+	[0x61] = "Reset interface",
+	[0x62] = "Recover bus",
+	[0x90] = "Test address ACK",
+	[0x91] = "Test command ACK",
+	[0x92] = "Test command write",
+	[0x93] = "Scan address ACK",
+	[0x94] = "Scan command ACK",
+	[0x95] = "Scan command write",
+	[0x96] = "Set scan skip",
+	[0x98] = "Firmware version",
+	[0x99] = "Interface ID",
+}
+
+local statuses = {
+	[0] = "OK",
+	[1] = "NAK address",
+	[2] = "NAK command",
+	[3] = "NAK data",
+	[4] = "Bus error",
+	[5] = "Timeout",
+	[6] = "PEC mismatch",
+	[7] = "Bad length",
+}
+
+local pecModes = { [0] = "Off", [1] = "Firmware", [2] = "Host" }
+
+-- requests whose IN reply starts with the status, acked header
+local withHeader = {
+	[0x10] = true, [0x20] = true, [0x22] = true, [0x23] = true, [0x24] = true,
+	[0x25] = true, [0x30] = true, [0x34] = true, [0x35] = true, [0x40] = true,
+	[0x51] = true, [0x90] = true, [0x91] = true, [0x92] = true, [0x93] = true,
+	[0x94] = true, [0x95] = true,
+}
+
+-- reads that end in a raw PEC byte in host PEC mode
+local hostPec = {
+	[0x10] = true, [0x20] = true, [0x24] = true, [0x30] = true, [0x34] = true,
+}
+
+local f = smbusb.fields
+f.version   = ProtoField.uint8("smbusb.version", "Version")
+f.direction = ProtoField.uint8("smbusb.direction", "Direction", base.HEX, { [0x00] = "OUT", [0x80] = "IN" })
+f.request   = ProtoField.uint8("smbusb.request", "Request", base.HEX, requests)
+f.bus       = ProtoField.uint8("smbusb.bus", "Bus")
+f.pecmode   = ProtoField.uint8("smbusb.pec_mode", "PEC mode", base.DEC, pecModes)
+f.address   = ProtoField.uint8("smbusb.address", "Address", base.HEX)
+f.command   = ProtoField.uint8("smbusb.command", "Command", base.HEX)
+f.value     = ProtoField.uint16("smbusb.value", "wValue", base.HEX)
+f.index     = ProtoField.uint16("smbusb.index", "wIndex", base.HEX)
+f.length    = ProtoField.uint16("smbusb.length", "wLength")
+f.result    = ProtoField.int32("smbusb.result", "Result")
+f.duration  = ProtoField.uint32("smbusb.duration", "Duration (us)")
+f.status    = ProtoField.uint8("smbusb.status", "SMBus status", base.DEC, statuses)
+f.acked     = ProtoField.uint8("smbusb.acked", "Bytes ACKed")
+f.data      = ProtoField.bytes("smbusb.data", "Data")
+f.pec       = ProtoField.uint8("smbusb.pec", "PEC", base.HEX)
+
+function smbusb.dissector(tvb, pinfo, tree)
+	if tvb:len() < 24 then return 0 end
+	pinfo.cols.protocol = "SMBusb"
+
+	local dir = tvb(1,1):uint()
+	local req = tvb(2,1):uint()
+	local flags = tvb(5,1):uint()
+	local result = tvb(16,4):le_int()
+	local t = tree:add(smbusb, tvb(), "SMBusb " .. (requests[req] or string.format("request 0x%02x", req)))
+
+	t:add(f.version, tvb(0,1))
+	t:add(f.direction, tvb(1,1))
+	t:add(f.request, tvb(2,1))
+	t:add(f.bus, tvb(3,1))
+	t:add(f.pecmode, tvb(4,1))
+	if bit.band(flags, 1) ~= 0 then t:add(f.address, tvb(6,1)) end
+	if bit.band(flags, 2) ~= 0 then t:add(f.command, tvb(7,1)) end
+	t:add_le(f.value, tvb(8,2))
+	t:add_le(f.index, tvb(10,2))
+	t:add_le(f.length, tvb(12,2))
+	t:add_le(f.result, tvb(16,4))
+	t:add_le(f.duration, tvb(20,4))
+
+	local info = (requests[req] or string.format("0x%02x", req))
+	if bit.band(flags, 1) ~= 0 then info = info .. string.format(" addr 0x%02x", tvb(6,1):uint()) end
+	if bit.band(flags, 2) ~= 0 then info = info .. string.format(" cmd 0x%02x", tvb(7,1):uint()) end
+
+	local data = tvb:len() - 24
+	local pos = 24
+	if dir == 0x80 and withHeader[req] and data >= 2 then
+		local st = tvb(pos,1):uint()
+		t:add(f.status, tvb(pos,1))
+		t:add(f.acked, tvb(pos+1,1))
+		info = info .. " " .. (statuses[st] or "status " .. st)
+		pos = pos + 2
+		data = data - 2
+		if tvb(4,1):uint() == 2 and hostPec[req] and st == 0 and data > 0 then
+			data = data - 1
+			t:add(f.pec, tvb(pos+data,1))
+		end
+	elseif result < 0 then
+		info = info .. " failed " .. result
+	end
+	if data > 0 then t:add(f.data, tvb(pos,data)) end
+
+	pinfo.cols.info = info
+	return tvb:len()
+end
+
+DissectorTable.get("wtap_encap"):add(wtap.USER0, smbusb)
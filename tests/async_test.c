@@ -0,0 +1,125 @@
+/*
+* async_test
+* SMBAsync* requests against a replayed device: completion order, error
+* mapping, stalled writes and cancellation
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public
+* License as published by the Free Software Foundation; either
+* version 2.1 of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with this program; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <libusb.h>
+
+#include "libsmbusb.h"
+#include "replay.h"
+
+#define TRACE "async_test.trc"
+#define ADDR SBS_DEFAULT_ADDRESS
+#define WORD_LEN (SMB_RESP_HDR+2)
+#define BLOCK_LEN (SMB_RESP_HDR+SMB_RESP_MAX)
+
+struct completion {
+	int calls;
+	int order;			// completions seen before this one
+	int status;
+	unsigned char data[SMB_RESP_MAX];
+	unsigned int len;
+};
+
+static int completions = 0;
+
+static void done(int status, const unsigned char *data, unsigned int len, void *user) {
+	struct completion *c = user;
+
+	c->calls++;
+	c->order = completions++;
+	c->status = status;
+	c->len = len;
+	if (data != NULL) memcpy(c->data,data,len);
+}
+
+static void writeTrace() {
+	FILE *f = replayCreate(TRACE);
+	const unsigned char voltage[4] = { SMB_STATUS_OK, 2, 0x34, 0x12 };
+	const unsigned char current[4] = { SMB_STATUS_OK, 2, 0x10, 0x00 };
+	const unsigned char name[6] = { SMB_STATUS_OK, 5, 3, 'a', 'b', 'c' };
+	const unsigned char nakCommand[2] = { SMB_STATUS_NAK_COMMAND, 1 };
+	const unsigned char nakData[2] = { SMB_STATUS_NAK_DATA, 2 };
+	const unsigned char word[2] = { 0x78, 0x56 };
+
+	replayIn(f,SMB_READ_WORD,ADDR,SBS_VOLTAGE,WORD_LEN,4,voltage);
+	replayIn(f,SMB_READ_BLOCK,ADDR,SBS_DEVICE_NAME,BLOCK_LEN,6,name);
+	replayIn(f,SMB_READ_WORD,ADDR,SBS_CURRENT,WORD_LEN,4,current);
+	replayIn(f,SMB_READ_WORD,ADDR,SBS_TEMPERATURE,WORD_LEN,2,nakCommand);
+
+	// a write the firmware stalls, and why
+	replayOut(f,SMB_WRITE_WORD,ADDR,SBS_AT_RATE,word,2,LIBUSB_ERROR_PIPE);
+	replayIn(f,SMB_GET_STATUS,0,0,2,2,nakData);
+
+	// cancelled after it was answered
+	replayIn(f,SMB_READ_WORD,ADDR,SBS_VOLTAGE,WORD_LEN,4,voltage);
+
+	fclose(f);
+}
+
+int main() {
+	struct completion a, b, c, d;
+	long id;
+
+	writeTrace();
+	if (SMBOpenTrace(TRACE) < 0) {
+		fprintf(stderr,"can't open %s\n",TRACE);
+		return 1;
+	}
+
+	// three at once, completed in submit order by one poll
+	memset(&a,0,sizeof(a)); memset(&b,0,sizeof(b)); memset(&c,0,sizeof(c));
+	CHECK(SMBAsyncReadWord(ADDR,SBS_VOLTAGE,100,done,&a) > 0);
+	CHECK(SMBAsyncReadBlock(ADDR,SBS_DEVICE_NAME,100,done,&b) > 0);
+	CHECK(SMBAsyncReadWord(ADDR,SBS_CURRENT,100,done,&c) > 0);
+	CHECK(SMBAsyncPending() == 3);
+	CHECK(a.calls == 0);		// callbacks only run from SMBAsyncPoll
+	CHECK(SMBAsyncPoll(0) == 3);
+	CHECK(SMBAsyncPending() == 0);
+	CHECK(a.calls == 1 && a.order == 0 && a.status == 0x1234);
+	CHECK(b.calls == 1 && b.order == 1 && b.status == 3 && b.len == 3 && !memcmp(b.data,"abc",3));
+	CHECK(c.calls == 1 && c.order == 2 && c.status == 0x10);
+
+	memset(&a,0,sizeof(a));
+	CHECK(SMBAsyncReadWord(ADDR,SBS_TEMPERATURE,100,done,&a) > 0);
+	CHECK(SMBAsyncPoll(0) == 1);
+	CHECK(a.status == ERR_NAK_COMMAND && a.len == 0);
+
+	memset(&a,0,sizeof(a));
+	CHECK(SMBAsyncWriteWord(ADDR,SBS_AT_RATE,0x5678,100,done,&a) > 0);
+	CHECK(SMBAsyncPoll(0) == 1);
+	CHECK(a.status == ERR_NAK_DATA);
+
+	memset(&d,0,sizeof(d));
+	id = SMBAsyncReadWord(ADDR,SBS_VOLTAGE,100,done,&d);
+	CHECK(id > 0);
+	CHECK(SMBAsyncCancel(id) == 0);
+	CHECK(SMBAsyncPoll(0) == 1);
+	CHECK(d.calls == 1 && d.status == LIBUSB_ERROR_INTERRUPTED);
+	CHECK(SMBAsyncCancel(id) == LIBUSB_ERROR_NOT_FOUND);
+
+	// no mux select can go between asynchronous requests
+	CHECK(SMBAsyncReadWord(SMB_MUX_ADDRESS(0xE0,1,ADDR),SBS_VOLTAGE,100,done,&d) == LIBUSB_ERROR_INVALID_PARAM);
+	CHECK(SMBAsyncPending() == 0);
+
+	CHECK(SMBReadWord(ADDR,SBS_VOLTAGE) == ERR_TRACE_END);
+
+	SMBCloseDevice();
+	remove(TRACE);
+	return replayFailures ? 1 : 0;
+}
@@ -0,0 +1,150 @@
+/*
+* co_test
+* The smbusb::co coroutines against a replayed device: awaited requests,
+* timers interleaving tasks, stop tokens and exceptions out of run()
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public
+* License as published by the Free Software Foundation; either
+* version 2.1 of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with this program; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <libusb.h>
+
+#include <string>
+
+#include "libsmbusb_co.hpp"
+#include "replay.h"
+
+#define TRACE "co_test.trc"
+#define ADDR SBS_DEFAULT_ADDRESS
+#define WORD_LEN (SMB_RESP_HDR+2)
+#define BLOCK_LEN (SMB_RESP_HDR+SMB_RESP_MAX)
+
+using smbusb::co::Loop;
+using smbusb::co::Task;
+
+static std::string order;
+
+static void writeTrace() {
+	FILE *f = replayCreate(TRACE);
+	const unsigned char voltage[4] = { SMB_STATUS_OK, 2, 0x34, 0x12 };
+	const unsigned char current[4] = { SMB_STATUS_OK, 2, 0x10, 0x00 };
+	const unsigned char name[6] = { SMB_STATUS_OK, 5, 3, 'a', 'b', 'c' };
+	const unsigned char busTimeout[2] = { SMB_STATUS_TIMEOUT, 0 };
+
+	// sequence()
+	replayIn(f,SMB_READ_WORD,ADDR,SBS_VOLTAGE,WORD_LEN,4,voltage);
+	replayIn(f,SMB_READ_BLOCK,ADDR,SBS_DEVICE_NAME,BLOCK_LEN,6,name);
+
+	// late() sleeps, early() goes first
+	replayIn(f,SMB_READ_WORD,ADDR,SBS_VOLTAGE,WORD_LEN,4,voltage);
+	replayIn(f,SMB_READ_WORD,ADDR,SBS_CURRENT,WORD_LEN,4,current);
+
+	// stopped()
+	replayIn(f,SMB_READ_WORD,ADDR,SBS_VOLTAGE,WORD_LEN,4,voltage);
+
+	// failing()
+	replayIn(f,SMB_READ_WORD,ADDR,SBS_TEMPERATURE,WORD_LEN,2,busTimeout);
+
+	fclose(f);
+}
+
+static Task<int> voltagePlusOne(Loop &smb) {
+	int mv = co_await smb.readWord(ADDR, SBS_VOLTAGE);
+	co_return mv + 1;
+}
+
+static Task<> sequence(Loop &smb) {
+	// co_await into a local, GCC 12 miscompiles it inside CHECK's do/while
+	int mv = co_await voltagePlusOne(smb);
+	auto name = co_await smb.readBlock(ADDR, SBS_DEVICE_NAME);
+
+	CHECK(mv == 0x1235);
+	CHECK(name.status == 3);
+	CHECK(std::string(name.data.begin(), name.data.end()) == "abc");
+}
+
+static Task<> late(Loop &smb) {
+	co_await smb.sleep(std::chrono::milliseconds(5));
+	int ma = co_await smb.readWord(ADDR, SBS_CURRENT);
+
+	CHECK(ma == 0x10);
+	order += "late ";
+}
+
+static Task<> early(Loop &smb) {
+	int mv = co_await smb.readWord(ADDR, SBS_VOLTAGE);
+
+	CHECK(mv == 0x1234);
+	order += "early ";
+}
+
+static Task<> stopped(Loop &smb, std::stop_token stop) {
+	int status = co_await smb.readWord(ADDR, SBS_VOLTAGE, Loop::Timeout(100), stop);
+
+	CHECK(status == LIBUSB_ERROR_INTERRUPTED);
+}
+
+static Task<> failing(Loop &smb) {
+	int status = co_await smb.readWord(ADDR, SBS_TEMPERATURE);
+
+	if (status < 0) throw std::runtime_error(SMBGetErrorString(status));
+}
+
+int main() {
+	writeTrace();
+	if (SMBOpenTrace(TRACE) < 0) {
+		fprintf(stderr,"can't open %s\n",TRACE);
+		return 1;
+	}
+
+	{
+		Loop smb;
+		smb.spawn(sequence(smb));
+		smb.run();
+	}
+
+	{
+		Loop smb;
+		smb.spawn(late(smb));
+		smb.spawn(early(smb));
+		smb.run();
+		CHECK(order == "early late ");
+	}
+
+	{
+		Loop smb;
+		std::stop_source stop;
+		stop.request_stop();
+		smb.spawn(stopped(smb, stop.get_token()));
+		smb.run();
+	}
+
+	{
+		Loop smb;
+		bool thrown = false;
+		smb.spawn(failing(smb));
+		try {
+			smb.run();
+		} catch (const std::runtime_error &e) {
+			thrown = std::string(e.what()) == SMBGetErrorString(ERR_BUS_TIMEOUT);
+		}
+		CHECK(thrown);
+	}
+
+	CHECK(SMBReadWord(ADDR,SBS_VOLTAGE) == ERR_TRACE_END);
+
+	SMBCloseDevice();
+	remove(TRACE);
+	return replayFailures ? 1 : 0;
+}
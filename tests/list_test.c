@@ -0,0 +1,99 @@
+/*
+* list_test
+* SMBReadWords and SMBReadBlocks against a replayed device: the list is
+* staged once and every request after it reads on from where the last stopped
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public
+* License as published by the Free Software Foundation; either
+* version 2.1 of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with this program; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include "libsmbusb.h"
+#include "replay.h"
+
+#define TRACE "list_test.trc"
+#define ADDR SBS_DEFAULT_ADDRESS
+#define WORDS 100		// more than one reply holds
+#define PER_REPLY (SMB_RESP_MAX/3)
+#define NAKED 3			// the entry the device NAKs
+
+static unsigned char commands[WORDS];
+static const unsigned char blockCommands[3] = { SBS_MANUFACTURER_NAME, SBS_DEVICE_NAME, SBS_DEVICE_CHEMISTRY };
+
+// the reply to SMB_READ_WORD_LIST from entry first on: status, low, high per entry
+static void wordReply(FILE *f, unsigned int first, unsigned int count) {
+	unsigned char reply[SMB_RESP_HDR+SMB_RESP_MAX];
+	unsigned int i, n = SMB_RESP_HDR;
+
+	reply[0] = SMB_STATUS_OK;
+	reply[1] = 0;
+	for (i=first;i<first+count;i++) {
+		reply[n++] = i == NAKED ? SMB_STATUS_NAK_COMMAND : SMB_STATUS_OK;
+		reply[n++] = commands[i];
+		reply[n++] = 0x10;
+	}
+	replayIn(f,SMB_READ_WORD_LIST,ADDR,first,SMB_RESP_HDR+count*3,n,reply);
+}
+
+static void writeTrace() {
+	FILE *f = replayCreate(TRACE);
+	const unsigned char blocks[] = { SMB_STATUS_OK, 0,
+		SMB_STATUS_OK, 3, 'a', 'b', 'c',
+		SMB_STATUS_OK, 2, 'd', 'e',
+		SMB_STATUS_OK, 1, 'f' };
+	unsigned int i;
+
+	for (i=0;i<WORDS;i++) commands[i] = i;
+
+	// staged once, read in two requests
+	replayOut(f,SMB_STAGE_WRITE,0,0,commands,WORDS,WORDS);
+	wordReply(f,0,PER_REPLY);
+	wordReply(f,PER_REPLY,WORDS-PER_REPLY);
+
+	replayOut(f,SMB_STAGE_WRITE,0,0,blockCommands,3,3);
+	replayIn(f,SMB_READ_BLOCK_LIST,ADDR,0,SMB_RESP_HDR+SMB_RESP_MAX,sizeof(blocks),blocks);
+
+	fclose(f);
+}
+
+int main() {
+	unsigned short words[WORDS];
+	int wordStatus[WORDS], blockStatus[3], i, ok;
+	static unsigned char blocks[3*SMB_BLOCK_STRIDE];
+
+	writeTrace();
+	if (SMBOpenTrace(TRACE) < 0) {
+		fprintf(stderr,"can't open %s\n",TRACE);
+		return 1;
+	}
+
+	CHECK(SMBReadWords(ADDR,commands,WORDS,words,wordStatus) == WORDS);
+	for (i=0,ok=1;i<WORDS;i++) {
+		if (i == NAKED) continue;
+		if (wordStatus[i] != 0 || words[i] != (0x1000 | i)) ok = 0;
+	}
+	CHECK(ok);
+	CHECK(wordStatus[NAKED] == ERR_NAK_COMMAND);
+
+	CHECK(SMBReadBlocks(ADDR,blockCommands,3,blocks,blockStatus) == 3);
+	CHECK(blockStatus[0] == 3 && !memcmp(blocks,"abc",3));
+	CHECK(blockStatus[1] == 2 && !memcmp(blocks+SMB_BLOCK_STRIDE,"de",2));
+	CHECK(blockStatus[2] == 1 && blocks[2*SMB_BLOCK_STRIDE] == 'f');
+
+	// every record was used, none twice
+	CHECK(SMBReadWord(ADDR,SBS_VOLTAGE) == ERR_TRACE_END);
+
+	SMBCloseDevice();
+	remove(TRACE);
+	return replayFailures ? 1 : 0;
+}
@@ -0,0 +1,102 @@
+/*
+* r2j240_test
+* smbusb_r2j240flasher's interleaved write and verify against a replayed
+* device: every chunk is read back, the last one too when it's short
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public
+* License as published by the Free Software Foundation; either
+* version 2.1 of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with this program; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+// the tool's functions without its main
+#define main r2j240Main
+#include "../tools/smbusb_r2j240flasher.c"
+#undef main
+
+#include "replay.h"
+
+#define TRACE "r2j240_test.trc"
+#define ADDR 0x16
+#define RAM_ADDRESS 0x3000
+#define SIZE 0x500		// one whole RAM_CHUNK and a short one
+
+static unsigned char image[SIZE];
+
+// writeRam: the CMD_WRITE_RAM header, then the data in SMB_RESP_MAX pieces
+static void ramWrite(FILE *f, unsigned int offset, unsigned int len) {
+	unsigned char hdr[7] = { ADDR, CMD_WRITE_RAM };
+	unsigned int address = RAM_ADDRESS+offset, n, done;
+
+	hdr[2] = address&0xFF; hdr[3] = (address>>8)&0xFF; hdr[4] = (address>>16)&0xFF;
+	hdr[5] = len&0xFF; hdr[6] = (len>>8)&0xFF;
+	replayOut(f,SMB_WRITE,7,SMB_WRITE_CMD_START_FIRST,hdr,7,7);
+	for (done=0;done<len;done+=n) {
+		n = len-done > SMB_RESP_MAX ? SMB_RESP_MAX : len-done;
+		replayOut(f,SMB_WRITE,n,done+n == len ? SMB_WRITE_CMD_STOP_AFTER : 0,image+offset+done,n,n);
+	}
+}
+
+// readRam: the staged CMD_READ_RAM header, SMB_WRITE_READ and SMB_READ for what doesn't fit
+static void ramRead(FILE *f, unsigned int offset, unsigned int len) {
+	unsigned char hdr[6] = { CMD_READ_RAM }, reply[SMB_RESP_HDR+SMB_RESP_MAX] = { SMB_STATUS_OK, 0 };
+	const unsigned char pecs[2] = { 0x5A, 0x5A };
+	unsigned int address = RAM_ADDRESS+offset, n, done;
+
+	hdr[1] = address&0xFF; hdr[2] = (address>>8)&0xFF; hdr[3] = (address>>16)&0xFF;
+	hdr[4] = len&0xFF; hdr[5] = (len>>8)&0xFF;
+	replayOut(f,SMB_STAGE_WRITE,0,0,hdr,6,6);
+
+	n = len > SMB_RESP_MAX ? SMB_RESP_MAX : len;
+	memcpy(reply+SMB_RESP_HDR,image+offset,n);
+	replayIn(f,SMB_WRITE_READ,ADDR | (n < len ? SMB_WR_CONTINUE<<8 : 0),0,SMB_RESP_HDR+n,SMB_RESP_HDR+n,reply);
+	for (done=n;done<len;done+=n) {
+		n = len-done > SMB_RESP_MAX ? SMB_RESP_MAX : len-done;
+		memcpy(reply+SMB_RESP_HDR,image+offset+done,n);
+		replayIn(f,SMB_READ,n,done+n == len ? SMB_READ_CMD_LAST_READ : 0,SMB_RESP_HDR+n,SMB_RESP_HDR+n,reply);
+	}
+	if (len > SMB_RESP_MAX) replayIn(f,SMB_GET_MRQ_PECS,2,0,2,2,pecs);
+}
+
+static void writeTrace() {
+	FILE *f = replayCreate(TRACE);
+
+	// chunk N is read back after chunk N+1 went out, the last one after the loop
+	ramWrite(f,0,RAM_CHUNK);
+	ramWrite(f,RAM_CHUNK,SIZE-RAM_CHUNK);
+	ramRead(f,0,RAM_CHUNK);
+	ramRead(f,RAM_CHUNK,SIZE-RAM_CHUNK);
+
+	fclose(f);
+}
+
+int main() {
+	int i, failAddress = -1;
+
+	for (i=0;i<SIZE;i++) image[i] = i*7;
+
+	writeTrace();
+	if (SMBOpenTrace(TRACE) < 0) {
+		fprintf(stderr,"can't open %s\n",TRACE);
+		return 1;
+	}
+
+	CHECK(writeRamInterleaved(RAM_ADDRESS,SIZE,image,&failAddress) == SIZE);
+	CHECK(failAddress == -1);
+
+	// every record was used, the short chunk's read back included
+	CHECK(SMBReadWord(ADDR,SBS_VOLTAGE) == ERR_TRACE_END);
+
+	SMBCloseDevice();
+	remove(TRACE);
+	return replayFailures ? 1 : 0;
+}
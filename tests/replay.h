@@ -0,0 +1,106 @@
+/*
+* replay.h
+* Writes SMBOpenTrace traces by hand, so the tests run against a
+* simulated device instead of the interface
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public
+* License as published by the Free Software Foundation; either
+* version 2.1 of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with this program; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// same layout as the library writes, see the trace comment in smbusb.c
+#define REPLAY_IN 0x80
+#define REPLAY_OUT 0x00
+
+static int replayFailures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr,"%s:%d: check failed: %s\n",__FILE__,__LINE__,#cond); \
+		replayFailures++; \
+	} \
+} while (0)
+
+static inline void replayLE(FILE *f, unsigned int v, int n) {
+	while (n--) {
+		fputc(v & 0xFF, f);
+		v >>= 8;
+	}
+}
+
+static inline FILE *replayCreate(const char *path) {
+	FILE *f;
+	unsigned char hdr[12] = "SMBTRACE";
+
+	if ((f = fopen(path,"wb")) == NULL) {
+		perror(path);
+		exit(1);
+	}
+	hdr[8] = 1;
+	fwrite(hdr,12,1,f);
+	return f;
+}
+
+static inline void replayRecord(FILE *f, unsigned char direction, unsigned char request, unsigned int value,
+			unsigned int index, unsigned int length, int result, const unsigned char *data, unsigned int dataLen) {
+	fputc(direction,f);
+	fputc(request,f);
+	replayLE(f,value,2);
+	replayLE(f,index,2);
+	replayLE(f,length,2);
+	replayLE(f,(unsigned int)result,4);
+	replayLE(f,0,4);
+	replayLE(f,0,4);
+	if (dataLen) fwrite(data,dataLen,1,f);
+}
+
+// IN request: the firmware replied with result bytes of data (status, acked, payload), or failed with result < 0
+static inline void replayIn(FILE *f, unsigned char request, unsigned int value, unsigned int index,
+			unsigned int length, int result, const unsigned char *data) {
+	replayRecord(f,REPLAY_IN,request,value,index,length,result,data,result > 0 ? result : 0);
+}
+
+// OUT request: the library sends len bytes of data
+static inline void replayOut(FILE *f, unsigned char request, unsigned int value, unsigned int index,
+			const unsigned char *data, unsigned int len, int result) {
+	replayRecord(f,REPLAY_OUT,request,value,index,len,result,data,len);
+}
+
+static inline unsigned long long replayNowUs() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (unsigned long long)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+// SMBus PEC, CRC-8 x^8+x^2+x+1
+static inline unsigned char replayPec(const unsigned char *data, unsigned int len) {
+	unsigned char crc = 0;
+	int i;
+
+	while (len--) {
+		crc ^= *data++;
+		for (i=0;i<8;i++) crc = (crc & 0x80) ? (crc<<1) ^ 0x07 : crc<<1;
+	}
+	return crc;
+}
+
+#endif
@@ -0,0 +1,134 @@
+/*
+* retry_test
+* Retry policy against a replayed device: attempt counts, error mapping, backoff
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public
+* License as published by the Free Software Foundation; either
+* version 2.1 of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with this program; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include "libsmbusb.h"
+#include "replay.h"
+
+#define TRACE "retry_test.trc"
+#define ADDR SBS_DEFAULT_ADDRESS
+#define BACKOFF 2000
+
+static const unsigned char pecFail[2] = { SMB_STATUS_PEC, 2 };
+static const unsigned char nakAddress[2] = { SMB_STATUS_NAK_ADDRESS, 0 };
+static const unsigned char busError[2] = { SMB_STATUS_BUS_ERROR, 0 };
+static const unsigned char voltage[4] = { SMB_STATUS_OK, 2, 0x34, 0x12 };
+static const unsigned char current[4] = { SMB_STATUS_OK, 2, 0x10, 0x00 };
+
+static void writeTrace() {
+	FILE *f = replayCreate(TRACE);
+	unsigned char hostPec[5] = { SMB_STATUS_OK, 3, 0x34, 0x12, 0 };
+	unsigned char pecData[5] = { ADDR, SBS_VOLTAGE, ADDR|1, 0x34, 0x12 };
+
+	// PEC failures that clear up on the third attempt
+	replayIn(f,SMB_READ_WORD,ADDR,SBS_VOLTAGE,4,2,pecFail);
+	replayIn(f,SMB_READ_WORD,ADDR,SBS_VOLTAGE,4,2,pecFail);
+	replayIn(f,SMB_READ_WORD,ADDR,SBS_VOLTAGE,4,4,voltage);
+
+	// and ones that don't
+	replayIn(f,SMB_READ_WORD,ADDR,SBS_VOLTAGE,4,2,pecFail);
+	replayIn(f,SMB_READ_WORD,ADDR,SBS_VOLTAGE,4,2,pecFail);
+	replayIn(f,SMB_READ_WORD,ADDR,SBS_VOLTAGE,4,2,pecFail);
+
+	// a NAK isn't in the policy, the next read has to get the next record
+	replayIn(f,SMB_READ_WORD,ADDR,SBS_VOLTAGE,4,2,nakAddress);
+	replayIn(f,SMB_READ_WORD,ADDR,SBS_CURRENT,4,4,current);
+
+	// host PEC: a corrupted reply, then a good one
+	replayOut(f,SMB_ENABLE_PEC,SMB_PEC_HOST,0,NULL,0,0);
+	hostPec[4] = replayPec(pecData,5) ^ 0x5A;
+	replayIn(f,SMB_READ_WORD,ADDR,SBS_VOLTAGE,5,5,hostPec);
+	hostPec[4] = replayPec(pecData,5);
+	replayIn(f,SMB_READ_WORD,ADDR,SBS_VOLTAGE,5,5,hostPec);
+	replayOut(f,SMB_ENABLE_PEC,SMB_PEC_FIRMWARE,0,NULL,0,0);
+
+	// a bus error isn't retried either, but the bus is recovered
+	replayIn(f,SMB_READ_WORD,ADDR,SBS_VOLTAGE,4,2,busError);
+	replayOut(f,SMB_RECOVER_BUS,0,0,NULL,0,0);
+
+	fclose(f);
+}
+
+int main() {
+	struct smb_retry_policy policy = { 3, BACKOFF, 2, SMB_RETRY_ON_PEC };
+	struct smb_result res;
+	struct smb_recovery_stats before, after;
+	unsigned long retries;
+	unsigned long long start, took;
+	int status;
+
+	writeTrace();
+	if (SMBOpenTrace(TRACE) < 0) {
+		fprintf(stderr,"can't open %s\n",TRACE);
+		return 1;
+	}
+	SMBSetRetryPolicy(&policy);
+	SMBGetLastResult(&res);
+	retries = res.totalRetries;
+
+	start = replayNowUs();
+	status = SMBReadWord(ADDR,SBS_VOLTAGE);
+	took = replayNowUs() - start;
+	SMBGetLastResult(&res);
+	CHECK(status == 0x1234);
+	CHECK(res.status == 0x1234);
+	CHECK(res.attempts == 3);
+	CHECK(res.pecFailed == 0);
+	CHECK(res.totalRetries == retries+2);
+	CHECK(took >= BACKOFF + BACKOFF*2);	// 2ms, then 2ms*factor
+	retries = res.totalRetries;
+
+	status = SMBReadWord(ADDR,SBS_VOLTAGE);
+	SMBGetLastResult(&res);
+	CHECK(status == ERR_PEC_FAIL);
+	CHECK(res.attempts == 3);
+	CHECK(res.pecFailed == 1);
+	CHECK(res.totalRetries == retries+2);
+	CHECK(SMBGetLastReadPECFail() == 0xFF);
+	retries = res.totalRetries;
+
+	status = SMBReadWord(ADDR,SBS_VOLTAGE);
+	SMBGetLastResult(&res);
+	CHECK(status == ERR_NAK_ADDRESS);
+	CHECK(res.attempts == 1);
+	CHECK(res.totalRetries == retries);
+	CHECK(SMBReadWord(ADDR,SBS_CURRENT) == 0x10);
+
+	SMBSetPECMode(SMB_PEC_HOST);
+	status = SMBReadWord(ADDR,SBS_VOLTAGE);
+	SMBGetLastResult(&res);
+	CHECK(status == 0x1234);
+	CHECK(res.attempts == 2);
+	SMBSetPECMode(SMB_PEC_FIRMWARE);
+
+	SMBGetRecoveryStats(&before);
+	status = SMBReadWord(ADDR,SBS_VOLTAGE);
+	SMBGetLastResult(&res);
+	CHECK(status == ERR_BUS_ERROR);
+	CHECK(res.attempts == 1);
+	SMBGetRecoveryStats(&after);
+	CHECK(after.attempts == before.attempts+1);
+	CHECK(after.recovered == before.recovered+1);
+
+	// every record was used, none twice
+	CHECK(SMBReadWord(ADDR,SBS_VOLTAGE) == ERR_TRACE_END);
+
+	SMBCloseDevice();
+	remove(TRACE);
+	return replayFailures ? 1 : 0;
+}
@@ -21,6 +21,8 @@ if %ERRORLEVEL% GTR 0 goto tool_build_err
 gcc -m%1 -L../lib -I../lib smbusb_bootstrap.c -o smbusb_bootstrap.exe -lsmbusb
 if %ERRORLEVEL% GTR 0 goto tool_build_err
 gcc -m%1 -L../lib -I../lib smbusb_comm.c -o smbusb_comm.exe -lsmbusb
+if %ERRORLEVEL% GTR 0 goto tool_build_err
+gcc -m%1 -L../lib -I../lib smbusb_sniff.c -o smbusb_sniff.exe -lsmbusb
 
 goto tool_build_ok
 :tool_build_err
@@ -27,6 +27,7 @@
 #include <stdarg.h>
 #include <getopt.h>
 #include <sys/types.h>
+#include <sys/time.h>
 
 #include "libsmbusb.h"
 
@@ -56,6 +57,30 @@
 #define PROGRAM_BLOCK_COUNT 768
 #define EEPROM_BLOCK_COUNT 64
 #define EEPROM_RESERVED_BYTES 64
+#define EEPROM_FLASH_BLOCKS (EEPROM_BLOCK_COUNT-(EEPROM_RESERVED_BYTES/EEPROM_BLOCKSZ))	// the reserved ones at the end aren't written
+
+#define PROGRAM_WRITE_DELAY 200000
+#define EEPROM_WRITE_DELAY 2000
+
+#define VERIFY_RETRIES 3
+
+#define TRANSACTION_ATTEMPTS 3
+#define RETRY_BACKOFF 10000
+
+typedef int (*blockFunc)(int blockNr, unsigned char* buf);
+
+long long timeNowUs() {
+	struct timeval tv;
+
+	gettimeofday(&tv,NULL);
+	return (long long)tv.tv_sec*1000000 + tv.tv_usec;
+}
+
+void waitUntilUs(long long deadline) {
+	long long now = timeNowUs();
+
+	if (deadline > now) usleep(deadline-now);
+}
 
 void eraseProgramFlash() {
 	SMBWriteWord(0x16,CMD_ERASE_PROGRAM_FLASH,DATA_ERASE_CONFIRM);
@@ -83,7 +108,7 @@ int readProgramBlock(int blockNr, unsigned char* buf) {
 	return status;
 }
 
-int writeProgramBlock(int blockNr, unsigned char* buf) {
+int sendProgramBlock(int blockNr, unsigned char* buf) {
 	int status;
 	unsigned char block[0x62];
 
@@ -92,12 +117,20 @@ int writeProgramBlock(int blockNr, unsigned char* buf) {
 	memcpy(block+2,buf,0x60);
 
         status = SMBWriteBlock(0x16,CMD_WRITE_PROGRAM_BLOCK,block,0x62);
-	usleep(200000);
 
 	return (status > 0 ? status-2 : status);
 }
 
-int writeEepromBlock(unsigned char blockNr, unsigned char* buf) {
+int writeProgramBlock(int blockNr, unsigned char* buf) {
+	int status;
+
+	status = sendProgramBlock(blockNr,buf);
+	usleep(PROGRAM_WRITE_DELAY);
+
+	return status;
+}
+
+int sendEepromBlock(int blockNr, unsigned char* buf) {
 	int status;
 	unsigned char block[33];
 	
@@ -105,12 +138,20 @@ int writeEepromBlock(unsigned char blockNr, unsigned char* buf) {
 	memcpy(block+1,buf,32);
 
         status = SMBWriteBlock(0x16,CMD_WRITE_EEPROM_BLOCK,block,33);
-	usleep(2000);	
 	return (status > 0 ? status-1 : status);
 }
 
+int writeEepromBlock(int blockNr, unsigned char* buf) {
+	int status;
+
+	status = sendEepromBlock(blockNr,buf);
+	usleep(EEPROM_WRITE_DELAY);	
+
+	return status;
+}
+
 
-int readEepromBlock(unsigned char blockNr, unsigned char* buf) {
+int readEepromBlock(int blockNr, unsigned char* buf) {
 	int status,i;
 
 	status=SMBWriteWord(0x16,CMD_SET_EEPROM_ADDRESS,EEPROM_BASE_ADDR+(blockNr*32)); 
@@ -122,6 +163,102 @@ int readEepromBlock(unsigned char blockNr, unsigned char* buf) {
 
 }
 
+/*
+* Writes blockCount blocks of image and verifies block N while block N+1 is
+* being programmed, so the read back hides behind the program delay instead of
+* needing a second pass. A block that fails to verify is rewritten and checked
+* again immediately.
+*/
+int flashInterleaved(unsigned char *image, int blockCount, int blockSize, long delay,
+			blockFunc sendBlock, blockFunc readBlock) {
+	unsigned char readBack[256];
+	unsigned char *expected;
+	long long deadline=0;
+	int status, tries;
+	int i;
+
+	for (i=0;i<=blockCount;i++) {
+		if (i<blockCount) {
+			waitUntilUs(deadline);
+			status=sendBlock(i,image+(i*blockSize));
+			if (status != blockSize) {
+				printf("\nError: %s\n",SMBGetErrorString(status));
+				return -1;
+			}
+			deadline=timeNowUs()+delay;
+		}
+		if (i==0) continue;
+
+		expected=image+((i-1)*blockSize);
+		tries=0;
+		while (1) {
+			status=readBlock(i-1,readBack);
+			if (status != blockSize) {	// chip may be too busy programming to answer, try again when it's done
+				waitUntilUs(deadline);
+				status=readBlock(i-1,readBack);
+			}
+			if ((status == blockSize) && (memcmp(expected,readBack,blockSize) == 0)) break;
+
+			if (++tries > VERIFY_RETRIES) {
+				if (status != blockSize) {
+					printf("\nError: %s\n",SMBGetErrorString(status));
+				} else {
+					printf("\nBlock verify fail. Block #%d\n",i-1);
+				}
+				return -1;
+			}
+
+			fprintf(stderr,"R");
+			waitUntilUs(deadline);
+			status=sendBlock(i-1,expected);
+			if (status != blockSize) {
+				printf("\nError: %s\n",SMBGetErrorString(status));
+				return -1;
+			}
+			deadline=timeNowUs()+delay;
+			waitUntilUs(deadline);
+		}
+		fprintf(stderr,".");
+	}
+	waitUntilUs(deadline);
+
+	return 0;
+}
+
+/*
+* Reads the first flashBlocks blocks of an image file, which has to be exactly
+* blockCount blocks long. Everything is read before the chip is erased, a file
+* that can't be read in full stops here and leaves the flash alone.
+*/
+unsigned char *readImage(char *path, int blockCount, int blockSize, int flashBlocks) {
+	FILE *inFile;
+	unsigned char *image;
+	long size;
+
+	if ((inFile = fopen(path,"rb")) == NULL) {
+		printf("Error opening input file\n");
+		exit(3);
+	}
+	fseek(inFile, 0L, SEEK_END);
+	size = ftell(inFile);
+	rewind(inFile);	
+	if (size != (long)blockSize * blockCount) {
+		printf("File size does not match flash size\n");
+		exit(4);
+	}
+
+	if ((image = malloc((size_t)blockSize * flashBlocks)) == NULL) {
+		printf("Out of memory\n");
+		exit(3);
+	}
+	if (fread(image,blockSize,flashBlocks,inFile) != (size_t)flashBlocks) {
+		printf("Error reading input file\n");
+		exit(3);
+	}
+	fclose(inFile);
+	return image;
+}
+
 void printHeader() {
 
 	  printf("------------------------------------\n");
@@ -138,6 +275,7 @@ void printUsage() {
 
 	  printf("--execute                                   =   exit the Boot ROM and execute program flash\n");
 	  printf("--no-verify                                 =   skip verification after flashing (not recommended)\n");
+	  printf("--interleaved-verify                        =   verify each block while the next one is programmed\n");
 	  printf("--no-pec                                    =   disable SMBus Packet Error Checking (not recommended)\n");
 }
 
@@ -149,17 +287,20 @@ int main(int argc, char **argv)
 	char *eepromOut= NULL;
 	int c;
 	static int noVerify=0;
+	static int interleavedVerify=0;
 	static int noPec=0;
 	static int confirmDelete=0;
 	static int execute=0;
 	unsigned char block[256];
 	unsigned char block2[256];
+	unsigned char *image;
+
+	struct smb_retry_policy retryPolicy = { TRANSACTION_ATTEMPTS, RETRY_BACKOFF, 2, SMB_RETRY_ON_PEC | SMB_RETRY_ON_TIMEOUT };
 
 	int status;
 	int i,j;
 
 	FILE *outFile;
-	FILE *inFile;
 
 
 	if (argc==1) {
@@ -173,6 +314,7 @@ int main(int argc, char **argv)
 	        {
 	          {"confirm-delete", no_argument,       &confirmDelete, 1},
 	          {"no-verify", no_argument,       &noVerify, 1},
+	          {"interleaved-verify", no_argument,       &interleavedVerify, 1},
 	 	  {"no-pec", no_argument,       &noPec, 1},		
 	          {"execute",    no_argument, &execute,1},
 
@@ -246,6 +388,8 @@ int main(int argc, char **argv)
 
 	}
 
+	SMBSetRetryPolicy(&retryPolicy);	// ride out the odd PEC error or timeout instead of aborting the run
+
 	memset(block,0,256);			// read SBS Chemistry.. should return "LION" if running firmware
 	status = SMBReadBlock(0x16,CMD_SBS_CHEMISTRY,block);
 
@@ -318,61 +462,50 @@ int main(int argc, char **argv)
 			printf("This will erase and reprogram the program flash on the microcontroller.\nIf you're sure add --confirm-delete and try again.\n");
 			exit(0);
 		}
+
+		image = readImage(programIn,PROGRAM_BLOCK_COUNT,PROGRAM_BLOCKSZ,PROGRAM_BLOCK_COUNT);
+
 		printf("Erasing program flash\n");
 		eraseProgramFlash();
 		printf("Done\n");
 		printf("Flashing program flash\n");
-
-		inFile = fopen(programIn,"rb");
-
-		if (inFile != NULL) { 
-			fseek(inFile, 0L, SEEK_END);
-			i = ftell(inFile);
-			rewind(inFile);	
-			if (i != PROGRAM_BLOCKSZ * PROGRAM_BLOCK_COUNT) {
-				printf("File size does not match flash size\n");
-				exit(4);
-			}
-		} else {
-			printf("Error opening input file");
-			exit(3);
-		}
 	
-		for (i=0;i<PROGRAM_BLOCK_COUNT;i++) {
-			fread(block,PROGRAM_BLOCKSZ,1,inFile);
-			status=writeProgramBlock(i,block);
-			if (status != PROGRAM_BLOCKSZ) {
-				printf("Error: %s\n",SMBGetErrorString(status));
-				exit(2);
-			}
-
-			fprintf(stderr,".");
-		}
-		fprintf(stderr,"\nDone!\n");
-
-		if (!noVerify) {
-			printf("Verifying\n");
-			rewind(inFile);
+		if (interleavedVerify && !noVerify) {
+			if (flashInterleaved(image,PROGRAM_BLOCK_COUNT,PROGRAM_BLOCKSZ,PROGRAM_WRITE_DELAY,
+						sendProgramBlock,readProgramBlock) < 0) exit(2);
+			fprintf(stderr,"\nVerified OK!\n");
+		} else {
 			for (i=0;i<PROGRAM_BLOCK_COUNT;i++) {
-				fread(block,PROGRAM_BLOCKSZ,1,inFile);
-				status=readProgramBlock(i,block2);				
+				status=writeProgramBlock(i,image+(i*PROGRAM_BLOCKSZ));
 				if (status != PROGRAM_BLOCKSZ) {
 					printf("Error: %s\n",SMBGetErrorString(status));
 					exit(2);
 				}
-				if (memcmp(block,block2,PROGRAM_BLOCKSZ) == 0) {
-					fprintf(stderr,".");
-				} else {
-					printf("Block verify fail. Block #%d\n",i);
-					exit(0);
+
+				fprintf(stderr,".");
+			}
+			fprintf(stderr,"\nDone!\n");
+
+			if (!noVerify) {
+				printf("Verifying\n");
+				for (i=0;i<PROGRAM_BLOCK_COUNT;i++) {
+					status=readProgramBlock(i,block2);				
+					if (status != PROGRAM_BLOCKSZ) {
+						printf("Error: %s\n",SMBGetErrorString(status));
+						exit(2);
+					}
+					if (memcmp(image+(i*PROGRAM_BLOCKSZ),block2,PROGRAM_BLOCKSZ) == 0) {
+						fprintf(stderr,".");
+					} else {
+						printf("Block verify fail. Block #%d\n",i);
+						exit(0);
+					}
 				}
 			}
+			fprintf(stderr,"\nVerified OK!\n");
 		}
-		fprintf(stderr,"\nVerified OK!\n");
-		
-
-		fclose(inFile);		
 		
+		free(image);
 	}
 
 	if (eepromIn !=NULL) {
@@ -381,60 +514,49 @@ int main(int argc, char **argv)
 			exit(0);
 		}
 
-		inFile = fopen(eepromIn,"rb");
-
-		if (inFile != NULL) { 
-			fseek(inFile, 0L, SEEK_END);
-			i = ftell(inFile);
-			rewind(inFile);	
-			if (i != EEPROM_BLOCKSZ * EEPROM_BLOCK_COUNT) {
-				printf("File size does not match flash size\n");
-				exit(4);
-			}
-		} else {
-			printf("Error opening input file");
-			exit(3);
-		}
+		image = readImage(eepromIn,EEPROM_BLOCK_COUNT,EEPROM_BLOCKSZ,EEPROM_FLASH_BLOCKS);
 
 		printf("Erasing eeprom(data) flash\n");
 		eraseEepromFlash();
 		printf("Done\n");
 		printf("Flashing eeprom(data) flash\n");
 	
-		for (i=0;i<EEPROM_BLOCK_COUNT-(EEPROM_RESERVED_BYTES/EEPROM_BLOCKSZ);i++) {
-			fread(block,EEPROM_BLOCKSZ,1,inFile);
-			status=writeEepromBlock(i,block);
-			if (status != EEPROM_BLOCKSZ) {
-				printf("Error: %s\n",SMBGetErrorString(status));
-				exit(2);
-			}
-
-			fprintf(stderr,".");
-		}
-		fprintf(stderr,"\nDone!\n");
-
-		if (!noVerify) {
-			printf("Verifying\n");
-			rewind(inFile);
-			for (i=0;i<EEPROM_BLOCK_COUNT-(EEPROM_RESERVED_BYTES/EEPROM_BLOCKSZ);i++) {
-				fread(block,EEPROM_BLOCKSZ,1,inFile);
-				status=readEepromBlock(i,block2);				
+		if (interleavedVerify && !noVerify) {
+			if (flashInterleaved(image,EEPROM_FLASH_BLOCKS,EEPROM_BLOCKSZ,
+						EEPROM_WRITE_DELAY,sendEepromBlock,readEepromBlock) < 0) exit(2);
+			fprintf(stderr,"\nVerified OK!\n");
+		} else {
+			for (i=0;i<EEPROM_FLASH_BLOCKS;i++) {
+				status=writeEepromBlock(i,image+(i*EEPROM_BLOCKSZ));
 				if (status != EEPROM_BLOCKSZ) {
 					printf("Error: %s\n",SMBGetErrorString(status));
 					exit(2);
 				}
-				if (memcmp(block,block2,EEPROM_BLOCKSZ) == 0) {
-					fprintf(stderr,".");
-				} else {
-					printf("Block verify fail. Block #%d\n",i);
-					exit(0);
+
+				fprintf(stderr,".");
+			}
+			fprintf(stderr,"\nDone!\n");
+
+			if (!noVerify) {
+				printf("Verifying\n");
+				for (i=0;i<EEPROM_FLASH_BLOCKS;i++) {
+					status=readEepromBlock(i,block2);				
+					if (status != EEPROM_BLOCKSZ) {
+						printf("Error: %s\n",SMBGetErrorString(status));
+						exit(2);
+					}
+					if (memcmp(image+(i*EEPROM_BLOCKSZ),block2,EEPROM_BLOCKSZ) == 0) {
+						fprintf(stderr,".");
+					} else {
+						printf("Block verify fail. Block #%d\n",i);
+						exit(0);
+					}
 				}
 			}
+			fprintf(stderr,"\nVerified OK!\n");	
 		}
-		fprintf(stderr,"\nVerified OK!\n");	
 
-		fclose(inFile);		
-		
+		free(image);
 	}
 
 	if (execute) {
@@ -27,6 +27,7 @@
 #include <stdarg.h>
 #include <getopt.h>
 #include <sys/types.h>
+#include <sys/time.h>
 
 #include "libsmbusb.h"
 
@@ -41,6 +42,14 @@
 
 #define CHUNKLEN 0x10
 
+#define FLASH_WRITE_DELAY 2000
+#define VERIFY_RETRIES 3
+
+#define TRANSACTION_ATTEMPTS 3
+#define RETRY_BACKOFF 10000
+
+#define ERR_VERIFY -98
+
 #define CMD_SBS_CHEMISTRY 0x22
 
 #define BLOCK_B_ADDRESS 0x1000
@@ -61,6 +70,19 @@
 #define BLOCK_0_ADDRESS 0xE000
 #define BLOCK_0_SIZE 0x2000
 
+long long timeNowUs() {
+	struct timeval tv;
+
+	gettimeofday(&tv,NULL);
+	return (long long)tv.tv_sec*1000000 + tv.tv_usec;
+}
+
+void waitUntilUs(long long deadline) {
+	long long now = timeNowUs();
+
+	if (deadline > now) usleep(deadline-now);
+}
+
 int readClearStatusRegister() {
 	return SMBReadByte(0x16,CMD_READ_CLEAR_STATUS_REGISTER);
 }
@@ -105,21 +127,26 @@ int readFlash(int address, int len, unsigned char* buf) {
 	
 	return len;
 }
+int sendFlashChunk(int address, unsigned char* buf) {
+	unsigned char chunk[CHUNKLEN+2];
+
+	memcpy(chunk+2,buf,CHUNKLEN);
+
+	chunk[0] = address & 0xFF;
+	chunk[1] = (address >> 8) & 0xFF;	
+
+	readClearStatusRegister();
+	return SMBWriteBlock(0x16,CMD_WRITE_BLOCK,chunk,CHUNKLEN+2);		
+}
+
 int writeFlash(int address, int len, unsigned char* buf) {
 	int status,i;
-	unsigned char chunk[CHUNKLEN+2];
 
 	if (len % CHUNKLEN !=0) return -99;
 
 	for (i=0;i<len/CHUNKLEN;i++) {
-		memcpy(chunk+2,buf+(i*CHUNKLEN),CHUNKLEN);
-
-		chunk[0] = (address+(i*CHUNKLEN)) & 0xFF;
-		chunk[1] = ((address+(i*CHUNKLEN)) >> 8) & 0xFF;	
-
-		readClearStatusRegister();
-		status=SMBWriteBlock(0x16,CMD_WRITE_BLOCK,chunk,CHUNKLEN+2);		
-		usleep(2000);
+		status=sendFlashChunk(address+(i*CHUNKLEN),buf+(i*CHUNKLEN));
+		usleep(FLASH_WRITE_DELAY);
 
 		if (status != CHUNKLEN+2) return status;		
 	}	
@@ -127,6 +154,57 @@ int writeFlash(int address, int len, unsigned char* buf) {
 	return len;
 }
 
+/*
+* Writes like writeFlash but reads back chunk N while chunk N+1 is being programmed,
+* so verification costs no extra pass. A chunk that fails to verify is rewritten
+* immediately; failAddress is set to the chunk that could not be fixed.
+*/
+int writeFlashInterleaved(int address, int len, unsigned char* buf, int *failAddress) {
+	int status,i,tries;
+	int chunks,prevAddress;
+	unsigned char readBack[CHUNKLEN];
+	long long deadline=0;
+
+	if (len % CHUNKLEN !=0) return -99;
+	chunks = len/CHUNKLEN;
+
+	for (i=0;i<=chunks;i++) {
+		if (i<chunks) {
+			waitUntilUs(deadline);
+			status=sendFlashChunk(address+(i*CHUNKLEN),buf+(i*CHUNKLEN));
+			if (status != CHUNKLEN+2) return status;
+			deadline=timeNowUs()+FLASH_WRITE_DELAY;
+		}
+		if (i==0) continue;
+
+		prevAddress=address+((i-1)*CHUNKLEN);
+		tries=0;
+		while (1) {
+			status=readFlash(prevAddress,CHUNKLEN,readBack);
+			if (status != CHUNKLEN) {	// may be busy programming, try again when it's done
+				waitUntilUs(deadline);
+				status=readFlash(prevAddress,CHUNKLEN,readBack);
+			}
+			if ((status == CHUNKLEN) && (memcmp(buf+((i-1)*CHUNKLEN),readBack,CHUNKLEN) == 0)) break;
+
+			if (++tries > VERIFY_RETRIES) {
+				*failAddress=prevAddress;
+				return (status != CHUNKLEN) ? status : ERR_VERIFY;
+			}
+
+			fprintf(stderr,"R");
+			waitUntilUs(deadline);
+			status=sendFlashChunk(prevAddress,buf+((i-1)*CHUNKLEN));
+			if (status != CHUNKLEN+2) return status;
+			deadline=timeNowUs()+FLASH_WRITE_DELAY;
+			waitUntilUs(deadline);
+		}
+	}
+	waitUntilUs(deadline);
+	
+	return len;
+}
+
 
 void printHeader() {
 
@@ -145,6 +223,7 @@ void printUsage() {
 	  printf("--size=0x<size> ,  -s 0x<size>          =   size of data to read or write\n");
 	  printf("--preset=<preset> , -p <preset>         =   sets address and size based on a preset, see below.\n");
 	  printf("--no-verify                             =   skip verification after flashing (not recommended)\n");
+	  printf("--interleaved-verify                    =   verify each chunk while the next one is programmed\n");
 	  printf("\n");
 	  printf("Presets:\n");
 	  printf("bb                                      =   Data Block B\n");
@@ -192,6 +271,7 @@ int main(int argc, char **argv)
 
 	int c;
 	static int noVerify=0;
+	static int interleavedVerify=0;
 	static int confirmDelete=0;
 
 	static int opErase=0;
@@ -201,8 +281,11 @@ int main(int argc, char **argv)
 	unsigned char block[0x1FFFF];
 	unsigned char block2[0x1FFFF];
 
+	struct smb_retry_policy retryPolicy = { TRANSACTION_ATTEMPTS, RETRY_BACKOFF, 2, SMB_RETRY_ON_TIMEOUT };
+
 	int status;
 	int i,j,chk;
+	int failAddress;
 	FILE *outFile;
 	FILE *inFile;
 
@@ -217,6 +300,7 @@ int main(int argc, char **argv)
 	        {
 	          {"confirm-delete", no_argument,       &confirmDelete, 1},
 	          {"no-verify", no_argument,       &noVerify, 1},
+	          {"interleaved-verify", no_argument,       &interleavedVerify, 1},
 		  {"erase",  no_argument,&opErase,1},		  
 
 	          {"address",    required_argument, 0, 'a'},
@@ -299,6 +383,7 @@ int main(int argc, char **argv)
 	}
 
 	SMBEnablePEC(0);  // Renesas BootROM does not support PEC :(
+	SMBSetRetryPolicy(&retryPolicy);
 
 	memset(block,0,255);			
 	status = SMBReadBlock(0x16,CMD_SBS_CHEMISTRY,block); // read SBS Chemistry.. should return "LION" if running firmware
@@ -369,7 +454,14 @@ int main(int argc, char **argv)
 			exit(3);
 		}
 
-		fread(block,opSize,1,inFile);
+		if (opSize > (int)sizeof(block)) {
+			printf("Size can't be more than 0x%x\n",(unsigned int)sizeof(block));
+			exit(2);
+		}
+		if (fread(block,opSize,1,inFile) != 1) {
+			printf("Error reading input file\n");
+			exit(3);
+		}
 
 		printf("Erasing flash block starting at 0x%04x ...\n",opAddress);
 
@@ -380,32 +472,45 @@ int main(int argc, char **argv)
 			exit(0);
 		}
 
-		printf("Writing memory 0x%04x-0x%04x ...\n",opAddress,opAddress+opSize-1);
-		status=writeFlash(opAddress,opSize,block);
+		if (interleavedVerify && !noVerify) {
+			printf("Writing and verifying memory 0x%04x-0x%04x ...\n",opAddress,opAddress+opSize-1);
+			status=writeFlashInterleaved(opAddress,opSize,block,&failAddress);
 
-		if (status>0) {
-			fprintf(stderr,"Done!\n");
+			if (status>0) {
+				printf("Verified OK!\n");
+			} else if (status == ERR_VERIFY) {
+				printf("Verify FAIL at 0x%04x\n",failAddress);
+			} else {
+				printf("Write Error: %s\n",SMBGetErrorString(status));
+			}
 		} else {
-			fprintf(stderr,"Write Error: %s\n",SMBGetErrorString(status));
+			printf("Writing memory 0x%04x-0x%04x ...\n",opAddress,opAddress+opSize-1);
+			status=writeFlash(opAddress,opSize,block);
 
-		}
+			if (status>0) {
+				fprintf(stderr,"Done!\n");
+			} else {
+				fprintf(stderr,"Write Error: %s\n",SMBGetErrorString(status));
 
-		if (!noVerify) {
-			printf("Verifying 0x%04x-0x%04x ...\n",opAddress,opAddress+opSize-1);
-			status = readFlash(opAddress,opSize,block2);
-			if (status < 0) {
-				printf("Read Error: %s\n",SMBGetErrorString(status));
-				exit(0);
 			}
 
+			if (!noVerify) {
+				printf("Verifying 0x%04x-0x%04x ...\n",opAddress,opAddress+opSize-1);
+				status = readFlash(opAddress,opSize,block2);
+				if (status < 0) {
+					printf("Read Error: %s\n",SMBGetErrorString(status));
+					exit(0);
+				}
 
-			if (i=memcmp(block,block2,opSize) == 0) {
-					printf("Verified OK!\n");
 
-			} else {
-					printf("Verify FAIL at 0x%04x\n",i);
-			}
-		}		
+				if (i=memcmp(block,block2,opSize) == 0) {
+						printf("Verified OK!\n");
+
+				} else {
+						printf("Verify FAIL at 0x%04x\n",i);
+				}
+			}		
+		}
 
 		fclose(inFile);		
 		
@@ -54,6 +54,11 @@
 #define DATAFLASH3_ADDRESS 0xC000
 #define DATAFLASH3_SIZE 0x2000
 
+#define RAM_CHUNK 0x400
+#define VERIFY_RETRIES 3
+
+#define ERR_VERIFY -98
+
 
 int eraseFlashBlock(unsigned int address) {
 	int status;
@@ -71,23 +76,16 @@ int eraseFlashBlock(unsigned int address) {
 
 
 int readRam(int address, unsigned int size, unsigned char *buf) {
-	int status,i;
 	unsigned char block[0xFF];
 
-	block[0]=0x16;
-	block[1]=CMD_READ_RAM;
-	block[2]=address&0xFF;
-	block[3]=(address>>8)&0xFF;
-	block[4]=(address>>16)&0xFF;
-	block[5]=size&0xFF;
-	block[6]=(size>>8)&0xFF;
-	status= SMBWrite(1,0,0,block,7);
-	if (status <0) return status;
+	block[0]=CMD_READ_RAM;
+	block[1]=address&0xFF;
+	block[2]=(address>>8)&0xFF;
+	block[3]=(address>>16)&0xFF;
+	block[4]=size&0xFF;
+	block[5]=(size>>8)&0xFF;
 
-	block[0]=0x17;
-	status= SMBWrite(0,1,0,block,1);
-	
-	return SMBRead(size,buf,1);
+	return SMBWriteRead(0x16,block,6,buf,size,0);
 }
 
 int writeRam(int address, unsigned int size, unsigned char *buf) {
@@ -111,6 +109,47 @@ int writeRam(int address, unsigned int size, unsigned char *buf) {
 	
 }
 
+/*
+* Writes in RAM_CHUNK pieces and reads back chunk N right after chunk N+1 has been
+* sent, so a bad chunk is rewritten immediately instead of failing a full verify
+* pass at the end. The last chunk is read back on a pass of its own after the
+* data has run out. failAddress is set to the chunk that could not be fixed.
+*/
+int writeRamInterleaved(int address, unsigned int size, unsigned char *buf, int *failAddress) {
+	int status,tries;
+	unsigned int offset,prevOffset,len,prevLen;
+	unsigned char readBack[RAM_CHUNK];
+
+	prevLen=0; prevOffset=0;
+	for (offset=0;offset<size || prevLen>0;offset+=RAM_CHUNK) {
+		len = offset>=size ? 0 : (size-offset) > RAM_CHUNK ? RAM_CHUNK : size-offset;
+		if (len>0) {
+			status=writeRam(address+offset,len,buf+offset);
+			if (status<0) return status;
+		}
+
+		if (prevLen>0) {
+			tries=0;
+			while (1) {
+				status=readRam(address+prevOffset,prevLen,readBack);
+				if ((status>=0) && (memcmp(buf+prevOffset,readBack,prevLen) == 0)) break;
+
+				if (++tries > VERIFY_RETRIES) {
+					*failAddress=address+prevOffset;
+					return (status<0) ? status : ERR_VERIFY;
+				}
+
+				fprintf(stderr,"R");
+				status=writeRam(address+prevOffset,prevLen,buf+prevOffset);
+				if (status<0) return status;
+			}
+		}
+		prevOffset=offset; prevLen=len;
+	}
+
+	return size;
+}
+
 void printHeader() {
 
 	  printf("------------------------------------\n");
@@ -128,6 +167,7 @@ void printUsage() {
 	  printf("--preset=<preset> , -p <preset>         =   sets address and size based on a preset, see below.\n");
 	  printf("--execute                               =   exit the Boot ROM and execute firmware\n");
 	  printf("--no-verify                             =   skip verification after flashing (not recommended)\n");
+	  printf("--interleaved-verify                    =   write in chunks, verifying each one as the next is written\n");
 	  printf("--fix-lgc-static-checksum               =   adds fixed checksum to end of data (LGC algo.)\n");
 	  printf("                                            (use when flashing modified static data)\n");
 	  printf("\n");
@@ -179,6 +219,7 @@ int main(int argc, char **argv)
 
 	int c;
 	static int noVerify=0;
+	static int interleavedVerify=0;
 	static int confirmDelete=0;
 
 	static int lgcChecksumFix=0;
@@ -192,6 +233,7 @@ int main(int argc, char **argv)
 
 	int status;
 	int i,j,chk;
+	int failAddress;
 	FILE *outFile;
 	FILE *inFile;
 
@@ -206,6 +248,7 @@ int main(int argc, char **argv)
 	        {
 	          {"confirm-delete", no_argument,       &confirmDelete, 1},
 	          {"no-verify", no_argument,       &noVerify, 1},
+	          {"interleaved-verify", no_argument,       &interleavedVerify, 1},
 	          {"execute",  no_argument, &opExecute,1},
 		  {"erase",  no_argument,&opErase,1},
 		  {"fix-lgc-static-checksum", no_argument, &lgcChecksumFix,1},
@@ -349,7 +392,14 @@ int main(int argc, char **argv)
 			printf("Error opening input file\n");
 			exit(3);
 		}
-		fread(block,opSize,1,inFile);
+		if (opSize > (int)sizeof(block)) {
+			printf("Size can't be more than 0x%x\n",(unsigned int)sizeof(block));
+			exit(2);
+		}
+		if (fread(block,opSize,1,inFile) != 1) {
+			printf("Error reading input file\n");
+			exit(3);
+		}
 
 		if (lgcChecksumFix) {
 			chk=0;
@@ -370,30 +420,43 @@ int main(int argc, char **argv)
 		}
 
 
-		printf("Writing memory 0x%04x-0x%04x ...\n",opAddress,opAddress+opSize-1);
-
-		status = writeRam(opAddress,opSize,block);	
+		if (interleavedVerify && !noVerify) {
+			printf("Writing and verifying memory 0x%04x-0x%04x ...\n",opAddress,opAddress+opSize-1);
+			status=writeRamInterleaved(opAddress,opSize,block,&failAddress);
 
-		if (status>0) {
-			fprintf(stderr,"Done!\n");
+			if (status>0) {
+				printf("Verified OK!\n");
+			} else if (status == ERR_VERIFY) {
+				printf("Verify FAIL at 0x%04x\n",failAddress);
+			} else {
+				printf("Write Error: %s\n",SMBGetErrorString(status));
+			}
 		} else {
-			fprintf(stderr,"Write Error: %s\n",SMBGetErrorString(status));
+			printf("Writing memory 0x%04x-0x%04x ...\n",opAddress,opAddress+opSize-1);
 
-		}
+			status = writeRam(opAddress,opSize,block);	
 
+			if (status>0) {
+				fprintf(stderr,"Done!\n");
+			} else {
+				fprintf(stderr,"Write Error: %s\n",SMBGetErrorString(status));
 
-		fprintf(stderr,"Done!\n");
+			}
 
-		if (!noVerify) {
-			printf("Verifying 0x%04x-0x%04x ...\n",opAddress,opAddress+opSize-1);
-			readRam(opAddress,opSize,block2);
-			if (i=memcmp(block,block2,opSize) == 0) {
-					printf("Verified OK!\n");
 
-			} else {
-					printf("Verify FAIL at 0x%04x\n",i);
-			}
-		}		
+			fprintf(stderr,"Done!\n");
+
+			if (!noVerify) {
+				printf("Verifying 0x%04x-0x%04x ...\n",opAddress,opAddress+opSize-1);
+				readRam(opAddress,opSize,block2);
+				if (i=memcmp(block,block2,opSize) == 0) {
+						printf("Verified OK!\n");
+
+				} else {
+						printf("Verify FAIL at 0x%04x\n",i);
+				}
+			}		
+		}
 
 		fclose(inFile);		
 		
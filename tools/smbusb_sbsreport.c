@@ -26,8 +26,10 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <getopt.h>
+#include <sys/time.h>
 
 #include "libsmbusb.h"
 
@@ -37,100 +39,353 @@ typedef struct {
     unsigned char unknown_1[2];
 } lenovo_data_t __attribute__ ((aligned (1)));
 
-int main(int argc, char*argv[])
-{
-	int status;
-	int i;
+#define OUTPUT_TEXT 0
+#define OUTPUT_JSON 1
+#define OUTPUT_CSV 2
 
-	unsigned char *block = malloc(256);
-	int size = 0;
+#define FMT_HEX 0
+#define FMT_UINT 1
+#define FMT_INT 2
+#define FMT_TEMP 3
+#define FMT_DATE 4
+#define FMT_STRING 5
+#define FMT_DATA 6
 
-	unsigned char *tempStr = malloc(256);
-	unsigned int tempWord;
+typedef struct {
+	unsigned char reg;
+	const char *label;
+	const char *key;
+	unsigned char format;
+	const char *unit;
+	size_t offset;
+} sbs_field_t;
 
-	if ((status = SMBOpenDeviceVIDPID(SMB_DEFAULT_VID,SMB_DEFAULT_PID)) >0) {
-		printf("SMBusb Firmware Version: %d.%d.%d\n",status&0xFF,(status >>8)&0xFF,(status >>16)&0xFF);
-	} else {
-		printf("Error: %s\n",SMBGetErrorString(status));
-		exit(0);
+#define FIELD(reg,label,key,format,unit) {reg,label,#key,format,unit,offsetof(struct sbs_snapshot,key)}
+
+static const sbs_field_t fields[] = {
+	FIELD(SBS_MANUFACTURER_NAME,"Manufacturer Name",manufacturerName,FMT_STRING,""),
+	FIELD(SBS_DEVICE_NAME,"Device Name",deviceName,FMT_STRING,""),
+	FIELD(SBS_DEVICE_CHEMISTRY,"Device Chemistry",deviceChemistry,FMT_STRING,""),
+	FIELD(SBS_SERIAL_NUMBER,"Serial Number",serialNumber,FMT_UINT,""),
+	FIELD(SBS_MANUFACTURE_DATE,"Manufacture Date",manufactureDate,FMT_DATE,""),
+	FIELD(SBS_MANUFACTURER_ACCESS,"Manufacturer Access",manufacturerAccess,FMT_HEX,""),
+	FIELD(SBS_REMAINING_CAPACITY_ALARM,"Remaining Capacity Alarm",remainingCapacityAlarm,FMT_UINT,"mAh(/10mWh)"),
+	FIELD(SBS_REMAINING_TIME_ALARM,"Remaining Time Alarm",remainingTimeAlarm,FMT_UINT,"min"),
+	FIELD(SBS_BATTERY_MODE,"Battery Mode",batteryMode,FMT_HEX,""),
+	FIELD(SBS_AT_RATE,"At Rate",atRate,FMT_INT,"mAh(/10mWh)"),
+	FIELD(SBS_AT_RATE_TIME_TO_FULL,"At Rate Time To Full",atRateTimeToFull,FMT_UINT,"min"),
+	FIELD(SBS_AT_RATE_TIME_TO_EMPTY,"At Rate Time To Empty",atRateTimeToEmpty,FMT_UINT,"min"),
+	FIELD(SBS_AT_RATE_OK,"At Rate OK",atRateOK,FMT_UINT,""),
+	FIELD(SBS_TEMPERATURE,"Temperature",temperature,FMT_TEMP,"degC"),
+	FIELD(SBS_VOLTAGE,"Voltage",voltage,FMT_UINT,"mV"),
+	FIELD(SBS_CURRENT,"Current",current,FMT_INT,"mA"),
+	FIELD(SBS_AVERAGE_CURRENT,"Average Current",averageCurrent,FMT_INT,"mA"),
+	FIELD(SBS_MAX_ERROR,"Max Error",maxError,FMT_UINT,"%"),
+	FIELD(SBS_RELATIVE_STATE_OF_CHARGE,"Relative State Of Charge",relativeStateOfCharge,FMT_UINT,"%"),
+	FIELD(SBS_ABSOLUTE_STATE_OF_CHARGE,"Absolute State Of Charge",absoluteStateOfCharge,FMT_UINT,"%"),
+	FIELD(SBS_REMAINING_CAPACITY,"Remaining Capacity",remainingCapacity,FMT_UINT,"mAh(/10mWh)"),
+	FIELD(SBS_FULL_CHARGE_CAPACITY,"Full Charge Capacity",fullChargeCapacity,FMT_UINT,"mAh(/10mWh)"),
+	FIELD(SBS_RUN_TIME_TO_EMPTY,"Run Time To Empty",runTimeToEmpty,FMT_UINT,"min"),
+	FIELD(SBS_AVERAGE_TIME_TO_EMPTY,"Average Time To Empty",averageTimeToEmpty,FMT_UINT,"min"),
+	FIELD(SBS_AVERAGE_TIME_TO_FULL,"Average Time To Full",averageTimeToFull,FMT_UINT,"min"),
+	FIELD(SBS_CHARGING_CURRENT,"Charging Current",chargingCurrent,FMT_UINT,"mA"),
+	FIELD(SBS_CHARGING_VOLTAGE,"Charging Voltage",chargingVoltage,FMT_UINT,"mV"),
+	FIELD(SBS_BATTERY_STATUS,"Battery Status",batteryStatus,FMT_HEX,""),
+	FIELD(SBS_CYCLE_COUNT,"Cycle Count",cycleCount,FMT_UINT,""),
+	FIELD(SBS_DESIGN_CAPACITY,"Design Capacity",designCapacity,FMT_UINT,"mAh(/10mWh)"),
+	FIELD(SBS_DESIGN_VOLTAGE,"Design Voltage",designVoltage,FMT_UINT,"mV"),
+	FIELD(SBS_SPECIFICATION_INFO,"Specification Info",specificationInfo,FMT_HEX,""),
+	FIELD(SBS_MANUFACTURER_DATA,"Manufacturer Data",manufacturerData,FMT_DATA,"")
+};
+
+#define FIELD_COUNT (sizeof(fields)/sizeof(fields[0]))
+
+void printUsage() {
+	  printf("------------------------------------\n");
+	  printf("          smbusb_sbsreport\n");
+ 	  printf("------------------------------------\n");
+	  printf("options:\n");
+	  printf("--no-pec                 , -n                  =   disable SMBus Packet Error Checking\n");
+	  printf("--json                   , -j                  =   print one JSON object per sample\n");
+	  printf("--csv                    , -c                  =   print a CSV header and one row per sample\n");
+	  printf("--watch=<ms>             , -w <ms>             =   keep sampling every <ms> milliseconds\n");
+	  printf("--mux=<addr>:<channel>   , -m <addr>:<channel> =   the battery is behind a PCA9548 style mux\n");
+}
+
+unsigned long long timeNowMs() {
+	struct timeval tv;
+
+	gettimeofday(&tv,NULL);
+	return (unsigned long long)tv.tv_sec*1000+tv.tv_usec/1000;
+}
+
+unsigned int fieldWord(struct sbs_snapshot *snap, const sbs_field_t *f) {
+	return *(unsigned short*)((char*)snap+f->offset);
+}
+
+void printJSONString(const char *str) {
+	putchar('"');
+	for (;*str;str++) {
+		if (*str == '"' || *str == '\\') {
+			printf("\\%c",*str);
+		} else if ((unsigned char)*str < 0x20) {
+			printf("\\u%04x",(unsigned char)*str);
+		} else {
+			putchar(*str);
+		}
+	}
+	putchar('"');
+}
+
+void printCSVString(const char *str) {
+	putchar('"');
+	for (;*str;str++) {
+		if (*str == '"') putchar('"');
+		putchar(*str);
 	}
+	putchar('"');
+}
+
+/*
+* Prints the value of a field that was read successfully in machine readable form
+*/
+void printValue(struct sbs_snapshot *snap, const sbs_field_t *f, int output) {
+	unsigned int w;
+	int i;
+	char date[11];
+
+	switch (f->format) {
+		case FMT_STRING:
+			if (output == OUTPUT_JSON) {
+				printJSONString((char*)snap+f->offset);
+			} else {
+				printCSVString((char*)snap+f->offset);
+			}
+			return;
+		case FMT_DATA:
+			putchar('"');
+			for (i=0;i<snap->manufacturerDataLen;i++) printf("%02x",snap->manufacturerData[i]);
+			putchar('"');
+			return;
+	}
+
+	w = fieldWord(snap,f);
+	switch (f->format) {
+		case FMT_INT:
+			printf("%d",(int16_t)w);
+			break;
+		case FMT_TEMP:
+			printf("%.2f",(w*0.1)-273.15);
+			break;
+		case FMT_DATE:
+			// the year is 7 bits, mask it so the buffer bound holds for any w
+			snprintf(date,sizeof(date),"%04u-%02u-%02u",1980+(w>>9&0x7F),w>>5&0xF,w&0x1F);
+			printf("\"%s\"",date);
+			break;
+		default:
+			printf("%u",w);
+	}
+}
 
-	SMBEnablePEC(!(argc > 1 && !strcmp(argv[1], "--no-pec")));
+void printText(struct sbs_snapshot *snap) {
+	unsigned int i,j,w;
+	const sbs_field_t *f;
+	char label[64];
+	lenovo_data_t *lenovo_data;
 
 	printf("-------------------------------------------------\n");
+	for (i=0;i<FIELD_COUNT;i++) {
+		f=&fields[i];
+		if (f->reg == SBS_MANUFACTURER_ACCESS) printf("\n");
 
+		if (f->format == FMT_DATA && snap->status[f->reg] == 0 && snap->manufacturerDataLen >= (int)sizeof(lenovo_data_t)) {
+			lenovo_data = (lenovo_data_t*)snap->manufacturerData;
+			for (j = 0; j < 4; j++) {
+				printf("Cell %d voltage:             %u mV\n", j, lenovo_data->cell_voltage[3-j]);
+			}
+			continue;
+		}
 
-	memset(tempStr,0,256);
-	if (SMBReadBlock(0x16,0x20,tempStr) <=0) strcpy(tempStr,"ERROR");
+		sprintf(label,"%s:",f->label);
+		printf("%-28s",label);
+		if (snap->status[f->reg] < 0) {
+			printf("ERROR (%s)\n",SMBGetErrorString(snap->status[f->reg]));
+			continue;
+		}
 
-	printf("Manufacturer Name:          %s\n",tempStr);
+		w = fieldWord(snap,f);
+		switch (f->format) {
+			case FMT_STRING:
+				printf("%s",(char*)snap+f->offset);
+				break;
+			case FMT_DATA:
+				for (j=0;(int)j<snap->manufacturerDataLen;j++) printf("%02x ",snap->manufacturerData[j]);
+				break;
+			case FMT_HEX:
+				printf("%04x",w);
+				break;
+			case FMT_INT:
+				printf("%d%s%s",(int16_t)w,*f->unit ? " " : "",f->unit);
+				break;
+			case FMT_TEMP:
+				printf("%02.02f %s",(w*0.1)-273.15,f->unit); // unit: 0.1Kelvin
+				break;
+			case FMT_DATE:
+				printf("%u.%02u.%02u",1980+(w>>9),w>>5&0xF,w&0x1F);
+				break;
+			default:
+				printf("%u%s%s",w,*f->unit ? " " : "",f->unit);
+		}
+		printf("\n");
+	}
+}
 
-	memset(tempStr,0,256);
-	if (SMBReadBlock(0x16,0x21,tempStr) <=0) strcpy(tempStr,"ERROR");
-	printf("Device Name:                %s\n",tempStr);
+void printJSON(struct sbs_snapshot *snap, unsigned long long timestamp) {
+	unsigned int i;
+	char haveError=0;
+
+	printf("{\"timestamp\":%llu",timestamp);
+	for (i=0;i<FIELD_COUNT;i++) {
+		printf(",\"%s\":",fields[i].key);
+		if (snap->status[fields[i].reg] < 0) {
+			printf("null");
+		} else {
+			printValue(snap,&fields[i],OUTPUT_JSON);
+		}
+	}
+	printf(",\"errors\":{");
+	for (i=0;i<FIELD_COUNT;i++) {
+		if (snap->status[fields[i].reg] < 0) {
+			if (haveError) printf(",");
+			printf("\"%s\":",fields[i].key);
+			printJSONString(SMBGetErrorString(snap->status[fields[i].reg]));
+			haveError=1;
+		}
+	}
+	printf("}}\n");
+}
 
-	memset(tempStr,0,256);
-	if (SMBReadBlock(0x16,0x22,tempStr) <=0) strcpy(tempStr,"ERROR");
-	printf("Device Chemistry:           %s\n",tempStr);
+void printCSVHeader() {
+	unsigned int i;
 
-	printf("Serial Number:              %u\n",SMBReadWord(0x16,0x1c));
+	printf("timestamp");
+	for (i=0;i<FIELD_COUNT;i++) printf(",%s",fields[i].key);
+	printf("\n");
+}
 
-	tempWord = SMBReadWord(0x16,0x1b);
-	printf("Manufacture Date:	    %u.%02u.%02u\n",1980+(tempWord>>9),
-						     	tempWord>>5&0xF,
-							tempWord&0x1F);
+void printCSV(struct sbs_snapshot *snap, unsigned long long timestamp) {
+	unsigned int i;
 
+	printf("%llu",timestamp);
+	for (i=0;i<FIELD_COUNT;i++) {
+		printf(",");
+		if (snap->status[fields[i].reg] == 0) printValue(snap,&fields[i],OUTPUT_CSV);
+	}
 	printf("\n");
-	printf("Manufacturer Access:        %04x\n",SMBReadWord(0x16,0x00));
-
-	printf("Remaining Capacity Alarm:   %u mAh(/10mWh)\n",SMBReadWord(0x16,0x01));
-
-	printf("Remaining Time Alarm:       %u min\n",SMBReadWord(0x16,0x02));
-
-	printf("Battery Mode:               %04x\n",SMBReadWord(0x16,0x03));
-
-
-	printf("At Rate:                    %d mAh(/10mWh)\n",SMBReadWord(0x16,0x04));
-
-	printf("At Rate Time To Full:       %u min\n",SMBReadWord(0x16,0x05));
-	printf("At Rate Time To Empty:      %u min\n",SMBReadWord(0x16,0x06));
-
-	printf("At Rate OK:                 %u\n",SMBReadWord(0x16,0x07));
-
-	printf("Temperature:                %02.02f degC\n",(float)((SMBReadWord(0x16,0x08)*0.1)-273.15)); // unit: 0.1Kelvin
-
-	printf("Voltage:                    %u mV\n",SMBReadWord(0x16,0x09));
-	printf("Current:                    %d mA\n", (int16_t)SMBReadWord(0x16, 0x0a));
-	printf("Average Current:            %d mA\n", (int16_t)SMBReadWord(0x16, 0x0b));
-	printf("Max Error:                  %u %%\n",SMBReadWord(0x16,0x0c));
-	printf("Relative State Of Charge    %u %%\n",SMBReadWord(0x16,0x0d));
-	printf("Absolute State Of Charge    %u %%\n",SMBReadWord(0x16,0x0e));
-	printf("Remaining Capacity:         %u mAh(/10mWh)\n",SMBReadWord(0x16,0x0f));
-	printf("Full Charge Capacity:       %u mAh(/10mWh)\n",SMBReadWord(0x16,0x10));
-	printf("Run Time To Empty:          %u min\n",SMBReadWord(0x16,0x11));
-	printf("Average Time To Empty:      %u min\n",SMBReadWord(0x16,0x12));
-	printf("Average Time To Full:       %u min\n",SMBReadWord(0x16,0x13));
-	printf("Charging Current:           %u mA\n",SMBReadWord(0x16,0x14));
-	printf("Charging Voltage:           %u mV\n",SMBReadWord(0x16,0x15));
-	printf("Battery Status:             %04x\n",SMBReadWord(0x16,0x16));
-	printf("Cycle Count:                %u\n",SMBReadWord(0x16,0x17));
-	printf("Design Capacity:            %u mAh(/10mWh)\n",SMBReadWord(0x16,0x18));
-	printf("Design Voltage:             %u mV\n",SMBReadWord(0x16,0x19));
-	printf("Specification Info:         %04x\n",SMBReadWord(0x16,0x1a));
-
-	memset(block, 0, 256);
-    size = SMBReadBlock(0x16, 0x23, block);
-	if (size < sizeof(lenovo_data_t)) {
-        printf("Manufacturer Data: ");
-        for (i = 0; i < size; i++) {
-            printf("%02x ", block[i]);
-        }
-        printf("\n");
-    } else {
-        lenovo_data_t *lenovo_data = (lenovo_data_t*)block;
-        for (i = 0; i < 4; i++) {
-            printf("Cell %d voltage:             %u mV\n", i,
-                    lenovo_data->cell_voltage[3-i]);
-        }
-    }
+}
+
+int main(int argc, char*argv[])
+{
+	int status;
+	int c;
+	int output=OUTPUT_TEXT;
+	int watchMs=0;
+	int pec=1;
+	unsigned int address=SBS_DEFAULT_ADDRESS, mux, channel;
+	unsigned long long timestamp, next;
+	struct sbs_snapshot *snap = malloc(sizeof(struct sbs_snapshot));
+
+	while (1)
+	{
+		static struct option long_options[] =
+	        {
+	          {"no-pec", no_argument,       0, 'n'},
+	          {"json", no_argument,       0, 'j'},
+	          {"csv", no_argument,       0, 'c'},
+	          {"watch", required_argument,       0, 'w'},
+	          {"mux", required_argument,       0, 'm'},
+	          {0, 0, 0, 0}
+		};
+
+		int option_index = 0;
+
+		c = getopt_long (argc, argv, "njcw:m:h",
+                       long_options, &option_index);
+
+		if (c == -1)
+			break;
+
+		switch (c)
+		{
+			case 'n':
+				pec=0;
+				break;
+			case 'j':
+				output=OUTPUT_JSON;
+				break;
+			case 'c':
+				output=OUTPUT_CSV;
+				break;
+			case 'w':
+				watchMs=strtol(optarg,NULL,10);
+				break;
+			case 'm':
+				if (sscanf(optarg,"%i:%u",&mux,&channel) != 2 || channel > 7) {
+					printUsage();
+					exit(0);
+				}
+				address = SMB_MUX_ADDRESS(mux,channel,SBS_DEFAULT_ADDRESS);
+				break;
+			case 'h':
+			case '?':
+				printUsage();
+				exit(0);
+		}
+	}
+
+	// keep stdout clean for the machine readable outputs
+	if ((status = SMBOpenDeviceVIDPID(SMB_DEFAULT_VID,SMB_DEFAULT_PID)) >0) {
+		fprintf(output == OUTPUT_TEXT ? stdout : stderr, "SMBusb Firmware Version: %d.%d.%d\n",status&0xFF,(status >>8)&0xFF,(status >>16)&0xFF);
+	} else {
+		fprintf(output == OUTPUT_TEXT ? stdout : stderr, "Error: %s\n",SMBGetErrorString(status));
+		exit(0);
+	}
+
+	SMBEnablePEC(pec);
+
+	if (output == OUTPUT_CSV) printCSVHeader();
+
+	next = timeNowMs();
+	do {
+		timestamp = timeNowMs();
+		status = SMBReadSBSSnapshot(address,snap);
+		if (status < 0) {
+			fprintf(stderr,"Error: %s\n",SMBGetErrorString(status));
+		} else {
+			switch (output) {
+				case OUTPUT_JSON:
+					printJSON(snap,timestamp);
+					break;
+				case OUTPUT_CSV:
+					printCSV(snap,timestamp);
+					break;
+				default:
+					printText(snap);
+			}
+		}
+		fflush(stdout);
+
+		if (watchMs > 0) {
+			next += watchMs;
+			timestamp = timeNowMs();
+			if (next > timestamp) {
+				usleep((next-timestamp)*1000);
+			} else {
+				next = timestamp;	// fell behind, don't try to catch up with a burst
+			}
+		}
+	} while (watchMs > 0);
+
+	SMBCloseDevice();
+	return 0;
 }
@@ -93,10 +93,22 @@ void printSkipMap(int start, int end, unsigned char skipMap[]) {
 	printf("\n------------------------------------\n");
 }
 
+void packSkipMap(unsigned char skipMap[], unsigned char skipBits[]) {
+	int i;
+
+	memset(skipBits,0,SMB_SCAN_MAP_SIZE);
+	for (i=0;i<256;i++) {
+		if (skipMap[i] == 0xFF) skipBits[i>>3] |= 1<<(i&7);
+	}
+}
+
 
 int main(int argc, char **argv)
 {                       
 	unsigned char skipMap[256] = {0};
+	unsigned char skipBits[SMB_SCAN_MAP_SIZE];
+	unsigned char ackMap[SMB_SCAN_MAP_SIZE];
+	unsigned char levels[256];
 	int address=0;
 	static int scanMode=0;
 
@@ -189,61 +201,64 @@ int main(int argc, char **argv)
 			skipMap[0xA0] = 0xFF; 	// reserved addresses belong to the FX2 config eeprom
 			skipMap[0xA1] = 0xFF;   // messing with it like this can hang the device
 			printSkipMap(start,end,skipMap);
+			packSkipMap(skipMap,skipBits);
 		
+			status = SMBScanAddressACK(start,end,skipBits,ackMap);
+			if (status< 0) {
+				printf("ERROR: %s\n",SMBGetErrorString(status));
+				break;
+			}
 			for(i=start;i<=end;i++) {
-				if (skipMap[i] != 0xFF) { 
-					status = SMBTestAddressACK(i);		
-					if (status< 0) printf("[%x] ERROR: %d\n",i,status);
-					if (status == 0xFF)  printf("[%x] ACK\n",i);
-				}
+				if (ackMap[i>>3] & (1<<(i&7)))  printf("[%x] ACK\n",i);
 			}
 				
 			break;
 		case SCAN_COMMAND:
 			printf("Scanning for commands..\n");
 			printSkipMap(start,end,skipMap);
+			packSkipMap(skipMap,skipBits);
+
+			status = SMBScanCommandACK(address,start,end,skipBits,ackMap);
+			if (status< 0) {
+				printf("ERROR: %s\n",SMBGetErrorString(status));
+				break;
+			}
 			for(i=start;i<=end;i++) {
-				if (skipMap[i] != 0xFF) { 
-					status = SMBTestCommandACK(address,i);
-					if (status< 0) printf("[%x] ERROR: %d\n",i,status);
-					if (status ==0xFF)  printf("[%x] ACK\n",i);
-				}
+				if (ackMap[i>>3] & (1<<(i&7)))  printf("[%x] ACK\n",i);
 			}
-				
-				
 	
 			break;
 		case SCAN_COMMAND_WRITE:
 			printf("Scanning for command writability..\n");
 			printSkipMap(start,end,skipMap);
+			packSkipMap(skipMap,skipBits);
+
+			status = SMBScanCommandWrite(address,start,end,skipBits,levels);
+			if (status< 0) {
+				printf("ERROR: %s\n",SMBGetErrorString(status));
+				break;
+			}
 			for(i=start;i<=end;i++) {
-				if (skipMap[i] != 0xFF) {
-					status = SMBTestCommandWrite(address,i);
-					if (status< 0) {
-						 printf("[%x] ERROR: %d\n",i,status);
-					} else {					
-		                        	if (status>0) { 
-							didAck=1;
-							printf("[%x] ACK",i);
-						}
-						if (status>1) {
-							printf(", Byte writable");
-						}
-						if (status>2) {
-							printf(", Word writable");
-						}
-						if (status>3) {
-							printf(", Block writable");
-						}
-						if (status>4) {
-							printf(", >Block writable");
-						}					
-					}
-					if (didAck) {
-						printf("\n");
-						didAck=0;
-					}
-                                	
+				status = levels[i];
+	                        if (status>0) { 
+					didAck=1;
+					printf("[%x] ACK",i);
+				}
+				if (status>1) {
+					printf(", Byte writable");
+				}
+				if (status>2) {
+					printf(", Word writable");
+				}
+				if (status>3) {
+					printf(", Block writable");
+				}
+				if (status>4) {
+					printf(", >Block writable");
+				}					
+				if (didAck) {
+					printf("\n");
+					didAck=0;
 				}
 			}
 
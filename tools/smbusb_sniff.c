@@ -0,0 +1,325 @@
+/*
+* smbusb_sniff
+* Passive SMBus monitor
+*
+* Copyright (c) 2016 Viktor <github@karosium.e4ward.com>
+*
+*
+* This program is free software; you can redistribute it and/or
+* modify it under the terms of the GNU Lesser General Public
+* License as published by the Free Software Foundation; either
+* version 2.1 of the License, or (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+* Lesser General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public
+* License along with this program; if not, write to the Free Software
+* Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+*/
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/types.h>
+
+#include "libsmbusb.h"
+
+#define FORMAT_TEXT 0
+#define FORMAT_PCAPNG 1
+#define FORMAT_LOG 2
+
+#define LINKTYPE_I2C_LINUX 209		// bus, flags (big endian), address byte, data
+#define MSG_MAX 512
+
+#define EVENTS 4096
+
+static volatile int stop = 0;
+
+static unsigned char msg[MSG_MAX];
+static unsigned int msgLen = 0;
+static unsigned long long msgTime = 0;
+
+void printHeader() {
+
+	  printf("------------------------------------\n");
+	  printf("            smbusb_sniff\n");
+ 	  printf("------------------------------------\n");
+}
+void printUsage() {
+	  printHeader();
+	  printf("options:\n");
+	  printf("--bus=<#>                , -b <#>              =   bit-banged bus to watch, 1-%d (default 1)\n",SMB_BUSES);
+	  printf("--output=<file>          , -o <file>           =   write the capture to a file instead of printing it\n");
+	  printf("--format=<pcapng|log>    , -f <pcapng|log>     =   file format, pcapng (default) or the compact log\n");
+	  printf("--count=<#>              , -c <#>              =   stop after this many events, Ctrl-C stops otherwise\n");
+	  printf("\nThe log is \"SMBSNIFF\", version, bus, then 12 bytes per event:\n");
+	  printf("time in ns (64 bit little endian), type, data, nak, 0\n");
+}
+
+void onSignal(int sig) {
+	(void)sig;
+	stop = 1;
+}
+
+void putU16(FILE *f, uint16_t v) {
+	fwrite(&v,2,1,f);
+}
+
+void putU32(FILE *f, uint32_t v) {
+	fwrite(&v,4,1,f);
+}
+
+void writePcapngHeader(FILE *f) {
+	// section header
+	putU32(f,0x0A0D0D0A);
+	putU32(f,28);
+	putU32(f,0x1A2B3C4D);
+	putU32(f,0x00000001);	// version 1.0
+	putU32(f,0xFFFFFFFF);	// section length unknown
+	putU32(f,0xFFFFFFFF);
+	putU32(f,28);
+
+	// interface, nanosecond timestamps
+	putU32(f,1);
+	putU32(f,32);
+	putU32(f,LINKTYPE_I2C_LINUX);
+	putU32(f,0);		// no snap length
+	putU16(f,9);		// if_tsresol, 10^-9
+	putU16(f,1);
+	putU32(f,9);
+	putU32(f,0);		// opt_endofopt
+	putU32(f,32);
+}
+
+void writePcapngMessage(FILE *f, unsigned char bus, unsigned long long time, unsigned char *data, unsigned int len) {
+	unsigned char hdr[5] = { bus, 0, 0, 0, 0 };	// flags 0 = a message, not an event
+	unsigned int caplen = len+5, pad = (4 - (caplen&3)) & 3;
+	uint32_t zero = 0;
+
+	putU32(f,6);
+	putU32(f,32+caplen+pad);
+	putU32(f,0);
+	putU32(f,time>>32);
+	putU32(f,time&0xFFFFFFFF);
+	putU32(f,caplen);
+	putU32(f,caplen);
+	fwrite(hdr,5,1,f);
+	fwrite(data,len,1,f);
+	fwrite(&zero,pad,1,f);
+	putU32(f,32+caplen+pad);
+}
+
+void writeLogEvent(FILE *f, struct smb_sniff_event *e) {
+	unsigned char rec[12] = {0};
+	int i;
+
+	for (i=0;i<8;i++) rec[i] = (e->time >> (8*i)) & 0xFF;
+	rec[8] = e->type;
+	rec[9] = e->data;
+	rec[10] = e->nak;
+	fwrite(rec,12,1,f);
+}
+
+void printEvent(struct smb_sniff_event *e) {
+	static int inMsg = 0;
+
+	switch (e->type) {
+		case SMB_SNIFF_START:
+			if (inMsg) {
+				printf("Sr ");
+			} else {
+				printf("%llu.%06llu S ",e->time/1000000000,(e->time/1000)%1000000);
+			}
+			inMsg = 1;
+			break;
+		case SMB_SNIFF_STOP:
+			printf("P\n");
+			inMsg = 0;
+			break;
+		case SMB_SNIFF_BYTE:
+			printf("%02x%c ",e->data,e->nak ? '-' : '+');
+			break;
+		case SMB_SNIFF_LOST:
+			printf("\n[%d records lost]\n",e->data);
+			inMsg = 0;
+			break;
+	}
+}
+
+/*
+* Collects START..START/STOP into messages for pcapng, the address byte first
+*/
+void collectEvent(FILE *f, unsigned char bus, unsigned long long base, struct smb_sniff_event *e) {
+	switch (e->type) {
+		case SMB_SNIFF_START:
+		case SMB_SNIFF_STOP:
+		case SMB_SNIFF_LOST:
+			if (msgLen) writePcapngMessage(f,bus,base+msgTime,msg,msgLen);
+			msgLen = 0;
+			msgTime = e->time;
+			break;
+		case SMB_SNIFF_BYTE:
+			if (msgLen < MSG_MAX) msg[msgLen++] = e->data;
+			break;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct smb_sniff_event *events;
+	unsigned char bus=1;
+	int format=FORMAT_TEXT;
+	char *outFile=NULL;
+	FILE *f=NULL;
+	unsigned long long base, total=0, count=0;
+
+	int status;
+	int c,i;
+
+	while (1)
+	{
+		static struct option long_options[] =
+	        {
+	          {"bus", required_argument,       0, 'b'},
+	          {"output", required_argument,       0, 'o'},
+	          {"format", required_argument,       0, 'f'},
+	          {"count", required_argument,       0, 'c'},
+	          {"help", no_argument,       0, 'h'},
+	          {0, 0, 0, 0}
+        };
+
+      int option_index = 0;
+
+      c = getopt_long (argc, argv, "b:o:f:c:h",
+                       long_options, &option_index);
+
+      if (c == -1)
+        break;
+
+      switch (c)
+        {
+        case 0:
+          if (long_options[option_index].flag != 0)
+            break;
+	case 'b':
+		status = strtol(optarg,NULL,0);
+		bus = status;
+		if (status < 1 || status > SMB_BUSES) {
+			printf("bus has to be 1-%d\n",SMB_BUSES);
+			exit(1);
+		}
+		break;
+	case 'o':
+		outFile = optarg;
+		if (format == FORMAT_TEXT) format = FORMAT_PCAPNG;
+		break;
+	case 'f':
+		if (!strcmp(optarg,"pcapng")) {
+			format = FORMAT_PCAPNG;
+		} else if (!strcmp(optarg,"log")) {
+			format = FORMAT_LOG;
+		} else {
+			printf("unknown format %s\n",optarg);
+			exit(1);
+		}
+		break;
+	case 'c':
+		count = strtoull(optarg,NULL,0);
+		break;
+	case 'h':
+        case '?':
+		printUsage();
+		exit(0);
+          break;
+        default:
+	  abort();
+        }
+    }
+
+	if (format != FORMAT_TEXT && outFile == NULL) {
+		printf("--format needs --output\n");
+		exit(1);
+	}
+
+	printHeader();
+
+	if ((status = SMBOpenDeviceVIDPID(SMB_DEFAULT_VID,SMB_DEFAULT_PID)) >0) {
+		printf("Success. SMBusb Firmware Version: %d.%d.%d\n",status&0xFF,(status >>8)&0xFF,(status >>16)&0xFF);
+	} else {
+		printf("Error: %s\n",SMBGetErrorString(status));
+		exit(0);
+	}
+
+	if (outFile != NULL) {
+		if ((f = fopen(outFile,"wb")) == NULL) {
+			printf("Can't open %s\n",outFile);
+			SMBCloseDevice();
+			exit(1);
+		}
+		if (format == FORMAT_PCAPNG) {
+			writePcapngHeader(f);
+		} else {
+			fwrite("SMBSNIFF\x01",9,1,f);
+			fwrite(&bus,1,1,f);
+		}
+	}
+
+	if ((events = malloc(EVENTS * sizeof(struct smb_sniff_event))) == NULL) {
+		printf("Out of memory\n");
+		SMBCloseDevice();
+		exit(1);
+	}
+
+	signal(SIGINT,onSignal);
+	base = (unsigned long long)time(NULL) * 1000000000ULL;
+
+	if ((status = SMBSniffStart(bus)) < 0) {
+		printf("Error: %s\n",SMBGetErrorString(status));
+		SMBCloseDevice();
+		exit(1);
+	}
+	printf("Sniffing bus %d, Ctrl-C to stop\n",bus);
+
+	while (!stop && (!count || total < count)) {
+		status = SMBSniffRead(events, EVENTS, 100);
+		if (status < 0) {
+			printf("Error: %s\n",SMBGetErrorString(status));
+			break;
+		}
+		if (count && total + status > count) status = count - total;
+		for (i=0;i<status;i++) {
+			switch (format) {
+				case FORMAT_TEXT:
+					printEvent(&events[i]);
+					break;
+				case FORMAT_PCAPNG:
+					collectEvent(f,bus,base,&events[i]);
+					break;
+				case FORMAT_LOG:
+					writeLogEvent(f,&events[i]);
+					break;
+			}
+		}
+		total += status;
+		if (format == FORMAT_TEXT) fflush(stdout);
+	}
+
+	SMBSniffStop();
+	if (f != NULL) {
+		if (format == FORMAT_PCAPNG && msgLen) writePcapngMessage(f,bus,base+msgTime,msg,msgLen);
+		fclose(f);
+	}
+	printf("\n%llu events\n",total);
+
+	free(events);
+	SMBCloseDevice();
+	return 0;
+}